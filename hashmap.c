@@ -7,6 +7,11 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stddef.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
 #include "hashmap.h"
 
 static void *(*_malloc)(size_t) = NULL;
@@ -32,6 +37,15 @@ struct bucket {
     uint64_t dib:16;
 };
 
+// cbucket is the bucket header of a compact map, see hashmap_set_compact.
+struct cbucket {
+    uint32_t fp:24;   // bits 24..47 of the hash
+    uint32_t dib:8;
+};
+
+#define CB_MAXDIB   255
+#define CB_SPREAD   64      // buckets per item before a grow gives up
+
 // hashmap is an open addressed hash map using robinhood hashing.
 struct hashmap {
     void *(*malloc)(size_t);
@@ -53,10 +67,37 @@ struct hashmap {
     size_t growat;
     size_t shrinkat;
     void *buckets;
+    uint64_t *used;   // occupancy bitmap, one bit per bucket, after buckets
     void *spare;
     void *edata;
+    struct hashmap_snapshot *snap;
+    int resizers;     // threads that split a grow, see hashmap_set_resizers
+    bool compact;     // cbucket headers, see hashmap_set_compact
+#ifdef TTLMAP_STATS
+    struct hashmap_stats stats;
+#endif
 };
 
+#ifdef TTLMAP_STATS
+#define STAT_ADD(map, field, n) ((map)->stats.field += (n))
+static uint64_t stat_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000+ts.tv_nsec;
+}
+static void stat_probe(struct hashmap_stats *stats, size_t probes, bool hit) {
+    stats->gets++;
+    if (hit) stats->hits++; else stats->misses++;
+    stats->probes += probes;
+    stats->probe_hist[probes <= HASHMAP_PROBE_HIST ? 
+                      probes-1 : HASHMAP_PROBE_HIST-1]++;
+}
+#define STAT_PROBE(map, probes, hit) stat_probe(&(map)->stats, (probes), (hit))
+#else
+#define STAT_ADD(map, field, n) do {} while (0)
+#define STAT_PROBE(map, probes, hit) ((void)(probes))
+#endif
+
 static struct bucket *bucket_at(struct hashmap *map, size_t index) {
     return (struct bucket*)(((char*)map->buckets)+(map->bucketsz*index));
 }
@@ -65,28 +106,171 @@ static void *bucket_item(struct bucket *entry) {
     return ((char*)entry)+sizeof(struct bucket);
 }
 
+// The entry_* functions read buckets of either layout. The probe loops of
+// get, set and delete have their own copy for compact maps instead.
+static size_t entry_dib(struct hashmap *map, const void *bucket) {
+    return map->compact ? ((const struct cbucket*)bucket)->dib :
+                          ((const struct bucket*)bucket)->dib;
+}
+
+static void entry_set_dib(struct hashmap *map, void *bucket, size_t dib) {
+    if (map->compact) {
+        ((struct cbucket*)bucket)->dib = dib;
+    } else {
+        ((struct bucket*)bucket)->dib = dib;
+    }
+}
+
+static void *entry_item(struct hashmap *map, void *bucket) {
+    return (char*)bucket+(map->compact ? sizeof(struct cbucket) : 
+                                         sizeof(struct bucket));
+}
+
+static void *item_at(struct hashmap *map, size_t index) {
+    return entry_item(map, bucket_at(map, index));
+}
+
+static size_t bucket_size(size_t elsize, bool compact) {
+    size_t bucketsz, align;
+    if (compact) {
+        bucketsz = sizeof(struct cbucket) + elsize;
+        align = sizeof(uint32_t);
+    } else {
+        bucketsz = sizeof(struct bucket) + elsize;
+        align = sizeof(uintptr_t);
+    }
+    while (bucketsz & (align-1)) {
+        bucketsz++;
+    }
+    return bucketsz;
+}
+
+// The bucket array is allocated together with a bitmap that has a bit set
+// for every occupied bucket. Scans read the bitmap and skip over empty
+// buckets 64 at a time, instead of loading every bucket to test its dib.
+static size_t used_words(size_t nbuckets) {
+    return (nbuckets+63)/64;
+}
+
+static size_t table_size(size_t bucketsz, size_t nbuckets) {
+    return bucketsz*nbuckets+used_words(nbuckets)*sizeof(uint64_t);
+}
+
+static uint64_t *table_used(void *buckets, size_t bucketsz, size_t nbuckets) {
+    return (uint64_t*)((char*)buckets+bucketsz*nbuckets);
+}
+
+static void used_set(struct hashmap *map, size_t i) {
+    map->used[i>>6] |= (uint64_t)1<<(i&63);
+}
+
+static void used_clear(struct hashmap *map, size_t i) {
+    map->used[i>>6] &= ~((uint64_t)1<<(i&63));
+}
+
+// used_rebuild sets the bitmap from the dib of every bucket.
+static void used_rebuild(struct hashmap *map) {
+    memset(map->used, 0, used_words(map->nbuckets)*sizeof(uint64_t));
+    for (size_t i = 0; i < map->nbuckets; i++) {
+        if (entry_dib(map, bucket_at(map, i))) {
+            used_set(map, i);
+        }
+    }
+}
+
+// next_used returns the first occupied bucket at or after i, or nbuckets if
+// there is none.
+static size_t next_used(struct hashmap *map, size_t i) {
+    if (i >= map->nbuckets) {
+        return map->nbuckets;
+    }
+    size_t w = i>>6, nwords = used_words(map->nbuckets);
+    uint64_t bits = map->used[w] & (~(uint64_t)0<<(i&63));
+    while (!bits) {
+        if (++w == nwords) {
+            return map->nbuckets;
+        }
+        bits = map->used[w];
+    }
+    return w<<6 | __builtin_ctzll(bits);
+}
+
 static uint64_t get_hash(struct hashmap *map, const void *key) {
     return map->hash(key, map->seed0, map->seed1) << 16 >> 16;
 }
 
-// hashmap_new_with_allocator returns a new hash map using a custom allocator.
-// See hashmap_new for more information information
-struct hashmap *hashmap_new_with_allocator(
-                            void *(*_malloc)(size_t), 
-                            void *(*_realloc)(void*, size_t), 
-                            void (*_free)(void*),
-                            size_t elsize, size_t cap, 
-                            uint64_t seed0, uint64_t seed1,
-                            uint64_t (*hash)(const void *item, 
-                                             uint64_t seed0, uint64_t seed1),
-                            int (*compare)(const void *a, const void *b, 
-                                           void *udata),
-                            void (*elfree)(void *item),
-                            void *udata)
+//-----------------------------------------------------------------------------
+// Copy-on-write snapshots
+//
+// While a snapshot is open, the buckets are tracked in chunks. The first write
+// to a chunk that the snapshot has not emitted yet saves a copy of that chunk,
+// so the snapshot always emits the table as it was when it was started. An
+// operation that replaces the whole table detaches the snapshot by saving all
+// of the remaining chunks.
+//-----------------------------------------------------------------------------
+#define SNAP_CHUNK 256
+
+struct hashmap_snapshot {
+    size_t nbuckets;
+    size_t bucketsz;
+    size_t count;
+    size_t chunk;     // buckets per chunk
+    size_t cursor;    // next bucket to emit
+    bool detached;    // the map no longer uses the snapshotted table
+    bool failed;      // a chunk could not be saved
+    void *buckets;    // the snapshotted table, while not detached
+    void **saved;     // per chunk copy taken before the first write
+};
+
+// snap_touch must be called before the bucket at index i is written. When the
+// chunk can't be copied, the snapshot is marked as failed instead of failing
+// the write.
+static void snap_touch(struct hashmap *map, size_t i) {
+    struct hashmap_snapshot *snap = map->snap;
+    if (snap->detached || snap->failed) {
+        return;
+    }
+    size_t c = i/snap->chunk;
+    if ((c+1)*snap->chunk <= snap->cursor || snap->saved[c]) {
+        return;
+    }
+    size_t len = snap->chunk*snap->bucketsz;
+    snap->saved[c] = map->malloc(len);
+    if (!snap->saved[c]) {
+        snap->failed = true;
+        return;
+    }
+    memcpy(snap->saved[c], (char*)snap->buckets+c*len, len);
+}
+
+// snap_detach must be called before the table is replaced or cleared.
+static void snap_detach(struct hashmap *map) {
+    struct hashmap_snapshot *snap = map->snap;
+    if (!snap || snap->detached) {
+        return;
+    }
+    size_t nchunks = snap->nbuckets/snap->chunk;
+    for (size_t c = snap->cursor/snap->chunk; c < nchunks; c++) {
+        snap_touch(map, c*snap->chunk);
+    }
+    snap->detached = true;
+    snap->buckets = NULL;
+}
+
+#define SNAP_TOUCH(map, i) { if ((map)->snap) snap_touch((map), (i)); }
+
+static struct hashmap *new_map(void *(*_malloc)(size_t), 
+                              void *(*_realloc)(void*, size_t), 
+                              void (*_free)(void*),
+                              size_t elsize, size_t cap, 
+                              uint64_t seed0, uint64_t seed1,
+                              uint64_t (*hash)(const void *item, 
+                                               uint64_t seed0, uint64_t seed1),
+                              int (*compare)(const void *a, const void *b, 
+                                             void *udata),
+                              void (*elfree)(void *item),
+                              void *udata, bool compact)
 {
-    _malloc = _malloc ? _malloc : malloc;
-    _realloc = _realloc ? _realloc : realloc;
-    _free = _free ? _free : free;
     int ncap = 16;
     if (cap < ncap) {
         cap = ncap;
@@ -96,10 +280,7 @@ struct hashmap *hashmap_new_with_allocator(
         }
         cap = ncap;
     }
-    size_t bucketsz = sizeof(struct bucket) + elsize;
-    while (bucketsz & (sizeof(uintptr_t)-1)) {
-        bucketsz++;
-    }
+    size_t bucketsz = bucket_size(elsize, compact);
     // hashmap + spare + edata
     size_t size = sizeof(struct hashmap)+bucketsz*2;
     struct hashmap *map = _malloc(size);
@@ -115,17 +296,19 @@ struct hashmap *hashmap_new_with_allocator(
     map->compare = compare;
     map->elfree = elfree;
     map->udata = udata;
+    map->compact = compact;
     map->spare = ((char*)map)+sizeof(struct hashmap);
     map->edata = (char*)map->spare+bucketsz;
     map->cap = cap;
     map->nbuckets = cap;
     map->mask = map->nbuckets-1;
-    map->buckets = _malloc(map->bucketsz*map->nbuckets);
+    map->buckets = _malloc(table_size(map->bucketsz, map->nbuckets));
     if (!map->buckets) {
         _free(map);
         return NULL;
     }
-    memset(map->buckets, 0, map->bucketsz*map->nbuckets);
+    memset(map->buckets, 0, table_size(map->bucketsz, map->nbuckets));
+    map->used = table_used(map->buckets, map->bucketsz, map->nbuckets);
     map->growat = map->nbuckets*0.75;
     map->shrinkat = map->nbuckets*0.10;
     map->malloc = _malloc;
@@ -134,6 +317,28 @@ struct hashmap *hashmap_new_with_allocator(
     return map;  
 }
 
+// hashmap_new_with_allocator returns a new hash map using a custom allocator.
+// See hashmap_new for more information information
+struct hashmap *hashmap_new_with_allocator(
+                            void *(*_malloc)(size_t), 
+                            void *(*_realloc)(void*, size_t), 
+                            void (*_free)(void*),
+                            size_t elsize, size_t cap, 
+                            uint64_t seed0, uint64_t seed1,
+                            uint64_t (*hash)(const void *item, 
+                                             uint64_t seed0, uint64_t seed1),
+                            int (*compare)(const void *a, const void *b, 
+                                           void *udata),
+                            void (*elfree)(void *item),
+                            void *udata)
+{
+    _malloc = _malloc ? _malloc : malloc;
+    _realloc = _realloc ? _realloc : realloc;
+    _free = _free ? _free : free;
+    return new_map(_malloc, _realloc, _free, elsize, cap, seed0, seed1, hash,
+                   compare, elfree, udata, false);
+}
+
 
 // hashmap_new returns a new hash map. 
 // Param `elsize` is the size of each element in the tree. Every element that
@@ -171,9 +376,10 @@ struct hashmap *hashmap_new(size_t elsize, size_t cap,
 
 static void free_elements(struct hashmap *map) {
     if (map->elfree) {
-        for (size_t i = 0; i < map->nbuckets; i++) {
-            struct bucket *bucket = bucket_at(map, i);
-            if (bucket->dib) map->elfree(bucket_item(bucket));
+        for (size_t i = next_used(map, 0); i < map->nbuckets;
+             i = next_used(map, i+1))
+        {
+            map->elfree(item_at(map, i));
         }
     }
 }
@@ -186,131 +392,626 @@ static void free_elements(struct hashmap *map) {
 // the currently number of allocated buckets. This is an optimization to ensure
 // that this operation does not perform any allocations.
 void hashmap_clear(struct hashmap *map, bool update_cap) {
+    snap_detach(map);
     map->count = 0;
     free_elements(map);
     if (update_cap) {
         map->cap = map->nbuckets;
     } else if (map->nbuckets != map->cap) {
-        void *new_buckets = map->malloc(map->bucketsz*map->cap);
+        void *new_buckets = map->malloc(table_size(map->bucketsz, map->cap));
         if (new_buckets) {
             map->free(map->buckets);
             map->buckets = new_buckets;
+            map->nbuckets = map->cap;
         }
-        map->nbuckets = map->cap;
     }
-    memset(map->buckets, 0, map->bucketsz*map->nbuckets);
+    memset(map->buckets, 0, table_size(map->bucketsz, map->nbuckets));
+    map->used = table_used(map->buckets, map->bucketsz, map->nbuckets);
     map->mask = map->nbuckets-1;
     map->growat = map->nbuckets*0.75;
     map->shrinkat = map->nbuckets*0.10;
 }
 
 
-static bool resize(struct hashmap *map, size_t new_cap) {
-    struct hashmap *map2 = hashmap_new(map->elsize, new_cap, map->seed1, 
-                                       map->seed1, map->hash, map->compare,
-                                       map->elfree, map->udata);
-    if (!map2) {
-        return false;
+// place continues the probe of entry at bucket j of a table being built by
+// resize, swapping it with richer entries on the way.
+static void place(struct hashmap *map2, struct bucket *entry, size_t j) {
+    for (;;) {
+        struct bucket *bucket = bucket_at(map2, j);
+        if (bucket->dib == 0) {
+            memcpy(bucket, entry, map2->bucketsz);
+            used_set(map2, j);
+            break;
+        }
+        if (bucket->dib < entry->dib) {
+            memcpy(map2->spare, bucket, map2->bucketsz);
+            memcpy(bucket, entry, map2->bucketsz);
+            memcpy(entry, map2->spare, map2->bucketsz);
+        }
+        j = (j + 1) & map2->mask;
+        entry->dib += 1;
     }
-    for (size_t i = 0; i < map->nbuckets; i++) {
-        struct bucket *entry = bucket_at(map, i);
-        if (!entry->dib) {
+}
+
+// cplace is place for a compact table. Returns false when the entry would be
+// pushed past the largest dib.
+static bool cplace(struct hashmap *map2, struct cbucket *entry, size_t j) {
+    for (;;) {
+        struct cbucket *bucket = (struct cbucket*)bucket_at(map2, j);
+        if (bucket->dib == 0) {
+            memcpy(bucket, entry, map2->bucketsz);
+            used_set(map2, j);
+            return true;
+        }
+        if (bucket->dib < entry->dib) {
+            memcpy(map2->spare, bucket, map2->bucketsz);
+            memcpy(bucket, entry, map2->bucketsz);
+            memcpy(entry, map2->spare, map2->bucketsz);
+        }
+        if (entry->dib == CB_MAXDIB) {
+            return false;
+        }
+        j = (j + 1) & map2->mask;
+        entry->dib += 1;
+    }
+}
+
+// cresize fills map2 with the items of a compact map. The home bucket is not
+// kept in a compact header, so every item is hashed again. The old table is
+// left as it is, and false is returned, when a dib would overflow.
+static bool cresize(struct hashmap *map, struct hashmap *map2) {
+    struct cbucket *entry = map->edata;
+    for (size_t i = next_used(map, 0); i < map->nbuckets;
+         i = next_used(map, i+1))
+    {
+        memcpy(entry, bucket_at(map, i), map->bucketsz);
+        entry->dib = 1;
+        uint64_t hash = get_hash(map, entry_item(map, entry));
+        if (!cplace(map2, entry, hash & map2->mask)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+// Parallel resize
+//
+// Doubling a large table is split over helper threads by ranges of the old
+// table. A helper moves the items whose home bucket is in its range [a,b).
+// These land in [a,b) or [a+n,b+n) of the new table, and the helper never
+// writes outside of these two ranges. An item that would be pushed past the
+// end of a range is set aside with its current dib. Once all helpers are
+// done, the caller places the set aside items, continuing their probes where
+// the helpers stopped. The old table is only read, so when a helper runs out
+// of room for set aside items the resize starts over sequentially. Ranges
+// start at multiples of 64, so no two helpers share a word of the occupancy
+// bitmap.
+//-----------------------------------------------------------------------------
+#define RESIZE_PAR_MIN  65536   // buckets before a grow is split
+#define RESIZE_ASIDE    256     // set aside items per helper
+
+struct resize_part {
+    pthread_t tid;
+    bool started;
+    struct hashmap *map;
+    struct hashmap *map2;
+    size_t a, b;
+    char *aside;      // RESIZE_ASIDE buckets, followed by entry and spare
+    size_t naside;
+    bool failed;
+};
+
+static void resize_put(struct resize_part *part, struct bucket *entry,
+                       size_t end)
+{
+    struct hashmap *map2 = part->map2;
+    size_t bucketsz = map2->bucketsz;
+    char *spare = part->aside+(RESIZE_ASIDE+1)*bucketsz;
+    for (size_t j = entry->hash & map2->mask; ; j++, entry->dib++) {
+        if (j == end) {
+            if (part->naside == RESIZE_ASIDE) {
+                part->failed = true;
+                return;
+            }
+            memcpy(part->aside+part->naside*bucketsz, entry, bucketsz);
+            part->naside++;
+            return;
+        }
+        struct bucket *bucket = bucket_at(map2, j);
+        if (bucket->dib == 0) {
+            memcpy(bucket, entry, bucketsz);
+            used_set(map2, j);
+            return;
+        }
+        if (bucket->dib < entry->dib) {
+            memcpy(spare, bucket, bucketsz);
+            memcpy(bucket, entry, bucketsz);
+            memcpy(entry, spare, bucketsz);
+        }
+    }
+}
+
+static void *resize_run(void *arg) {
+    struct resize_part *part = arg;
+    struct hashmap *map = part->map;
+    size_t n = map->nbuckets;
+    struct bucket *entry = 
+        (struct bucket*)(part->aside+RESIZE_ASIDE*map->bucketsz);
+    // the cluster running over the end of the range may still hold items
+    // of the range, so scan on to the next empty bucket
+    for (size_t i = part->a; i < part->a+n && !part->failed; i++) {
+        struct bucket *bucket = bucket_at(map, i & map->mask);
+        if (!bucket->dib) {
+            if (i >= part->b) break;
+            continue;
+        }
+        size_t home = (i-(bucket->dib-1)) & map->mask;
+        if (home < part->a || home >= part->b) {
             continue;
         }
+        memcpy(entry, bucket, map->bucketsz);
         entry->dib = 1;
-        size_t j = entry->hash & map2->mask;
-        for (;;) {
-            struct bucket *bucket = bucket_at(map2, j);
-            if (bucket->dib == 0) {
-                memcpy(bucket, entry, map->bucketsz);
-                break;
+        resize_put(part, entry, 
+                   (entry->hash & part->map2->mask) < n ? part->b : part->b+n);
+    }
+    return NULL;
+}
+
+// resize_parallel fills map2, which is twice the size of map, using
+// map->resizers threads including the caller. Returns false when the table
+// must be filled sequentially instead.
+static bool resize_parallel(struct hashmap *map, struct hashmap *map2) {
+    size_t nparts = map->resizers, per = map->nbuckets/nparts & ~(size_t)63, i;
+    size_t asidesz = (RESIZE_ASIDE+2)*map->bucketsz;
+    struct resize_part *parts = map->malloc(sizeof(struct resize_part)*nparts);
+    bool ok = true;
+    if (!parts) {
+        return false;
+    }
+    memset(parts, 0, sizeof(struct resize_part)*nparts);
+    for (i = 0; i < nparts; i++) {
+        parts[i].map = map;
+        parts[i].map2 = map2;
+        parts[i].a = i*per;
+        parts[i].b = i == nparts-1 ? map->nbuckets : (i+1)*per;
+        parts[i].aside = map->malloc(asidesz);
+        if (!parts[i].aside) {
+            ok = false;
+            break;
+        }
+    }
+    if (ok) {
+        for (i = 1; i < nparts; i++) {
+            parts[i].started = pthread_create(&parts[i].tid, NULL, resize_run,
+                                              &parts[i]) == 0;
+        }
+        for (i = 0; i < nparts; i++) {
+            if (!parts[i].started) {
+                resize_run(&parts[i]);
             }
-            if (bucket->dib < entry->dib) {
-                memcpy(map2->spare, bucket, map->bucketsz);
-                memcpy(bucket, entry, map->bucketsz);
-                memcpy(entry, map2->spare, map->bucketsz);
+        }
+        for (i = 1; i < nparts; i++) {
+            if (parts[i].started) {
+                pthread_join(parts[i].tid, NULL);
             }
-            j = (j + 1) & map2->mask;
-            entry->dib += 1;
+            ok = ok && !parts[i].failed;
+        }
+        ok = ok && !parts[0].failed;
+    }
+    for (i = 0; i < nparts && parts[i].aside; i++) {
+        for (size_t k = 0; ok && k < parts[i].naside; k++) {
+            struct bucket *entry = 
+                (struct bucket*)(parts[i].aside+k*map->bucketsz);
+            place(map2, entry, 
+                  ((entry->hash & map2->mask)+entry->dib-1) & map2->mask);
+        }
+        map->free(parts[i].aside);
+    }
+    map->free(parts);
+    return ok;
+}
+
+static bool resize(struct hashmap *map, size_t new_cap) {
+#ifdef TTLMAP_STATS
+    uint64_t start = stat_now();
+#endif
+    struct hashmap *map2 = new_map(map->malloc, map->realloc, map->free,
+                                   map->elsize, new_cap, map->seed0,
+                                   map->seed1, map->hash, map->compare,
+                                   map->elfree, map->udata, map->compact);
+    if (!map2) {
+        return false;
+    }
+    snap_detach(map);
+    if (map->compact) {
+        if (cresize(map, map2)) {
+            goto done;
+        }
+        map->free(map2->buckets);
+        map->free(map2);
+        // a larger table spreads the long cluster over more homes, but
+        // don't let a poor hash function grow it without bound
+        return new_cap > map->nbuckets && new_cap/CB_SPREAD <= map->count &&
+               resize(map, new_cap*2);
+    }
+    if (map->resizers > 1 && map->nbuckets >= RESIZE_PAR_MIN && 
+        new_cap == map->nbuckets*2)
+    {
+        if (resize_parallel(map, map2)) {
+            goto done;
         }
+        memset(map2->buckets, 0, table_size(map2->bucketsz, map2->nbuckets));
+    }
+    for (size_t i = next_used(map, 0); i < map->nbuckets;
+         i = next_used(map, i+1))
+    {
+        struct bucket *entry = bucket_at(map, i);
+        entry->dib = 1;
+        place(map2, entry, entry->hash & map2->mask);
 	}
+done:
     map->free(map->buckets);
     map->buckets = map2->buckets;
+    map->used = map2->used;
     map->nbuckets = map2->nbuckets;
     map->mask = map2->mask;
     map->growat = map2->growat;
     map->shrinkat = map2->shrinkat;
     map->free(map2);
+    STAT_ADD(map, resizes, 1);
+    STAT_ADD(map, resize_ns, stat_now()-start);
     return true;
 }
 
-// hashmap_set inserts or replaces an item in the hash map. If an item is
-// replaced then it is returned otherwise NULL is returned. This operation
-// may allocate memory. If the system is unable to allocate additional
-// memory then NULL is returned and hashmap_oom() returns true.
-void *hashmap_set(struct hashmap *map, const void *item) {
-    if (!item) {
-        panic("item is null");
-    }
-    map->oom = false;
-    if (map->count == map->growat) {
+// hashmap_set_resizers lets a grow of a large map (RESIZE_PAR_MIN buckets or
+// more) move the items with `nthreads` threads, the caller and nthreads-1
+// helpers that are started for the grow. Values below 2 keep resizes
+// sequential, which is the default.
+void hashmap_set_resizers(struct hashmap *map, int nthreads) {
+    map->resizers = nthreads;
+}
+
+//-----------------------------------------------------------------------------
+// Compact buckets
+//
+// A compact map has a 4 byte bucket header, 24 bits of the hash and an 8 bit
+// dib, and rounds its buckets up to 4 bytes instead of 8, so a bucket of a 4
+// byte element takes 8 bytes instead of 16, and one of an 8 byte element 12
+// instead of 16. The stored hash bits are above the ones that pick the home
+// bucket of tables up to 16M buckets. They only save compare calls, and a
+// resize hashes the items again. An insert that would push a dib past 255
+// grows the table first.
+//-----------------------------------------------------------------------------
+
+static struct cbucket *cbucket_at(struct hashmap *map, size_t index) {
+    return (struct cbucket*)bucket_at(map, index);
+}
+
+static void *cbucket_item(struct cbucket *entry) {
+    return ((char*)entry)+sizeof(struct cbucket);
+}
+
+static uint32_t cbucket_fp(uint64_t hash) {
+    return hash >> 24;
+}
+
+// cslot returns the bucket of key in a compact map. When the key is not in
+// the map, a bucket is made for it as hashmap_upsert does. Returns NULL when
+// the table could not grow.
+static struct cbucket *cslot(struct hashmap *map, const void *key,
+                             bool *found)
+{
+    if (map->count >= map->growat) {
         if (!resize(map, map->nbuckets*2)) {
-            map->oom = true;
             return NULL;
         }
     }
-
-    
-    struct bucket *entry = map->edata;
-    entry->hash = get_hash(map, item);
-    entry->dib = 1;
-    memcpy(bucket_item(entry), item, map->elsize);
-    
-    size_t i = entry->hash & map->mask;
-	for (;;) {
-        struct bucket *bucket = bucket_at(map, i);
-        if (bucket->dib == 0) {
-            memcpy(bucket, entry, map->bucketsz);
-            map->count++;
-			return NULL;
-		}
-        if (entry->hash == bucket->hash && 
-            map->compare(bucket_item(entry), bucket_item(bucket), 
-                         map->udata) == 0)
-        {
-            memcpy(map->spare, bucket_item(bucket), map->elsize);
-            memcpy(bucket_item(bucket), bucket_item(entry), map->elsize);
-            return map->spare;
-		}
-        if (bucket->dib < entry->dib) {
-            memcpy(map->spare, bucket, map->bucketsz);
-            memcpy(bucket, entry, map->bucketsz);
-            memcpy(entry, map->spare, map->bucketsz);
-		}
-		i = (i + 1) & map->mask;
-        entry->dib += 1;
-	}
+    uint64_t hash = get_hash(map, key);
+    uint32_t fp = cbucket_fp(hash);
+    for (;;) {
+        size_t i = hash & map->mask;
+        size_t dib = 1;
+        for (;; dib++) {
+            struct cbucket *bucket = cbucket_at(map, i);
+            if (bucket->dib < dib) {
+                break;
+            }
+            if (bucket->fp == fp &&
+                map->compare(key, cbucket_item(bucket), map->udata) == 0)
+            {
+                SNAP_TOUCH(map, i);
+                *found = true;
+                return bucket;
+            }
+            i = (i + 1) & map->mask;
+        }
+        // the rest of the cluster moves one bucket up, so none of it may
+        // already be at the largest dib
+        size_t j = i, maxdib = dib;
+        for (; cbucket_at(map, j)->dib; j = (j + 1) & map->mask) {
+            size_t moved = cbucket_at(map, j)->dib+1;
+            if (moved > maxdib) {
+                maxdib = moved;
+            }
+        }
+        if (maxdib > CB_MAXDIB) {
+            if (!resize(map, map->nbuckets*2)) {
+                return NULL;
+            }
+            continue;
+        }
+        used_set(map, j);
+        for (; j != i; j = (j - 1) & map->mask) {
+            struct cbucket *bucket = cbucket_at(map, j);
+            SNAP_TOUCH(map, j);
+            memcpy(bucket, cbucket_at(map, (j - 1) & map->mask), 
+                   map->bucketsz);
+            bucket->dib++;
+        }
+        SNAP_TOUCH(map, i);
+        struct cbucket *bucket = cbucket_at(map, i);
+        bucket->fp = fp;
+        bucket->dib = dib;
+        map->count++;
+        *found = false;
+        return bucket;
+    }
 }
 
-// hashmap_get returns the item based on the provided key. If the item is not
-// found then NULL is returned.
-void *hashmap_get(struct hashmap *map, const void *key) {
-    if (!key) {
-        panic("key is null");
+static void *cset(struct hashmap *map, const void *item) {
+    bool found;
+    struct cbucket *bucket = cslot(map, item, &found);
+    if (!bucket) {
+        map->oom = true;
+        return NULL;
+    }
+    if (found) {
+        memcpy(map->spare, cbucket_item(bucket), map->elsize);
+        memcpy(cbucket_item(bucket), item, map->elsize);
+        return map->spare;
     }
+    memcpy(cbucket_item(bucket), item, map->elsize);
+    return NULL;
+}
+
+static void *cget(struct hashmap *map, const void *key) {
     uint64_t hash = get_hash(map, key);
-	size_t i = hash & map->mask;
-	for (;;) {
+    uint32_t fp = cbucket_fp(hash);
+    size_t i = hash & map->mask;
+    size_t probes = 1;
+    for (;;) {
+        struct cbucket *bucket = cbucket_at(map, i);
+        if (!bucket->dib) {
+            STAT_PROBE(map, probes, false);
+            return NULL;
+        }
+        if (bucket->fp == fp &&
+            map->compare(key, cbucket_item(bucket), map->udata) == 0)
+        {
+            STAT_PROBE(map, probes, true);
+            return cbucket_item(bucket);
+        }
+        i = (i + 1) & map->mask;
+        probes++;
+    }
+}
+
+static void *cdelete(struct hashmap *map, const void *key) {
+    uint64_t hash = get_hash(map, key);
+    uint32_t fp = cbucket_fp(hash);
+    size_t i = hash & map->mask;
+    for (;;) {
+        struct cbucket *bucket = cbucket_at(map, i);
+        if (!bucket->dib) {
+            return NULL;
+        }
+        if (bucket->fp == fp &&
+            map->compare(key, cbucket_item(bucket), map->udata) == 0)
+        {
+            memcpy(map->spare, cbucket_item(bucket), map->elsize);
+            SNAP_TOUCH(map, i);
+            bucket->dib = 0;
+            for (;;) {
+                struct cbucket *prev = bucket;
+                i = (i + 1) & map->mask;
+                bucket = cbucket_at(map, i);
+                if (bucket->dib <= 1) {
+                    prev->dib = 0;
+                    used_clear(map, (i - 1) & map->mask);
+                    break;
+                }
+                SNAP_TOUCH(map, i);
+                memcpy(prev, bucket, map->bucketsz);
+                prev->dib--;
+            }
+            map->count--;
+            if (map->nbuckets > map->cap && map->count <= map->shrinkat) {
+                // a failed shrink leaves the map as it is
+                resize(map, map->nbuckets/2);
+            }
+            return map->spare;
+        }
+        i = (i + 1) & map->mask;
+    }
+}
+
+// hashmap_set_compact switches an empty map to compact buckets, which have a
+// 4 byte header instead of 8 and are only 4 byte aligned. This suits maps of
+// small elements, such as counters, where the header is a large part of each
+// bucket: more of them fit in a cache line. Elements are then only 4 byte
+// aligned, and a grow always runs on the caller's thread. Returns false if
+// the map is not empty, has an open snapshot, or the system is unable to
+// allocate memory.
+bool hashmap_set_compact(struct hashmap *map) {
+    map->oom = false;
+    if (map->compact) {
+        return true;
+    }
+    if (map->count || map->snap) {
+        return false;
+    }
+    size_t bucketsz = bucket_size(map->elsize, true);
+    void *buckets = map->malloc(table_size(bucketsz, map->nbuckets));
+    if (!buckets) {
+        map->oom = true;
+        return false;
+    }
+    memset(buckets, 0, table_size(bucketsz, map->nbuckets));
+    map->free(map->buckets);
+    map->buckets = buckets;
+    map->bucketsz = bucketsz;
+    map->used = table_used(buckets, bucketsz, map->nbuckets);
+    map->compact = true;
+    return true;
+}
+
+// hashmap_set inserts or replaces an item in the hash map. If an item is
+// replaced then it is returned otherwise NULL is returned. This operation
+// may allocate memory. If the system is unable to allocate additional
+// memory then NULL is returned and hashmap_oom() returns true.
+void *hashmap_set(struct hashmap *map, const void *item) {
+    if (!item) {
+        panic("item is null");
+    }
+    map->oom = false;
+    if (map->compact) {
+        return cset(map, item);
+    }
+    if (map->count >= map->growat) {
+        if (!resize(map, map->nbuckets*2)) {
+            map->oom = true;
+            return NULL;
+        }
+    }
+
+    
+    struct bucket *entry = map->edata;
+    entry->hash = get_hash(map, item);
+    entry->dib = 1;
+    memcpy(bucket_item(entry), item, map->elsize);
+    
+    size_t i = entry->hash & map->mask;
+	for (;;) {
+        struct bucket *bucket = bucket_at(map, i);
+        if (bucket->dib == 0) {
+            SNAP_TOUCH(map, i);
+            memcpy(bucket, entry, map->bucketsz);
+            used_set(map, i);
+            map->count++;
+			return NULL;
+		}
+        if (entry->hash == bucket->hash && 
+            map->compare(bucket_item(entry), bucket_item(bucket), 
+                         map->udata) == 0)
+        {
+            SNAP_TOUCH(map, i);
+            memcpy(map->spare, bucket_item(bucket), map->elsize);
+            memcpy(bucket_item(bucket), bucket_item(entry), map->elsize);
+            return map->spare;
+		}
+        if (bucket->dib < entry->dib) {
+            SNAP_TOUCH(map, i);
+            memcpy(map->spare, bucket, map->bucketsz);
+            memcpy(bucket, entry, map->bucketsz);
+            memcpy(entry, map->spare, map->bucketsz);
+		}
+		i = (i + 1) & map->mask;
+        entry->dib += 1;
+	}
+}
+
+// hashmap_upsert returns the item of `key` for the caller to write into. When
+// the key is not in the map, `found` is set to false and a bucket is made for
+// it, holding an item that the caller must fill in completely, key included,
+// before the map is used again. The key only needs to hold what the hash and
+// compare functions read, so the rest of a new item is copied only once,
+// straight into the table. Returns NULL when the system is unable to allocate
+// memory, and hashmap_oom() then returns true.
+void *hashmap_upsert(struct hashmap *map, const void *key, bool *found) {
+    if (!key) {
+        panic("key is null");
+    }
+    map->oom = false;
+    if (map->compact) {
+        struct cbucket *bucket = cslot(map, key, found);
+        if (!bucket) {
+            map->oom = true;
+            return NULL;
+        }
+        return cbucket_item(bucket);
+    }
+    if (map->count >= map->growat) {
+        if (!resize(map, map->nbuckets*2)) {
+            map->oom = true;
+            return NULL;
+        }
+    }
+    uint64_t hash = get_hash(map, key);
+    size_t i = hash & map->mask;
+    size_t dib = 1;
+    for (;; dib++) {
+        struct bucket *bucket = bucket_at(map, i);
+        if (bucket->dib < dib) {
+            break;
+        }
+        if (bucket->hash == hash &&
+            map->compare(key, bucket_item(bucket), map->udata) == 0)
+        {
+            SNAP_TOUCH(map, i);
+            *found = true;
+            return bucket_item(bucket);
+        }
+        i = (i + 1) & map->mask;
+    }
+    // bucket i is where robin-hood insertion would put the key, so shift the
+    // rest of the cluster one bucket up
+    size_t j = i;
+    while (bucket_at(map, j)->dib) {
+        j = (j + 1) & map->mask;
+    }
+    used_set(map, j);
+    for (; j != i; j = (j - 1) & map->mask) {
+        struct bucket *bucket = bucket_at(map, j);
+        SNAP_TOUCH(map, j);
+        memcpy(bucket, bucket_at(map, (j - 1) & map->mask), map->bucketsz);
+        bucket->dib++;
+    }
+    SNAP_TOUCH(map, i);
+    struct bucket *bucket = bucket_at(map, i);
+    bucket->hash = hash;
+    bucket->dib = dib;
+    map->count++;
+    *found = false;
+    return bucket_item(bucket);
+}
+
+// hashmap_get returns the item based on the provided key. If the item is not
+// found then NULL is returned.
+void *hashmap_get(struct hashmap *map, const void *key) {
+    if (!key) {
+        panic("key is null");
+    }
+    if (map->compact) {
+        return cget(map, key);
+    }
+    uint64_t hash = get_hash(map, key);
+	size_t i = hash & map->mask;
+    size_t probes = 1;
+	for (;;) {
         struct bucket *bucket = bucket_at(map, i);
 		if (!bucket->dib) {
+            STAT_PROBE(map, probes, false);
 			return NULL;
 		}
 		if (bucket->hash == hash && 
             map->compare(key, bucket_item(bucket), map->udata) == 0)
         {
+            STAT_PROBE(map, probes, true);
             return bucket_item(bucket);
 		}
 		i = (i + 1) & map->mask;
+        probes++;
 	}
 }
 
@@ -320,10 +1021,10 @@ void *hashmap_get(struct hashmap *map, const void *key) {
 void *hashmap_probe(struct hashmap *map, uint64_t position) {
     size_t i = position & map->mask;
     struct bucket *bucket = bucket_at(map, i);
-    if (!bucket->dib) {
+    if (!entry_dib(map, bucket)) {
 		return NULL;
 	}
-    return bucket_item(bucket);
+    return entry_item(map, bucket);
 }
 
 
@@ -334,6 +1035,9 @@ void *hashmap_delete(struct hashmap *map, void *key) {
         panic("key is null");
     }
     map->oom = false;
+    if (map->compact) {
+        return cdelete(map, key);
+    }
     uint64_t hash = get_hash(map, key);
 	size_t i = hash & map->mask;
 	for (;;) {
@@ -345,6 +1049,7 @@ void *hashmap_delete(struct hashmap *map, void *key) {
             map->compare(key, bucket_item(bucket), map->udata) == 0)
         {
             memcpy(map->spare, bucket_item(bucket), map->elsize);
+            SNAP_TOUCH(map, i);
             bucket->dib = 0;
             for (;;) {
                 struct bucket *prev = bucket;
@@ -352,8 +1057,10 @@ void *hashmap_delete(struct hashmap *map, void *key) {
                 bucket = bucket_at(map, i);
                 if (bucket->dib <= 1) {
                     prev->dib = 0;
+                    used_clear(map, (i - 1) & map->mask);
                     break;
                 }
+                SNAP_TOUCH(map, i);
                 memcpy(prev, bucket, map->bucketsz);
                 prev->dib--;
             }
@@ -380,6 +1087,7 @@ size_t hashmap_count(struct hashmap *map) {
 // if present, to free any data referenced in the elements of the hashmap.
 void hashmap_free(struct hashmap *map) {
     if (!map) return;
+    hashmap_snapshot_end(map);
     free_elements(map);
     map->free(map->buckets);
     map->free(map);
@@ -391,59 +1099,2082 @@ bool hashmap_oom(struct hashmap *map) {
     return map->oom;
 }
 
-// hashmap_scan iterates over all items in the hash map
-// Param `iter` can return false to stop iteration early.
-// Returns false if the iteration has been stopped early.
-bool hashmap_scan(struct hashmap *map, 
-                  bool (*iter)(const void *item, void *udata), void *udata)
-{
-    for (size_t i = 0; i < map->nbuckets; i++) {
-        struct bucket *bucket = bucket_at(map, i);
-        if (bucket->dib) {
-            if (!iter(bucket_item(bucket), udata)) {
-                return false;
-            }
+// hashmap_scan iterates over all items in the hash map
+// Param `iter` can return false to stop iteration early.
+// Returns false if the iteration has been stopped early.
+bool hashmap_scan(struct hashmap *map, 
+                  bool (*iter)(const void *item, void *udata), void *udata)
+{
+    for (size_t i = next_used(map, 0); i < map->nbuckets;
+         i = next_used(map, i+1))
+    {
+        if (!iter(item_at(map, i), udata)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// cursor_rev reverses the bits of v.
+static size_t cursor_rev(size_t v) {
+    size_t s = 8*sizeof(v);
+    size_t mask = ~(size_t)0;
+    while ((s >>= 1) > 0) {
+        mask ^= (mask << s);
+        v = ((v >> s) & mask) | ((v << s) & ~mask);
+    }
+    return v;
+}
+
+// cursor_next returns the bucket after v for a table of mask+1 buckets. The
+// bucket index is incremented from its high bit down, as done by the SCAN
+// command of Redis. When a table doubles, bucket v is split into v and
+// v|(mask+1), and both come after the buckets already visited. When it
+// halves, the visited buckets merge into buckets that are still ahead at
+// most once, so items may be returned twice but never skipped.
+static size_t cursor_next(size_t v, size_t mask) {
+    v |= ~mask;
+    v = cursor_rev(v);
+    v++;
+    return cursor_rev(v);
+}
+
+// scan_home calls iter for each item whose home is bucket h. Robin-hood
+// insertion keeps the items of a cluster ordered by home, so they follow
+// the items pushed past h from earlier homes and end at the first bucket
+// that is empty or holds an item from a later home.
+static bool scan_home(struct hashmap *map, size_t h,
+                      bool (*iter)(const void *item, void *udata), void *udata)
+{
+    size_t i = h;
+    for (size_t dib = 1; ; dib++) {
+        struct bucket *bucket = bucket_at(map, i);
+        size_t bdib = entry_dib(map, bucket);
+        if (bdib < dib) {
+            return true;
+        }
+        if (bdib == dib && !iter(entry_item(map, bucket), udata)) {
+            return false;
+        }
+        i = (i + 1) & map->mask;
+    }
+}
+
+// hashmap_scan_cursor continues a scan at `cursor`, visiting the items of at
+// most `count` home buckets, and stores the cursor to continue from. A scan
+// starts with a cursor of 0. It returns 1 while there is more to scan and 0
+// once the scan is complete. The map may be changed, and resized, between
+// calls: every item that is in the map for the whole scan is visited at least
+// once, though an item may be visited twice when the table shrank. If `iter`
+// returns false the scan stops and -1 is returned. The cursor then stays at
+// the bucket it stopped in, so passing it again resumes the scan with that
+// bucket.
+int hashmap_scan_cursor(struct hashmap *map, size_t *cursor, size_t count,
+                        bool (*iter)(const void *item, void *udata),
+                        void *udata)
+{
+    size_t v = *cursor & map->mask;
+    if (count == 0) {
+        count = 1;
+    }
+    do {
+        if (!scan_home(map, v, iter, udata)) {
+            *cursor = v;
+            return -1;
+        }
+        v = cursor_next(v, map->mask);
+    } while (v != 0 && --count > 0);
+    *cursor = v;
+    return v != 0;
+}
+
+
+// hashmap_iter iterates one key at a time yielding a reference to an
+// entry at each iteration. Useful to write simple loops and avoid writing
+// dedicated callbacks and udata structures, as in hashmap_scan.
+//
+// map is a hash map handle. i is a pointer to a size_t cursor that
+// should be initialized to 0 at the beginning of the loop. item is a void
+// pointer pointer that is populated with the retrieved item. Note that this
+// is NOT a copy of the item stored in the hash map and can be directly
+// modified.
+//
+// Note that if hashmap_delete() is called on the hashmap being iterated,
+// the buckets are rearranged and the iterator must be reset to 0, otherwise
+// unexpected results may be returned after deletion. Use hashmap_scan_cursor
+// to walk a map that changes in between.
+//
+// This function has not been tested for thread safety.
+//
+// The function returns true if an item was retrieved; false if the end of the
+// iteration has been reached.
+bool hashmap_iter(struct hashmap *map, size_t *i, void **item)
+{
+    *i = next_used(map, *i);
+    if (*i >= map->nbuckets) return false;
+
+    *item = item_at(map, *i);
+    (*i)++;
+
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+// Parallel scans
+//
+// The buckets are split into one contiguous range per thread. The caller
+// scans the first range and helpers started for the scan take the others,
+// each passing its own udata to iter. When iter returns false in one thread,
+// the others stop at their next item. Once all threads are joined, the
+// caller folds the udata of every other thread into the first with reduce.
+// Small tables, and ranges whose helper could not be started, are scanned
+// by the caller.
+//-----------------------------------------------------------------------------
+#define SCAN_PAR_MIN    4096    // buckets per thread before helpers are used
+
+struct scan_part {
+    pthread_t tid;
+    bool started;
+    void *map;
+    size_t a, b;
+    bool (*range)(struct scan_part *part);
+    bool (*iter)(const void *item, void *udata);
+    void *udata;
+    int *stop;
+    bool ok;
+};
+
+static bool scan_stopped(struct scan_part *part) {
+    return __atomic_load_n(part->stop, __ATOMIC_RELAXED);
+}
+
+static void *scan_run(void *arg) {
+    struct scan_part *part = arg;
+    part->ok = part->range(part);
+    if (!part->ok) {
+        __atomic_store_n(part->stop, 1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+// scan_parallel runs `range` over [0, n) with nthreads threads. `map` is
+// handed to every part, and the parts array is allocated with `_malloc`.
+static bool scan_parallel(void *map, void *(*_malloc)(size_t),
+                          void (*_free)(void*), size_t n, int nthreads,
+                          bool (*range)(struct scan_part *part),
+                          bool (*iter)(const void *item, void *udata),
+                          void **udata, void (*reduce)(void *into, void *from))
+{
+    size_t nparts = nthreads > 1 ? nthreads : 1, per = n/nparts, i;
+    int stop = 0;
+    bool ok = true;
+    struct scan_part *parts = _malloc(sizeof(struct scan_part)*nparts);
+    if (!parts) {
+        // scan everything with the first udata
+        struct scan_part part = { .map = map, .a = 0, .b = n, .range = range,
+                                  .iter = iter, .udata = udata[0],
+                                  .stop = &stop };
+        scan_run(&part);
+        ok = part.ok;
+    } else {
+        memset(parts, 0, sizeof(struct scan_part)*nparts);
+        for (i = 0; i < nparts; i++) {
+            parts[i].map = map;
+            parts[i].a = i*per;
+            parts[i].b = i == nparts-1 ? n : (i+1)*per;
+            parts[i].range = range;
+            parts[i].iter = iter;
+            parts[i].udata = udata[i];
+            parts[i].stop = &stop;
+        }
+        for (i = 1; per >= SCAN_PAR_MIN && i < nparts; i++) {
+            parts[i].started = pthread_create(&parts[i].tid, NULL, scan_run,
+                                              &parts[i]) == 0;
+        }
+        for (i = 0; i < nparts; i++) {
+            if (!parts[i].started && !scan_stopped(&parts[i])) {
+                scan_run(&parts[i]);
+            }
+        }
+        for (i = 1; i < nparts; i++) {
+            if (parts[i].started) {
+                pthread_join(parts[i].tid, NULL);
+            }
+        }
+        _free(parts);
+        ok = !stop;
+    }
+    for (i = 1; reduce && i < nparts; i++) {
+        reduce(udata[0], udata[i]);
+    }
+    return ok;
+}
+
+static bool scan_range(struct scan_part *part) {
+    struct hashmap *map = part->map;
+    for (size_t i = next_used(map, part->a); i < part->b;
+         i = next_used(map, i+1))
+    {
+        if (scan_stopped(part) ||
+            !part->iter(item_at(map, i), part->udata))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// hashmap_scan_parallel iterates over all items in the hash map with
+// `nthreads` threads, the caller and nthreads-1 helpers. Each thread passes
+// its own entry of the `udata` array, which must hold nthreads pointers, to
+// `iter`, so iter must only touch shared state in a thread-safe way. When
+// all threads are done, `reduce`, if not NULL, is called on the caller's
+// thread to fold udata[1] ... udata[nthreads-1] into udata[0]. The map must
+// not be changed during the scan. Returns false if iter returned false in
+// any thread, which stops the others early.
+bool hashmap_scan_parallel(struct hashmap *map, int nthreads,
+                           bool (*iter)(const void *item, void *udata),
+                           void **udata,
+                           void (*reduce)(void *into, void *from))
+{
+    return scan_parallel(map, map->malloc, map->free, map->nbuckets, nthreads,
+                         scan_range, iter, udata, reduce);
+}
+
+
+// hashmap_buckets returns the raw bucket array of the hash map. The number of
+// buckets and the size of each bucket are written to `nbuckets` and
+// `bucketsz`. The array is only valid until the next mutating operation.
+// Together with hashmap_load, this allows a table to be persisted and restored
+// without rehashing. Note that the bucket layout, and therefore the stored
+// hashes, are only meaningful to a map using the same hash function and seeds.
+const void *hashmap_buckets(struct hashmap *map, size_t *nbuckets, 
+                            size_t *bucketsz)
+{
+    *nbuckets = map->nbuckets;
+    *bucketsz = map->bucketsz;
+    return map->buckets;
+}
+
+// hashmap_load replaces the contents of the hash map with a raw bucket array
+// previously obtained from hashmap_buckets. The buckets are copied as-is and
+// are not rehashed. Returns false if the layout does not match this map or if
+// the system is unable to allocate enough memory.
+bool hashmap_load(struct hashmap *map, const void *buckets, size_t nbuckets,
+                  size_t bucketsz)
+{
+    map->oom = false;
+    if (bucketsz != map->bucketsz || nbuckets < 16 || 
+        (nbuckets & (nbuckets-1)))
+    {
+        return false;
+    }
+    size_t count = 0;
+    for (size_t i = 0; i < nbuckets; i++) {
+        if (entry_dib(map, (const char*)buckets+bucketsz*i)) {
+            count++;
+        }
+    }
+    if (count >= nbuckets) {
+        return false;
+    }
+    void *new_buckets = map->malloc(table_size(bucketsz, nbuckets));
+    if (!new_buckets) {
+        map->oom = true;
+        return false;
+    }
+    memcpy(new_buckets, buckets, bucketsz*nbuckets);
+    snap_detach(map);
+    free_elements(map);
+    map->free(map->buckets);
+    map->buckets = new_buckets;
+    map->nbuckets = nbuckets;
+    map->used = table_used(map->buckets, bucketsz, nbuckets);
+    used_rebuild(map);
+    map->mask = nbuckets-1;
+    map->count = count;
+    map->growat = map->nbuckets*0.75;
+    map->shrinkat = map->nbuckets*0.10;
+    return true;
+}
+
+// hashmap_filter removes every item for which `keep` returns false in a single
+// pass over the buckets. Removed items are passed to the element-freeing
+// function, if present. The `keep` function may modify the item, but not the
+// part that is hashed or compared. Unlike calling hashmap_delete for each
+// item, the table is compacted once and never shrinks during the operation.
+// Returns the number of removed items.
+size_t hashmap_filter(struct hashmap *map, 
+                      bool (*keep)(void *item, void *udata), void *udata)
+{
+    snap_detach(map);
+    // Start right after an empty bucket so that no cluster wraps around the
+    // starting point.
+    size_t start = 0;
+    while (entry_dib(map, bucket_at(map, start))) {
+        start++;
+    }
+    size_t removed = 0;
+    bool hole = false;  // whether [hole_at, p) is a run of empty buckets
+    size_t hole_at = 0;
+    for (size_t n = 1; n <= map->nbuckets; n++) {
+        size_t p = (start+n) & map->mask;
+        struct bucket *bucket = bucket_at(map, p);
+        size_t dib = entry_dib(map, bucket);
+        if (dib && !keep(entry_item(map, bucket), udata)) {
+            if (map->elfree) {
+                map->elfree(entry_item(map, bucket));
+            }
+            entry_set_dib(map, bucket, 0);
+            used_clear(map, p);
+            removed++;
+            dib = 0;
+        }
+        if (!dib) {
+            if (!hole) {
+                hole = true;
+                hole_at = p;
+            }
+            continue;
+        }
+        if (!hole) {
+            continue;
+        }
+        // Move the item back to the first empty bucket of the run, but never
+        // in front of its home bucket.
+        size_t dist = (p-hole_at) & map->mask;
+        size_t back = dib-1 < dist ? dib-1 : dist;
+        if (back == 0) {
+            hole = false;
+            continue;
+        }
+        size_t dst = (p-back) & map->mask;
+        struct bucket *to = bucket_at(map, dst);
+        memcpy(to, bucket, map->bucketsz);
+        entry_set_dib(map, to, dib-back);
+        used_set(map, dst);
+        entry_set_dib(map, bucket, 0);
+        used_clear(map, p);
+        hole_at = (dst+1) & map->mask;
+    }
+    map->count -= removed;
+    return removed;
+}
+
+// hashmap_snapshot_begin starts a point-in-time snapshot of the hash map. The
+// snapshot is read in pieces with hashmap_snapshot_next, while the map keeps
+// being modified in between. Only the chunks of the table that are written
+// before the snapshot reaches them are copied. A map can only have one open
+// snapshot. Returns false if a snapshot is already open or if the system is
+// unable to allocate memory.
+// Note that items modified in place through pointers returned by the map are
+// not tracked, and may show up with their new contents.
+bool hashmap_snapshot_begin(struct hashmap *map, size_t *nbuckets,
+                            size_t *bucketsz, size_t *count)
+{
+    if (map->snap) {
+        return false;
+    }
+    struct hashmap_snapshot *snap = map->malloc(sizeof(struct hashmap_snapshot));
+    if (!snap) {
+        return false;
+    }
+    snap->nbuckets = map->nbuckets;
+    snap->bucketsz = map->bucketsz;
+    snap->count = map->count;
+    snap->chunk = map->nbuckets < SNAP_CHUNK ? map->nbuckets : SNAP_CHUNK;
+    snap->cursor = 0;
+    snap->detached = false;
+    snap->failed = false;
+    snap->buckets = map->buckets;
+    size_t nchunks = snap->nbuckets/snap->chunk;
+    snap->saved = map->malloc(nchunks*sizeof(void*));
+    if (!snap->saved) {
+        map->free(snap);
+        return false;
+    }
+    memset(snap->saved, 0, nchunks*sizeof(void*));
+    map->snap = snap;
+    *nbuckets = snap->nbuckets;
+    *bucketsz = snap->bucketsz;
+    *count = snap->count;
+    return true;
+}
+
+// hashmap_snapshot_next copies up to `n` of the next buckets of the open
+// snapshot into `buf`, which must have room for `n` buckets. The number of
+// buckets copied is written to `n`, which is zero once the whole table was
+// emitted. Returns false if there is no open snapshot or if the snapshot was
+// lost because the system was unable to allocate memory for a chunk.
+bool hashmap_snapshot_next(struct hashmap *map, void *buf, size_t *n) {
+    struct hashmap_snapshot *snap = map->snap;
+    size_t copied = 0;
+    if (!snap || snap->failed) {
+        *n = 0;
+        return false;
+    }
+    while (copied < *n && snap->cursor < snap->nbuckets) {
+        size_t c = snap->cursor/snap->chunk;
+        size_t off = snap->cursor-c*snap->chunk;
+        size_t len = snap->chunk-off;
+        if (len > *n-copied) {
+            len = *n-copied;
+        }
+        const char *src = snap->saved[c] ? (char*)snap->saved[c] : 
+                          (char*)snap->buckets+c*snap->chunk*snap->bucketsz;
+        memcpy((char*)buf+copied*snap->bucketsz, src+off*snap->bucketsz,
+               len*snap->bucketsz);
+        copied += len;
+        snap->cursor += len;
+        if (off+len == snap->chunk && snap->saved[c]) {
+            map->free(snap->saved[c]);
+            snap->saved[c] = NULL;
+        }
+    }
+    *n = copied;
+    return true;
+}
+
+// hashmap_snapshot_end closes the open snapshot, if any, and releases the
+// chunks it still holds.
+void hashmap_snapshot_end(struct hashmap *map) {
+    struct hashmap_snapshot *snap = map->snap;
+    if (!snap) {
+        return;
+    }
+    size_t nchunks = snap->nbuckets/snap->chunk;
+    for (size_t c = 0; c < nchunks; c++) {
+        if (snap->saved[c]) {
+            map->free(snap->saved[c]);
+        }
+    }
+    map->free(snap->saved);
+    map->free(snap);
+    map->snap = NULL;
+}
+
+// hashmap_stats copies the statistics of the hash map into `stats`. Returns
+// false, leaving `stats` zeroed, unless compiled with -DTTLMAP_STATS.
+bool hashmap_stats(struct hashmap *map, struct hashmap_stats *stats) {
+    memset(stats, 0, sizeof(struct hashmap_stats));
+#ifdef TTLMAP_STATS
+    memcpy(stats, &map->stats, sizeof(struct hashmap_stats));
+    stats->count = map->count;
+    stats->nbuckets = map->nbuckets;
+    return true;
+#else
+    (void)map;
+    return false;
+#endif
+}
+
+//-----------------------------------------------------------------------------
+// Concurrent hash map
+//
+// An alternative engine for maps shared by many threads. Items are kept in
+// immutable nodes chained off a bucket array. Readers walk the chains without
+// taking any lock. Writers lock one of CHM_STRIPES stripes, which owns every
+// bucket whose index has the same low bits, and publish a new or replacing
+// node with a single pointer store. Every node has two links and a table
+// chains its nodes through one of them. Growing the table takes all stripes,
+// relinks the nodes through the other link into a table twice the size and
+// publishes it, so a reader still walking the old table sees it unchanged.
+//
+// Unlinked nodes and tables are reclaimed with epochs. Every thread that
+// touches a map is registered once, process-wide, and announces the global
+// epoch it observed while it is between chashmap_enter and chashmap_leave.
+// Memory retired in epoch e is freed once the global epoch reached e+2, which
+// can only happen after every thread that might still see it has left.
+// Retired memory is queued on the stripe that retired it, under its lock.
+//-----------------------------------------------------------------------------
+#define CHM_STRIPES     256
+#define CHM_RETIRE_MAX  64      // retired entries per stripe before reclaiming
+#define CHM_ITER_SHIFT  48      // chashmap_iter cursor, chain index << shift
+
+#define CHM_NODE        0
+#define CHM_NODE_ELFREE 1       // node removed by clear, elfree is called
+#define CHM_TABLE       2
+
+struct chm_retired {
+    struct chm_retired *next;
+    uint64_t epoch;
+    int kind;
+};
+
+struct chm_node {
+    struct chm_retired retired;
+    struct chm_node *next[2];       // indexed by the link of the table
+    uint64_t hash;
+    char item[];
+};
+
+struct chm_table {
+    struct chm_retired retired;
+    size_t nbuckets;
+    size_t mask;
+    int link;                       // which of the node links chains buckets
+    struct chm_node *buckets[];
+};
+
+struct chm_stripe {
+    pthread_mutex_t lock;
+    size_t count;
+    struct chm_retired *retired;    // newest first
+    size_t nretired;
+    size_t collectat;               // nretired that triggers the next collect
+} __attribute__((aligned(64)));
+
+struct chashmap {
+    void *(*malloc)(size_t);
+    void (*free)(void *);
+    bool oom;
+    size_t elsize;
+    size_t cap;
+    uint64_t seed0;
+    uint64_t seed1;
+    uint64_t (*hash)(const void *item, uint64_t seed0, uint64_t seed1);
+    int (*compare)(const void *a, const void *b, void *udata);
+    void (*elfree)(void *item);
+    void *udata;
+    struct chm_table *table;
+    uint64_t relinkat;              // epoch from which the table may grow
+    struct chm_stripe *stripes;
+    void *stripemem;
+};
+
+struct chm_thread {
+    uint64_t local;             // observed epoch << 1 | 1 while active
+    unsigned int nest;
+    int used;
+    struct chm_thread *next;
+} __attribute__((aligned(64)));
+
+static uint64_t chm_epoch;
+static struct chm_thread *chm_threads;
+static pthread_once_t chm_once = PTHREAD_ONCE_INIT;
+static pthread_key_t chm_key;
+static __thread struct chm_thread *chm_self;
+
+static void chm_release(void *arg) {
+    struct chm_thread *t = arg;
+    __atomic_store_n(&t->local, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&t->used, 0, __ATOMIC_RELEASE);
+}
+
+static void chm_initkey(void) {
+    pthread_key_create(&chm_key, chm_release);
+}
+
+// chm_register gives the calling thread a record, reusing the one of an
+// exited thread when possible. Records are never freed.
+static struct chm_thread *chm_register(void) {
+    struct chm_thread *t;
+    pthread_once(&chm_once, chm_initkey);
+    for (t = __atomic_load_n(&chm_threads, __ATOMIC_ACQUIRE); t; t = t->next) {
+        int unused = 0;
+        if (__atomic_compare_exchange_n(&t->used, &unused, 1, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+    if (!t) {
+        if (posix_memalign((void**)&t, 64, sizeof(struct chm_thread)) != 0) {
+            panic("out of memory");
+        }
+        memset(t, 0, sizeof(struct chm_thread));
+        t->used = 1;
+        t->next = __atomic_load_n(&chm_threads, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&chm_threads, &t->next, t, true,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+    t->nest = 0;
+    pthread_setspecific(chm_key, t);
+    chm_self = t;
+    return t;
+}
+
+// chashmap_enter starts a read-side critical section of the calling thread.
+// Items returned by the chashmap functions stay valid until the matching
+// chashmap_leave. Sections may be nested.
+void chashmap_enter(void) {
+    struct chm_thread *t = chm_self ? chm_self : chm_register();
+    if (t->nest++ == 0) {
+        uint64_t e = __atomic_load_n(&chm_epoch, __ATOMIC_ACQUIRE);
+        __atomic_store_n(&t->local, e << 1 | 1, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
+}
+
+// chashmap_leave ends a section started by chashmap_enter.
+void chashmap_leave(void) {
+    struct chm_thread *t = chm_self;
+    if (--t->nest == 0) {
+        __atomic_store_n(&t->local, 0, __ATOMIC_RELEASE);
+    }
+}
+
+// chm_advance moves the global epoch forward when every active thread has
+// observed the current one.
+static void chm_advance(void) {
+    uint64_t e = __atomic_load_n(&chm_epoch, __ATOMIC_ACQUIRE);
+    struct chm_thread *t;
+    for (t = __atomic_load_n(&chm_threads, __ATOMIC_ACQUIRE); t; t = t->next) {
+        uint64_t local = __atomic_load_n(&t->local, __ATOMIC_SEQ_CST);
+        if ((local & 1) && (local >> 1) != e) {
+            return;
+        }
+    }
+    __atomic_compare_exchange_n(&chm_epoch, &e, e+1, false,
+                                __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
+
+static void chm_destroy(struct chashmap *map, struct chm_retired *r) {
+    if (r->kind == CHM_NODE_ELFREE && map->elfree) {
+        map->elfree(((struct chm_node*)r)->item);
+    }
+    map->free(r);
+}
+
+// chm_collect frees the retired entries of a stripe that no reader can see
+// anymore. The stripe must be locked.
+static void chm_collect(struct chashmap *map, struct chm_stripe *s) {
+    chm_advance();
+    uint64_t e = __atomic_load_n(&chm_epoch, __ATOMIC_ACQUIRE);
+    struct chm_retired **pp = &s->retired;
+    while (*pp && (*pp)->epoch+2 > e) {
+        pp = &(*pp)->next;
+    }
+    struct chm_retired *r = *pp;
+    *pp = NULL;
+    while (r) {
+        struct chm_retired *next = r->next;
+        chm_destroy(map, r);
+        s->nretired--;
+        r = next;
+    }
+    // entries a slow reader keeps alive are not walked again right away
+    s->collectat = s->nretired*2+CHM_RETIRE_MAX;
+}
+
+// chm_retire queues memory that was unlinked from the map. The stripe must be
+// locked.
+static void chm_retire(struct chashmap *map, struct chm_stripe *s,
+                       struct chm_retired *r, int kind)
+{
+    r->epoch = __atomic_load_n(&chm_epoch, __ATOMIC_ACQUIRE);
+    r->kind = kind;
+    r->next = s->retired;
+    s->retired = r;
+    if (++s->nretired >= s->collectat) {
+        chm_collect(map, s);
+    }
+}
+
+static struct chm_table *chm_newtable(struct chashmap *map, size_t nbuckets) {
+    size_t size = sizeof(struct chm_table)+sizeof(struct chm_node*)*nbuckets;
+    struct chm_table *table = map->malloc(size);
+    if (!table) {
+        return NULL;
+    }
+    memset(table, 0, size);
+    table->nbuckets = nbuckets;
+    table->mask = nbuckets-1;
+    return table;
+}
+
+static void chm_lockall(struct chashmap *map) {
+    for (int i = 0; i < CHM_STRIPES; i++) {
+        pthread_mutex_lock(&map->stripes[i].lock);
+    }
+}
+
+static void chm_unlockall(struct chashmap *map) {
+    for (int i = CHM_STRIPES-1; i >= 0; i--) {
+        pthread_mutex_unlock(&map->stripes[i].lock);
+    }
+}
+
+// chm_lock locks the stripe of a hash in the current table and returns the
+// table.
+static struct chm_table *chm_lock(struct chashmap *map, uint64_t hash,
+                                  struct chm_stripe **s)
+{
+    *s = &map->stripes[hash&(CHM_STRIPES-1)];
+    for (;;) {
+        struct chm_table *table = __atomic_load_n(&map->table, __ATOMIC_ACQUIRE);
+        pthread_mutex_lock(&(*s)->lock);
+        if (table == __atomic_load_n(&map->table, __ATOMIC_RELAXED)) {
+            return table;
+        }
+        pthread_mutex_unlock(&(*s)->lock);
+    }
+}
+
+// chm_grow doubles the table, unless another thread already replaced `old`.
+// The new bucket array is allocated before any stripe is taken and the nodes
+// are relinked through the link that `old` does not use. Readers of the table
+// before `old` used that link too, so the table only grows once they are all
+// gone, until then it stays fuller than it should be and a later set retries.
+static void chm_grow(struct chashmap *map, struct chm_table *old) {
+    chm_advance();
+    if (__atomic_load_n(&map->table, __ATOMIC_ACQUIRE) != old ||
+        __atomic_load_n(&chm_epoch, __ATOMIC_ACQUIRE) <
+        __atomic_load_n(&map->relinkat, __ATOMIC_RELAXED))
+    {
+        return;
+    }
+    struct chm_table *table = chm_newtable(map, old->nbuckets*2);
+    if (!table) {
+        return;
+    }
+    chm_lockall(map);
+    if (map->table != old) {
+        chm_unlockall(map);
+        map->free(table);
+        return;
+    }
+    int from = old->link;
+    int to = table->link = from^1;
+    for (size_t i = 0; i < old->nbuckets; i++) {
+        for (struct chm_node *n = old->buckets[i]; n; n = n->next[from]) {
+            struct chm_node **pp = &table->buckets[n->hash&table->mask];
+            n->next[to] = *pp;
+            *pp = n;
+        }
+    }
+    __atomic_store_n(&map->table, table, __ATOMIC_RELEASE);
+    chm_retire(map, &map->stripes[0], &old->retired, CHM_TABLE);
+    __atomic_store_n(&map->relinkat, old->retired.epoch+2, __ATOMIC_RELAXED);
+    chm_unlockall(map);
+}
+
+static size_t chm_cap(size_t cap) {
+    size_t ncap = CHM_STRIPES;
+    while (ncap < cap) {
+        ncap *= 2;
+    }
+    return ncap;
+}
+
+// chashmap_new_with_allocator returns a new concurrent hash map using a
+// custom allocator. See chashmap_new for more information.
+struct chashmap *chashmap_new_with_allocator(
+                            void *(*_malloc)(size_t),
+                            void (*_free)(void*),
+                            size_t elsize, size_t cap,
+                            uint64_t seed0, uint64_t seed1,
+                            uint64_t (*hash)(const void *item,
+                                             uint64_t seed0, uint64_t seed1),
+                            int (*compare)(const void *a, const void *b,
+                                           void *udata),
+                            void (*elfree)(void *item),
+                            void *udata)
+{
+    _malloc = _malloc ? _malloc : malloc;
+    _free = _free ? _free : free;
+    struct chashmap *map = _malloc(sizeof(struct chashmap));
+    if (!map) {
+        return NULL;
+    }
+    memset(map, 0, sizeof(struct chashmap));
+    map->malloc = _malloc;
+    map->free = _free;
+    map->elsize = elsize;
+    map->cap = chm_cap(cap);
+    map->seed0 = seed0;
+    map->seed1 = seed1;
+    map->hash = hash;
+    map->compare = compare;
+    map->elfree = elfree;
+    map->udata = udata;
+    map->stripemem = _malloc(sizeof(struct chm_stripe)*CHM_STRIPES+63);
+    map->table = chm_newtable(map, map->cap);
+    if (!map->stripemem || !map->table) {
+        if (map->stripemem) _free(map->stripemem);
+        if (map->table) _free(map->table);
+        _free(map);
+        return NULL;
+    }
+    map->stripes = (struct chm_stripe*)(((uintptr_t)map->stripemem+63)&~(uintptr_t)63);
+    memset(map->stripes, 0, sizeof(struct chm_stripe)*CHM_STRIPES);
+    for (int i = 0; i < CHM_STRIPES; i++) {
+        pthread_mutex_init(&map->stripes[i].lock, NULL);
+        map->stripes[i].collectat = CHM_RETIRE_MAX;
+    }
+    return map;
+}
+
+// chashmap_new returns a new concurrent hash map. The parameters are the same
+// as for hashmap_new, except that the capacity is at least CHM_STRIPES.
+// Any number of threads may get, set, delete and scan at the same time.
+// Items returned by the map are only valid until the calling thread leaves
+// its current read-side section, see chashmap_enter. Every function enters
+// one of its own, so a thread that wants to use a returned item must wrap the
+// call and the use in chashmap_enter and chashmap_leave.
+struct chashmap *chashmap_new(size_t elsize, size_t cap,
+                            uint64_t seed0, uint64_t seed1,
+                            uint64_t (*hash)(const void *item,
+                                             uint64_t seed0, uint64_t seed1),
+                            int (*compare)(const void *a, const void *b,
+                                           void *udata),
+                            void (*elfree)(void *item),
+                            void *udata)
+{
+    return chashmap_new_with_allocator(
+        (_malloc?_malloc:malloc),
+        (_free?_free:free),
+        elsize, cap, seed0, seed1, hash, compare, elfree, udata
+    );
+}
+
+// chashmap_free frees the map. No other thread may use the map anymore, but
+// readers that still hold items of it must have left their sections.
+void chashmap_free(struct chashmap *map) {
+    if (!map) return;
+    struct chm_table *table = map->table;
+    for (size_t i = 0; i < table->nbuckets; i++) {
+        for (struct chm_node *n = table->buckets[i], *next; n; n = next) {
+            next = n->next[table->link];
+            if (map->elfree) map->elfree(n->item);
+            map->free(n);
+        }
+    }
+    map->free(table);
+    for (int i = 0; i < CHM_STRIPES; i++) {
+        struct chm_stripe *s = &map->stripes[i];
+        while (s->retired) {
+            struct chm_retired *r = s->retired;
+            s->retired = r->next;
+            chm_destroy(map, r);
+        }
+        pthread_mutex_destroy(&s->lock);
+    }
+    map->free(map->stripemem);
+    map->free(map);
+}
+
+// chashmap_clear removes all items, see hashmap_clear. Items are handed to
+// elfree once no reader can see them anymore.
+void chashmap_clear(struct chashmap *map, bool update_cap) {
+    chm_lockall(map);
+    struct chm_table *old = map->table;
+    if (update_cap) {
+        map->cap = old->nbuckets;
+    }
+    struct chm_table *table = chm_newtable(map, map->cap);
+    if (table) {
+        table->link = old->link;
+        __atomic_store_n(&map->table, table, __ATOMIC_RELEASE);
+    }
+    int kind = map->elfree ? CHM_NODE_ELFREE : CHM_NODE;
+    for (size_t i = 0; i < old->nbuckets; i++) {
+        struct chm_stripe *s = &map->stripes[i&(CHM_STRIPES-1)];
+        struct chm_node *n = old->buckets[i], *next;
+        if (!table) {
+            __atomic_store_n(&old->buckets[i], NULL, __ATOMIC_RELEASE);
+        }
+        for (; n; n = next) {
+            next = n->next[old->link];
+            chm_retire(map, s, &n->retired, kind);
+        }
+    }
+    for (int i = 0; i < CHM_STRIPES; i++) {
+        map->stripes[i].count = 0;
+    }
+    if (table) {
+        chm_retire(map, &map->stripes[0], &old->retired, CHM_TABLE);
+    }
+    chm_unlockall(map);
+}
+
+// chashmap_count returns the number of items in the map. Writes that run
+// concurrently may or may not be counted.
+size_t chashmap_count(struct chashmap *map) {
+    size_t count = 0;
+    for (int i = 0; i < CHM_STRIPES; i++) {
+        count += __atomic_load_n(&map->stripes[i].count, __ATOMIC_RELAXED);
+    }
+    return count;
+}
+
+// chashmap_oom returns true if the last chashmap_set() call failed due to the
+// system being out of memory.
+bool chashmap_oom(struct chashmap *map) {
+    return __atomic_load_n(&map->oom, __ATOMIC_RELAXED);
+}
+
+// chashmap_get returns the item based on the provided key. If the item is not
+// found then NULL is returned.
+void *chashmap_get(struct chashmap *map, const void *key) {
+    uint64_t hash = map->hash(key, map->seed0, map->seed1);
+    void *item = NULL;
+    chashmap_enter();
+    struct chm_table *table = __atomic_load_n(&map->table, __ATOMIC_ACQUIRE);
+    struct chm_node *n = __atomic_load_n(&table->buckets[hash&table->mask],
+                                         __ATOMIC_ACQUIRE);
+    for (; n; n = __atomic_load_n(&n->next[table->link], __ATOMIC_ACQUIRE)) {
+        if (n->hash == hash && map->compare(n->item, key, map->udata) == 0) {
+            item = n->item;
+            break;
+        }
+    }
+    chashmap_leave();
+    return item;
+}
+
+static bool chm_always(const void *item, void *udata) {
+    (void)item;
+    (void)udata;
+    return true;
+}
+
+// chm_set inserts item, or replaces the item with its key when `cond` returns
+// true for it. Returns the replaced item and sets *stored.
+static void *chm_set(struct chashmap *map, const void *item,
+                     bool (*cond)(const void *item, void *udata), void *udata,
+                     bool *stored)
+{
+    uint64_t hash = map->hash(item, map->seed0, map->seed1);
+    *stored = false;
+    struct chm_node *node = map->malloc(sizeof(struct chm_node)+map->elsize);
+    if (!node) {
+        __atomic_store_n(&map->oom, true, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    __atomic_store_n(&map->oom, false, __ATOMIC_RELAXED);
+    memcpy(node->item, item, map->elsize);
+    node->hash = hash;
+
+    struct chm_stripe *s;
+    void *prev = NULL;
+    bool grow = false, found = false;
+    chashmap_enter();
+    struct chm_table *table = chm_lock(map, hash, &s);
+    int link = table->link;
+    struct chm_node **pp = &table->buckets[hash&table->mask];
+    for (struct chm_node *n = *pp; n; pp = &n->next[link], n = *pp) {
+        if (n->hash == hash && map->compare(n->item, item, map->udata) == 0) {
+            found = true;
+            if (cond && cond(n->item, udata)) {
+                node->next[link] = n->next[link];
+                __atomic_store_n(pp, node, __ATOMIC_RELEASE);
+                chm_retire(map, s, &n->retired, CHM_NODE);
+                prev = n->item;
+                *stored = true;
+            }
+            break;
+        }
+    }
+    if (!found) {
+        pp = &table->buckets[hash&table->mask];
+        node->next[link] = *pp;
+        __atomic_store_n(pp, node, __ATOMIC_RELEASE);
+        __atomic_store_n(&s->count, s->count+1, __ATOMIC_RELAXED);
+        *stored = true;
+        // each stripe owns nbuckets/CHM_STRIPES buckets, some slack keeps
+        // an unlucky stripe of a small table from growing it early
+        size_t per = table->nbuckets/CHM_STRIPES;
+        grow = s->count > per+per/2+2;
+    }
+    pthread_mutex_unlock(&s->lock);
+    if (!*stored) {
+        map->free(node);    // never published
+    }
+    if (grow) {
+        chm_grow(map, table);
+    }
+    chashmap_leave();
+    return prev;
+}
+
+// chashmap_set inserts or replaces an item in the map. If an item is
+// replaced then it is returned otherwise NULL is returned. The item is copied
+// into a new node, so readers of the replaced item never see a partial write.
+// When the system is out of memory NULL is returned and chashmap_oom()
+// returns true.
+void *chashmap_set(struct chashmap *map, const void *item) {
+    bool stored;
+    return chm_set(map, item, chm_always, NULL, &stored);
+}
+
+// chashmap_set_if inserts item when no item has its key, or replaces the
+// item with its key when `cond` returns true for it while its stripe is
+// locked. A NULL `cond` never replaces. A replaced item is retired as by
+// chashmap_set. Returns false when the existing item was kept or the system
+// is out of memory, which chashmap_oom() tells apart.
+bool chashmap_set_if(struct chashmap *map, const void *item,
+                     bool (*cond)(const void *item, void *udata), void *udata)
+{
+    bool stored;
+    chm_set(map, item, cond, udata, &stored);
+    return stored;
+}
+
+// chashmap_delete_if removes the item with the provided key when `cond`
+// returns true for it while its stripe is locked. A NULL `cond` always
+// removes. Returns the removed item or NULL.
+void *chashmap_delete_if(struct chashmap *map, const void *key,
+                         bool (*cond)(const void *item, void *udata),
+                         void *udata)
+{
+    uint64_t hash = map->hash(key, map->seed0, map->seed1);
+    struct chm_stripe *s;
+    void *prev = NULL;
+    chashmap_enter();
+    struct chm_table *table = chm_lock(map, hash, &s);
+    int link = table->link;
+    struct chm_node **pp = &table->buckets[hash&table->mask];
+    for (struct chm_node *n = *pp; n; pp = &n->next[link], n = *pp) {
+        if (n->hash == hash && map->compare(n->item, key, map->udata) == 0) {
+            if (!cond || cond(n->item, udata)) {
+                __atomic_store_n(pp, n->next[link], __ATOMIC_RELEASE);
+                __atomic_store_n(&s->count, s->count-1, __ATOMIC_RELAXED);
+                chm_retire(map, s, &n->retired, CHM_NODE);
+                prev = n->item;
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+    chashmap_leave();
+    return prev;
+}
+
+// chashmap_delete removes an item from the map and returns it. If the item is
+// not found then NULL is returned.
+void *chashmap_delete(struct chashmap *map, const void *key) {
+    return chashmap_delete_if(map, key, NULL, NULL);
+}
+
+// chashmap_probe returns the first item in the bucket at position or NULL if
+// the bucket is empty.
+void *chashmap_probe(struct chashmap *map, uint64_t position) {
+    chashmap_enter();
+    struct chm_table *table = __atomic_load_n(&map->table, __ATOMIC_ACQUIRE);
+    struct chm_node *n = __atomic_load_n(&table->buckets[position&table->mask],
+                                         __ATOMIC_ACQUIRE);
+    chashmap_leave();
+    return n ? n->item : NULL;
+}
+
+// chashmap_scan iterates over all items in the map without blocking writers.
+// Items set or deleted during the scan may or may not be visited.
+// Param `iter` can return false to stop iteration early.
+// Returns false if the iteration has been stopped early.
+bool chashmap_scan(struct chashmap *map,
+                   bool (*iter)(const void *item, void *udata), void *udata)
+{
+    bool ok = true;
+    chashmap_enter();
+    struct chm_table *table = __atomic_load_n(&map->table, __ATOMIC_ACQUIRE);
+    for (size_t i = 0; ok && i < table->nbuckets; i++) {
+        struct chm_node *n = __atomic_load_n(&table->buckets[i], __ATOMIC_ACQUIRE);
+        for (; ok && n; n = __atomic_load_n(&n->next[table->link], __ATOMIC_ACQUIRE)) {
+            ok = iter(n->item, udata);
+        }
+    }
+    chashmap_leave();
+    return ok;
+}
+
+// chashmap_scan_cursor continues a scan at `cursor` over at most `count`
+// buckets, see hashmap_scan_cursor. Items in the bucket chains are visited
+// without blocking writers, and grows between calls are handled the same way.
+int chashmap_scan_cursor(struct chashmap *map, size_t *cursor, size_t count,
+                         bool (*iter)(const void *item, void *udata),
+                         void *udata)
+{
+    bool ok = true;
+    chashmap_enter();
+    struct chm_table *table = __atomic_load_n(&map->table, __ATOMIC_ACQUIRE);
+    size_t v = *cursor & table->mask;
+    if (count == 0) {
+        count = 1;
+    }
+    do {
+        struct chm_node *n = __atomic_load_n(&table->buckets[v], __ATOMIC_ACQUIRE);
+        for (; ok && n; n = __atomic_load_n(&n->next[table->link], __ATOMIC_ACQUIRE)) {
+            ok = iter(n->item, udata);
+        }
+        if (!ok) {
+            break;
+        }
+        v = cursor_next(v, table->mask);
+    } while (v != 0 && --count > 0);
+    chashmap_leave();
+    *cursor = v;
+    return ok ? v != 0 : -1;
+}
+
+static bool chm_scan_range(struct scan_part *part) {
+    struct chm_table *table = part->map;
+    for (size_t i = part->a; i < part->b; i++) {
+        struct chm_node *n = __atomic_load_n(&table->buckets[i], __ATOMIC_ACQUIRE);
+        for (; n; n = __atomic_load_n(&n->next[table->link], __ATOMIC_ACQUIRE)) {
+            if (scan_stopped(part) || !part->iter(n->item, part->udata)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// chashmap_scan_parallel iterates over all items with `nthreads` threads,
+// see hashmap_scan_parallel. Writers are not blocked. The caller stays in a
+// read-side section for the whole scan, so nothing the helpers can reach is
+// reclaimed before they are joined.
+bool chashmap_scan_parallel(struct chashmap *map, int nthreads,
+                            bool (*iter)(const void *item, void *udata),
+                            void **udata,
+                            void (*reduce)(void *into, void *from))
+{
+    chashmap_enter();
+    struct chm_table *table = __atomic_load_n(&map->table, __ATOMIC_ACQUIRE);
+    bool ok = scan_parallel(table, map->malloc, map->free, table->nbuckets,
+                            nthreads, chm_scan_range, iter, udata, reduce);
+    chashmap_leave();
+    return ok;
+}
+
+// chashmap_iter iterates one item at a time, see hashmap_iter. The cursor
+// holds the bucket in its low CHM_ITER_SHIFT bits and the position in the
+// bucket's chain above them. As with hashmap_iter, it must be reset to 0 when
+// the map was changed in between.
+bool chashmap_iter(struct chashmap *map, size_t *i, void **item) {
+    bool found = false;
+    chashmap_enter();
+    struct chm_table *table = __atomic_load_n(&map->table, __ATOMIC_ACQUIRE);
+    size_t bucket = *i&(((size_t)1<<CHM_ITER_SHIFT)-1);
+    size_t pos = *i>>CHM_ITER_SHIFT;
+    for (; !found && bucket < table->nbuckets; bucket++, pos = 0) {
+        struct chm_node *n = __atomic_load_n(&table->buckets[bucket],
+                                             __ATOMIC_ACQUIRE);
+        for (size_t j = 0; n && j < pos; j++) {
+            n = __atomic_load_n(&n->next[table->link], __ATOMIC_ACQUIRE);
+        }
+        if (n) {
+            *item = n->item;
+            *i = (pos+1)<<CHM_ITER_SHIFT|bucket;
+            found = true;
+        }
+    }
+    chashmap_leave();
+    return found;
+}
+
+// chashmap_stats fills in the count and number of buckets. The concurrent
+// engine keeps no other counters. Returns false unless compiled with
+// -DTTLMAP_STATS, like hashmap_stats.
+bool chashmap_stats(struct chashmap *map, struct hashmap_stats *stats) {
+    memset(stats, 0, sizeof(struct hashmap_stats));
+#ifdef TTLMAP_STATS
+    stats->count = chashmap_count(map);
+    chashmap_enter();
+    stats->nbuckets = __atomic_load_n(&map->table, __ATOMIC_ACQUIRE)->nbuckets;
+    chashmap_leave();
+    return true;
+#else
+    (void)map;
+    return false;
+#endif
+}
+
+//-----------------------------------------------------------------------------
+// Segmented hash map
+//
+// Extendible hashing over robin-hood segments. A directory of 2^depth
+// pointers, indexed by the low bits of the hash, leads to segments of
+// SHM_SEGMENT buckets. Inside a segment the home bucket is taken from higher
+// bits of the hash and probes wrap around within the segment. A segment that
+// reaches its load limit is split in two by one more hash bit, and only the
+// directory entries pointing to it change. When the segment already uses as
+// many bits as the directory, the directory (one pointer per entry) is
+// doubled first. Growing therefore costs one segment's worth of copying and
+// memory, however large the map is. Segments are not merged when the map
+// shrinks.
+//-----------------------------------------------------------------------------
+#define SHM_SEGBITS     12
+#define SHM_SEGMENT     (1<<SHM_SEGBITS)    // buckets per segment
+#define SHM_GROWAT      (SHM_SEGMENT*3/4)
+#define SHM_MAXDEPTH    24                  // hash bits used by the directory
+
+struct shm_segment {
+    size_t depth;       // low hash bits shared by all items of the segment
+    size_t count;
+    char buckets[];
+};
+
+struct shashmap {
+    void *(*malloc)(size_t);
+    void (*free)(void *);
+    bool oom;
+    size_t elsize;
+    size_t bucketsz;
+    size_t cap;
+    uint64_t seed0;
+    uint64_t seed1;
+    uint64_t (*hash)(const void *item, uint64_t seed0, uint64_t seed1);
+    int (*compare)(const void *a, const void *b, void *udata);
+    void (*elfree)(void *item);
+    void *udata;
+    size_t count;
+    size_t depth;
+    size_t nsegments;
+    struct shm_segment **dir;
+    void *spare;
+    void *edata;
+#ifdef TTLMAP_STATS
+    struct hashmap_stats stats;
+#endif
+};
+
+static struct bucket *shm_bucket(struct shashmap *map, struct shm_segment *seg,
+                                 size_t i)
+{
+    return (struct bucket*)(seg->buckets+map->bucketsz*i);
+}
+
+static size_t shm_home(uint64_t hash) {
+    return (hash>>SHM_MAXDEPTH) & (SHM_SEGMENT-1);
+}
+
+static struct shm_segment *shm_segment_for(struct shashmap *map,
+                                           uint64_t hash)
+{
+    return map->dir[hash & (((size_t)1<<map->depth)-1)];
+}
+
+static struct shm_segment *shm_newsegment(struct shashmap *map, size_t depth) {
+    size_t size = sizeof(struct shm_segment)+map->bucketsz*SHM_SEGMENT;
+    struct shm_segment *seg = map->malloc(size);
+    if (!seg) {
+        return NULL;
+    }
+    memset(seg, 0, size);
+    seg->depth = depth;
+    return seg;
+}
+
+// shm_first reports whether directory entry i is the first one pointing to
+// its segment, which is how every segment is visited once.
+static bool shm_first(struct shashmap *map, size_t i) {
+    return i < ((size_t)1<<map->dir[i]->depth);
+}
+
+// shm_place inserts entry, whose dib must be 1, into a segment that has room.
+static void shm_place(struct shashmap *map, struct shm_segment *seg,
+                      struct bucket *entry)
+{
+    size_t i = shm_home(entry->hash);
+    for (;;) {
+        struct bucket *bucket = shm_bucket(map, seg, i);
+        if (bucket->dib == 0) {
+            memcpy(bucket, entry, map->bucketsz);
+            seg->count++;
+            return;
+        }
+        if (bucket->dib < entry->dib) {
+            memcpy(map->spare, bucket, map->bucketsz);
+            memcpy(bucket, entry, map->bucketsz);
+            memcpy(entry, map->spare, map->bucketsz);
+        }
+        i = (i + 1) & (SHM_SEGMENT-1);
+        entry->dib += 1;
+    }
+}
+
+// shm_init sets up the directory for a capacity of `cap` items.
+static bool shm_init(struct shashmap *map, size_t cap) {
+    size_t depth = 0;
+    while (((size_t)SHM_GROWAT<<depth) < cap && depth < SHM_MAXDEPTH) {
+        depth++;
+    }
+    size_t n = (size_t)1<<depth;
+    map->dir = map->malloc(sizeof(struct shm_segment*)*n);
+    if (!map->dir) {
+        return false;
+    }
+    for (size_t i = 0; i < n; i++) {
+        map->dir[i] = shm_newsegment(map, depth);
+        if (!map->dir[i]) {
+            while (i-- > 0) {
+                map->free(map->dir[i]);
+            }
+            map->free(map->dir);
+            return false;
+        }
+    }
+    map->depth = depth;
+    map->nsegments = n;
+    map->count = 0;
+    return true;
+}
+
+static void shm_freesegments(struct shashmap *map) {
+    // backwards, so a segment is freed at the last entry pointing to it
+    for (size_t i = ((size_t)1<<map->depth); i-- > 0; ) {
+        struct shm_segment *seg = map->dir[i];
+        if (!shm_first(map, i)) {
+            continue;
+        }
+        if (map->elfree) {
+            for (size_t j = 0; j < SHM_SEGMENT; j++) {
+                struct bucket *bucket = shm_bucket(map, seg, j);
+                if (bucket->dib) map->elfree(bucket_item(bucket));
+            }
+        }
+        map->free(seg);
+    }
+    map->free(map->dir);
+}
+
+// shm_split splits the segment at directory entry `index` by its next hash
+// bit. Returns false when out of memory or out of hash bits.
+static bool shm_split(struct shashmap *map, size_t index) {
+#ifdef TTLMAP_STATS
+    uint64_t start = stat_now();
+#endif
+    struct shm_segment *seg = map->dir[index];
+    if (seg->depth == map->depth) {
+        if (map->depth == SHM_MAXDEPTH) {
+            return false;
+        }
+        size_t n = (size_t)1<<map->depth;
+        struct shm_segment **dir = map->malloc(sizeof(struct shm_segment*)*n*2);
+        if (!dir) {
+            return false;
+        }
+        memcpy(dir, map->dir, sizeof(struct shm_segment*)*n);
+        memcpy(dir+n, map->dir, sizeof(struct shm_segment*)*n);
+        map->free(map->dir);
+        map->dir = dir;
+        map->depth++;
+    }
+    struct shm_segment *lo = shm_newsegment(map, seg->depth+1);
+    struct shm_segment *hi = shm_newsegment(map, seg->depth+1);
+    if (!lo || !hi) {
+        if (lo) map->free(lo);
+        if (hi) map->free(hi);
+        return false;
+    }
+    size_t bit = (size_t)1<<seg->depth;
+    struct bucket *entry = map->edata;
+    for (size_t i = 0; i < SHM_SEGMENT; i++) {
+        struct bucket *bucket = shm_bucket(map, seg, i);
+        if (!bucket->dib) {
+            continue;
+        }
+        memcpy(entry, bucket, map->bucketsz);
+        entry->dib = 1;
+        shm_place(map, (entry->hash & bit) ? hi : lo, entry);
+    }
+    for (size_t i = index & (bit-1); i < ((size_t)1<<map->depth); i += bit) {
+        map->dir[i] = (i & bit) ? hi : lo;
+    }
+    map->free(seg);
+    map->nsegments++;
+    STAT_ADD(map, resizes, 1);
+    STAT_ADD(map, resize_ns, stat_now()-start);
+    return true;
+}
+
+// shashmap_new_with_allocator returns a new segmented hash map using a custom
+// allocator. See shashmap_new for more information.
+struct shashmap *shashmap_new_with_allocator(
+                            void *(*_malloc)(size_t),
+                            void (*_free)(void*),
+                            size_t elsize, size_t cap,
+                            uint64_t seed0, uint64_t seed1,
+                            uint64_t (*hash)(const void *item,
+                                             uint64_t seed0, uint64_t seed1),
+                            int (*compare)(const void *a, const void *b,
+                                           void *udata),
+                            void (*elfree)(void *item),
+                            void *udata)
+{
+    _malloc = _malloc ? _malloc : malloc;
+    _free = _free ? _free : free;
+    size_t bucketsz = sizeof(struct bucket) + elsize;
+    while (bucketsz & (sizeof(uintptr_t)-1)) {
+        bucketsz++;
+    }
+    // shashmap + spare + edata
+    struct shashmap *map = _malloc(sizeof(struct shashmap)+bucketsz*2);
+    if (!map) {
+        return NULL;
+    }
+    memset(map, 0, sizeof(struct shashmap));
+    map->malloc = _malloc;
+    map->free = _free;
+    map->elsize = elsize;
+    map->bucketsz = bucketsz;
+    map->cap = cap;
+    map->seed0 = seed0;
+    map->seed1 = seed1;
+    map->hash = hash;
+    map->compare = compare;
+    map->elfree = elfree;
+    map->udata = udata;
+    map->spare = ((char*)map)+sizeof(struct shashmap);
+    map->edata = (char*)map->spare+bucketsz;
+    if (!shm_init(map, cap)) {
+        _free(map);
+        return NULL;
+    }
+    return map;
+}
+
+// shashmap_new returns a new segmented hash map. The parameters and the
+// functions are the same as for hashmap_new, but the table grows one segment
+// of SHM_SEGMENT buckets at a time instead of doubling as a whole. `cap` is
+// the number of items the map holds before its first split. The segments
+// for it, a power of two of them, are allocated up front.
+struct shashmap *shashmap_new(size_t elsize, size_t cap,
+                            uint64_t seed0, uint64_t seed1,
+                            uint64_t (*hash)(const void *item,
+                                             uint64_t seed0, uint64_t seed1),
+                            int (*compare)(const void *a, const void *b,
+                                           void *udata),
+                            void (*elfree)(void *item),
+                            void *udata)
+{
+    return shashmap_new_with_allocator(
+        (_malloc?_malloc:malloc),
+        (_free?_free:free),
+        elsize, cap, seed0, seed1, hash, compare, elfree, udata
+    );
+}
+
+// shashmap_free frees the map and calls elfree for every item.
+void shashmap_free(struct shashmap *map) {
+    if (!map) return;
+    shm_freesegments(map);
+    map->free(map);
+}
+
+// shashmap_clear removes all items, see hashmap_clear. With update_cap the
+// segments are kept, otherwise the map goes back to its initial capacity.
+void shashmap_clear(struct shashmap *map, bool update_cap) {
+    if (update_cap) {
+        for (size_t i = 0; i < ((size_t)1<<map->depth); i++) {
+            struct shm_segment *seg = map->dir[i];
+            if (!shm_first(map, i)) {
+                continue;
+            }
+            for (size_t j = 0; map->elfree && j < SHM_SEGMENT; j++) {
+                struct bucket *bucket = shm_bucket(map, seg, j);
+                if (bucket->dib) map->elfree(bucket_item(bucket));
+            }
+            memset(seg->buckets, 0, map->bucketsz*SHM_SEGMENT);
+            seg->count = 0;
+        }
+        map->count = 0;
+        return;
+    }
+    struct shm_segment **dir = map->dir;
+    size_t depth = map->depth, nsegments = map->nsegments;
+    if (!shm_init(map, map->cap)) {
+        // keep the segments and empty them instead
+        map->dir = dir;
+        map->depth = depth;
+        map->nsegments = nsegments;
+        shashmap_clear(map, true);
+        return;
+    }
+    struct shm_segment **initdir = map->dir;
+    size_t initdepth = map->depth, initn = map->nsegments;
+    map->dir = dir;
+    map->depth = depth;
+    shm_freesegments(map);
+    map->dir = initdir;
+    map->depth = initdepth;
+    map->nsegments = initn;
+}
+
+// shashmap_count returns the number of items in the map.
+size_t shashmap_count(struct shashmap *map) {
+    return map->count;
+}
+
+// shashmap_oom returns true if the last shashmap_set() call failed due to the
+// system being out of memory.
+bool shashmap_oom(struct shashmap *map) {
+    return map->oom;
+}
+
+// shashmap_get returns the item based on the provided key. If the item is not
+// found then NULL is returned.
+void *shashmap_get(struct shashmap *map, const void *key) {
+    if (!key) {
+        panic("key is null");
+    }
+    uint64_t hash = map->hash(key, map->seed0, map->seed1) << 16 >> 16;
+    struct shm_segment *seg = shm_segment_for(map, hash);
+    size_t i = shm_home(hash);
+    size_t probes = 1;
+    for (;;) {
+        struct bucket *bucket = shm_bucket(map, seg, i);
+        if (!bucket->dib) {
+            STAT_PROBE(map, probes, false);
+            return NULL;
+        }
+        if (bucket->hash == hash &&
+            map->compare(key, bucket_item(bucket), map->udata) == 0)
+        {
+            STAT_PROBE(map, probes, true);
+            return bucket_item(bucket);
+        }
+        i = (i + 1) & (SHM_SEGMENT-1);
+        probes++;
+    }
+}
+
+// shashmap_set inserts or replaces an item in the map. If an item is replaced
+// then it is returned otherwise NULL is returned. When the segment of a new
+// item is full and can't be split, NULL is returned and shashmap_oom()
+// returns true. A replace always succeeds.
+void *shashmap_set(struct shashmap *map, const void *item) {
+    if (!item) {
+        panic("item is null");
+    }
+    map->oom = false;
+    uint64_t hash = map->hash(item, map->seed0, map->seed1) << 16 >> 16;
+    struct shm_segment *seg = shm_segment_for(map, hash);
+    // look the key up first, so that a full segment only fails inserts
+    size_t i = shm_home(hash);
+    for (size_t dib = 1;; dib++) {
+        struct bucket *bucket = shm_bucket(map, seg, i);
+        if (bucket->dib < dib) {
+            break;
+        }
+        if (bucket->hash == hash &&
+            map->compare(item, bucket_item(bucket), map->udata) == 0)
+        {
+            memcpy(map->spare, bucket_item(bucket), map->elsize);
+            memcpy(bucket_item(bucket), item, map->elsize);
+            return map->spare;
+        }
+        i = (i + 1) & (SHM_SEGMENT-1);
+    }
+    while (seg->count >= SHM_GROWAT) {
+        if (!shm_split(map, hash & (((size_t)1<<map->depth)-1))) {
+            // an overloaded segment still works, but one bucket must stay
+            // empty to end the probes
+            if (seg->count >= SHM_SEGMENT-1) {
+                map->oom = true;
+                return NULL;
+            }
+            break;
+        }
+        seg = shm_segment_for(map, hash);
+    }
+
+    struct bucket *entry = map->edata;
+    entry->hash = hash;
+    entry->dib = 1;
+    memcpy(bucket_item(entry), item, map->elsize);
+
+    i = shm_home(hash);
+    for (;;) {
+        struct bucket *bucket = shm_bucket(map, seg, i);
+        if (bucket->dib == 0) {
+            memcpy(bucket, entry, map->bucketsz);
+            seg->count++;
+            map->count++;
+            return NULL;
+        }
+        if (bucket->dib < entry->dib) {
+            memcpy(map->spare, bucket, map->bucketsz);
+            memcpy(bucket, entry, map->bucketsz);
+            memcpy(entry, map->spare, map->bucketsz);
+        }
+        i = (i + 1) & (SHM_SEGMENT-1);
+        entry->dib += 1;
+    }
+}
+
+// shashmap_upsert returns the item of `key` for the caller to write into, see
+// hashmap_upsert.
+void *shashmap_upsert(struct shashmap *map, const void *key, bool *found) {
+    if (!key) {
+        panic("key is null");
+    }
+    map->oom = false;
+    uint64_t hash = map->hash(key, map->seed0, map->seed1) << 16 >> 16;
+    struct shm_segment *seg = shm_segment_for(map, hash);
+    size_t i = shm_home(hash);
+    size_t dib = 1;
+    for (;; dib++) {
+        struct bucket *bucket = shm_bucket(map, seg, i);
+        if (bucket->dib < dib) {
+            break;
+        }
+        if (bucket->hash == hash &&
+            map->compare(key, bucket_item(bucket), map->udata) == 0)
+        {
+            *found = true;
+            return bucket_item(bucket);
+        }
+        i = (i + 1) & (SHM_SEGMENT-1);
+    }
+    if (seg->count >= SHM_GROWAT) {
+        // split as shashmap_set does and look for the spot again
+        while (seg->count >= SHM_GROWAT) {
+            if (!shm_split(map, hash & (((size_t)1<<map->depth)-1))) {
+                if (seg->count >= SHM_SEGMENT-1) {
+                    map->oom = true;
+                    return NULL;
+                }
+                break;
+            }
+            seg = shm_segment_for(map, hash);
+        }
+        i = shm_home(hash);
+        for (dib = 1; shm_bucket(map, seg, i)->dib >= dib; dib++) {
+            i = (i + 1) & (SHM_SEGMENT-1);
+        }
+    }
+    size_t j = i;
+    while (shm_bucket(map, seg, j)->dib) {
+        j = (j + 1) & (SHM_SEGMENT-1);
+    }
+    for (; j != i; j = (j - 1) & (SHM_SEGMENT-1)) {
+        struct bucket *bucket = shm_bucket(map, seg, j);
+        memcpy(bucket, shm_bucket(map, seg, (j - 1) & (SHM_SEGMENT-1)),
+               map->bucketsz);
+        bucket->dib++;
+    }
+    struct bucket *bucket = shm_bucket(map, seg, i);
+    bucket->hash = hash;
+    bucket->dib = dib;
+    seg->count++;
+    map->count++;
+    *found = false;
+    return bucket_item(bucket);
+}
+
+// shashmap_delete removes an item from the map and returns it. If the item is
+// not found then NULL is returned.
+void *shashmap_delete(struct shashmap *map, const void *key) {
+    if (!key) {
+        panic("key is null");
+    }
+    map->oom = false;
+    uint64_t hash = map->hash(key, map->seed0, map->seed1) << 16 >> 16;
+    struct shm_segment *seg = shm_segment_for(map, hash);
+    size_t i = shm_home(hash);
+    for (;;) {
+        struct bucket *bucket = shm_bucket(map, seg, i);
+        if (!bucket->dib) {
+            return NULL;
+        }
+        if (bucket->hash == hash &&
+            map->compare(key, bucket_item(bucket), map->udata) == 0)
+        {
+            memcpy(map->spare, bucket_item(bucket), map->elsize);
+            bucket->dib = 0;
+            for (;;) {
+                struct bucket *prev = bucket;
+                i = (i + 1) & (SHM_SEGMENT-1);
+                bucket = shm_bucket(map, seg, i);
+                if (bucket->dib <= 1) {
+                    prev->dib = 0;
+                    break;
+                }
+                memcpy(prev, bucket, map->bucketsz);
+                prev->dib--;
+            }
+            seg->count--;
+            map->count--;
+            return map->spare;
+        }
+        i = (i + 1) & (SHM_SEGMENT-1);
+    }
+}
+
+// shashmap_probe returns the item in the home bucket of the hash `position`,
+// or NULL if that bucket is empty.
+void *shashmap_probe(struct shashmap *map, uint64_t position) {
+    struct shm_segment *seg = shm_segment_for(map, position);
+    struct bucket *bucket = shm_bucket(map, seg, shm_home(position));
+    if (!bucket->dib) {
+        return NULL;
+    }
+    return bucket_item(bucket);
+}
+
+// shashmap_scan iterates over all items in the map, see hashmap_scan.
+bool shashmap_scan(struct shashmap *map,
+                   bool (*iter)(const void *item, void *udata), void *udata)
+{
+    for (size_t i = 0; i < ((size_t)1<<map->depth); i++) {
+        struct shm_segment *seg = map->dir[i];
+        if (!shm_first(map, i)) {
+            continue;
+        }
+        for (size_t j = 0; j < SHM_SEGMENT; j++) {
+            struct bucket *bucket = shm_bucket(map, seg, j);
+            if (bucket->dib && !iter(bucket_item(bucket), udata)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// shm_scan_home calls iter for each item of segment `seg` whose home is
+// bucket h and whose low hash bits, as many as the directory uses, are d.
+static bool shm_scan_home(struct shashmap *map, struct shm_segment *seg,
+                          size_t d, size_t h,
+                          bool (*iter)(const void *item, void *udata),
+                          void *udata)
+{
+    size_t mask = ((size_t)1<<map->depth)-1;
+    size_t i = h;
+    for (size_t dib = 1; ; dib++) {
+        struct bucket *bucket = shm_bucket(map, seg, i);
+        if (bucket->dib < dib) {
+            return true;
+        }
+        if (bucket->dib == dib && (bucket->hash & mask) == d &&
+            !iter(bucket_item(bucket), udata))
+        {
+            return false;
+        }
+        i = (i + 1) & (SHM_SEGMENT-1);
+    }
+}
+
+// shashmap_scan_cursor continues a scan at `cursor` over at most `count`
+// buckets, see hashmap_scan_cursor. The cursor holds a directory entry above
+// the low SHM_SEGBITS bits and a home bucket below them. Each directory entry
+// is scanned on its own, so a segment is visited once for every entry that
+// points to it, and the entries follow in reverse-binary order, so splits of
+// segments and of the directory between calls skip no items.
+int shashmap_scan_cursor(struct shashmap *map, size_t *cursor, size_t count,
+                         bool (*iter)(const void *item, void *udata),
+                         void *udata)
+{
+    size_t mask = ((size_t)1<<map->depth)-1;
+    size_t d = (*cursor>>SHM_SEGBITS) & mask;
+    size_t h = *cursor & (SHM_SEGMENT-1);
+    if (count == 0) {
+        count = 1;
+    }
+    do {
+        if (!shm_scan_home(map, map->dir[d], d, h, iter, udata)) {
+            *cursor = d<<SHM_SEGBITS|h;
+            return -1;
+        }
+        if (++h == SHM_SEGMENT) {
+            h = 0;
+            d = cursor_next(d, mask);
+        }
+    } while ((d != 0 || h != 0) && --count > 0);
+    *cursor = d<<SHM_SEGBITS|h;
+    return *cursor != 0;
+}
+
+// shm_scan_range scans the buckets [a, b) of the directory in order, with
+// SHM_SEGBITS bits of bucket below the directory entry, as shashmap_iter.
+static bool shm_scan_range(struct scan_part *part) {
+    struct shashmap *map = part->map;
+    for (size_t i = part->a; i < part->b; i++) {
+        size_t d = i>>SHM_SEGBITS;
+        if (!shm_first(map, d)) {
+            i |= SHM_SEGMENT-1;
+            continue;
+        }
+        struct bucket *bucket =
+            shm_bucket(map, map->dir[d], i & (SHM_SEGMENT-1));
+        if (bucket->dib && (scan_stopped(part) ||
+                            !part->iter(bucket_item(bucket), part->udata)))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// shashmap_scan_parallel iterates over all items with `nthreads` threads,
+// see hashmap_scan_parallel.
+bool shashmap_scan_parallel(struct shashmap *map, int nthreads,
+                            bool (*iter)(const void *item, void *udata),
+                            void **udata,
+                            void (*reduce)(void *into, void *from))
+{
+    return scan_parallel(map, map->malloc, map->free,
+                         ((size_t)1<<map->depth)*SHM_SEGMENT, nthreads,
+                         shm_scan_range, iter, udata, reduce);
+}
+
+// shashmap_iter iterates one item at a time, see hashmap_iter. The cursor
+// counts buckets in directory order, so it must be reset to 0 after the map
+// was changed.
+bool shashmap_iter(struct shashmap *map, size_t *i, void **item) {
+    for (;;) {
+        size_t d = *i>>SHM_SEGBITS;
+        if (d >= ((size_t)1<<map->depth)) {
+            return false;
+        }
+        if (!shm_first(map, d)) {
+            *i = (d+1)<<SHM_SEGBITS;
+            continue;
+        }
+        struct bucket *bucket =
+            shm_bucket(map, map->dir[d], *i & (SHM_SEGMENT-1));
+        (*i)++;
+        if (bucket->dib) {
+            *item = bucket_item(bucket);
+            return true;
+        }
+    }
+}
+
+// shashmap_stats copies the statistics of the map into `stats`, counting
+// segment splits as resizes. Returns false, leaving `stats` zeroed, unless
+// compiled with -DTTLMAP_STATS.
+bool shashmap_stats(struct shashmap *map, struct hashmap_stats *stats) {
+    memset(stats, 0, sizeof(struct hashmap_stats));
+#ifdef TTLMAP_STATS
+    memcpy(stats, &map->stats, sizeof(struct hashmap_stats));
+    stats->count = map->count;
+    stats->nbuckets = map->nsegments*SHM_SEGMENT;
+    return true;
+#else
+    (void)map;
+    return false;
+#endif
+}
+
+//-----------------------------------------------------------------------------
+// Huge-page and NUMA-aware allocators
+//
+// Allocations of a huge page or more (the bucket arrays) are served straight
+// from mmap. A MAP_HUGETLB mapping is tried first and, when no hugetlbfs pages
+// are reserved, a 2MB aligned anonymous mapping with a MADV_HUGEPAGE hint is
+// used instead. The header lives in a small page just below the 2MB aligned
+// region, so a table of exactly N huge pages takes N huge pages. The NUMA
+// policy is applied with mbind before the memory is first touched. Smaller
+// allocations, such as the hashmap struct itself, fall back to malloc.
+//-----------------------------------------------------------------------------
+#define HUGE_PAGESZ     (2*1024*1024)
+#define HUGE_MINSZ      HUGE_PAGESZ
+#define HUGE_HDRSZ      64
+
+#define HUGE_KIND_HEAP  0
+#define HUGE_KIND_MMAP  1
+
+#ifndef MPOL_BIND
+#define MPOL_BIND       2
+#endif
+#ifndef MPOL_INTERLEAVE
+#define MPOL_INTERLEAVE 3
+#endif
+
+struct huge_hdr {
+    size_t size;      // usable size requested by the caller
+    size_t maplen;    // length of the mapping, or 0 for heap allocations
+    void *mapaddr;    // start of the mapping
+    int kind;
+};
+
+static pthread_once_t huge_nodes_once = PTHREAD_ONCE_INIT;
+static unsigned long huge_nodes_mask = 0;
+
+static void huge_load_nodes(void) {
+    unsigned long m = 0;
+    FILE *f = fopen("/sys/devices/system/node/online", "r");
+    if (f) {
+        int lo, hi;
+        char sep;
+        while (fscanf(f, "%d", &lo) == 1) {
+            hi = lo;
+            sep = fgetc(f);
+            if (sep == '-') {
+                if (fscanf(f, "%d", &hi) != 1) break;
+                sep = fgetc(f);
+            }
+            for (int n = lo; n <= hi && n < HASHMAP_NUMA_MAXNODES; n++) {
+                m |= 1UL << n;
+            }
+            if (sep != ',') break;
+        }
+        fclose(f);
+    }
+    huge_nodes_mask = m;
+}
+
+// huge_online_nodes returns a bitmask of the online NUMA nodes, parsed once
+// from sysfs. Returns 0 when the information is not available.
+static unsigned long huge_online_nodes(void) {
+    pthread_once(&huge_nodes_once, huge_load_nodes);
+    return huge_nodes_mask;
+}
+
+static void huge_place(void *addr, size_t len, int placement) {
+#ifdef SYS_mbind
+    unsigned long nodes = huge_online_nodes();
+    unsigned long mask;
+    int mode;
+    if (placement == HASHMAP_NUMA_INTERLEAVE) {
+        // interleaving over a single node is pointless
+        if (!nodes || !(nodes & (nodes-1))) return;
+        mode = MPOL_INTERLEAVE;
+        mask = nodes;
+    } else if (placement >= 0) {
+        mask = 1UL << placement;
+        if (!(nodes & mask)) return;
+        mode = MPOL_BIND;
+    } else {
+        return;
+    }
+    // Best effort. A failed mbind leaves the default first-touch policy.
+    syscall(SYS_mbind, addr, len, mode, &mask, 
+            (unsigned long)HASHMAP_NUMA_MAXNODES+1, 0);
+#else
+    (void)addr; (void)len; (void)placement;
+#endif
+}
+
+static void *huge_malloc(size_t size, int placement) {
+    struct huge_hdr *hdr;
+    if (size < HUGE_MINSZ) {
+        char *mem = malloc(HUGE_HDRSZ+size);
+        if (!mem) return NULL;
+        hdr = (struct huge_hdr*)mem;
+        hdr->size = size;
+        hdr->maplen = 0;
+        hdr->mapaddr = NULL;
+        hdr->kind = HUGE_KIND_HEAP;
+        return mem+HUGE_HDRSZ;
+    }
+    size_t len = (size+HUGE_PAGESZ-1) & ~((size_t)HUGE_PAGESZ-1);
+    size_t pagesz = (size_t)sysconf(_SC_PAGESIZE);
+    if (len < size) {
+        return NULL;
+    }
+    // Reserve room for a 2MB aligned region with one small page below it,
+    // then map the header page and the region over the reservation and
+    // trim the rest.
+    size_t rsvlen = len+HUGE_PAGESZ+pagesz;
+    char *raw = mmap(NULL, rsvlen, PROT_NONE, 
+                     MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+    if (raw == MAP_FAILED) {
+        return NULL;
+    }
+    char *mem = (char*)(((uintptr_t)raw+pagesz+HUGE_PAGESZ-1) & 
+                        ~((uintptr_t)HUGE_PAGESZ-1));
+    char *base = mem-pagesz;
+    char *ret = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    ret = mmap(mem, len, PROT_READ|PROT_WRITE, 
+               MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED|MAP_HUGETLB, -1, 0);
+#endif
+    if (ret == MAP_FAILED) {
+        ret = mmap(mem, len, PROT_READ|PROT_WRITE, 
+                   MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED, -1, 0);
+#ifdef MADV_HUGEPAGE
+        if (ret != MAP_FAILED) {
+            madvise(mem, len, MADV_HUGEPAGE);
         }
+#endif
     }
-    return true;
+    if (ret == MAP_FAILED || 
+        mmap(base, pagesz, PROT_READ|PROT_WRITE, 
+             MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED, -1, 0) == MAP_FAILED)
+    {
+        munmap(raw, rsvlen);
+        return NULL;
+    }
+    if (base > raw) {
+        munmap(raw, base-raw);
+    }
+    if (raw+rsvlen > mem+len) {
+        munmap(mem+len, (raw+rsvlen)-(mem+len));
+    }
+    huge_place(mem, len, placement);
+    hdr = (struct huge_hdr*)(mem-HUGE_HDRSZ);
+    hdr->size = size;
+    hdr->maplen = len+pagesz;
+    hdr->mapaddr = base;
+    hdr->kind = HUGE_KIND_MMAP;
+    return mem;
 }
 
+static void huge_free(void *ptr) {
+    if (!ptr) return;
+    struct huge_hdr *hdr = (struct huge_hdr*)((char*)ptr-HUGE_HDRSZ);
+    if (hdr->kind == HUGE_KIND_MMAP) {
+        munmap(hdr->mapaddr, hdr->maplen);
+    } else {
+        free(hdr);
+    }
+}
 
-// hashmap_iter iterates one key at a time yielding a reference to an
-// entry at each iteration. Useful to write simple loops and avoid writing
-// dedicated callbacks and udata structures, as in hashmap_scan.
-//
-// map is a hash map handle. i is a pointer to a size_t cursor that
-// should be initialized to 0 at the beginning of the loop. item is a void
-// pointer pointer that is populated with the retrieved item. Note that this
-// is NOT a copy of the item stored in the hash map and can be directly
-// modified.
-//
-// Note that if hashmap_delete() is called on the hashmap being iterated,
-// the buckets are rearranged and the iterator must be reset to 0, otherwise
-// unexpected results may be returned after deletion.
-//
-// This function has not been tested for thread safety.
-//
-// The function returns true if an item was retrieved; false if the end of the
-// iteration has been reached.
-bool hashmap_iter(struct hashmap *map, size_t *i, void **item)
-{
-    struct bucket *bucket;
+static void *huge_realloc(void *ptr, size_t size, int placement) {
+    if (!ptr) {
+        return huge_malloc(size, placement);
+    }
+    struct huge_hdr *hdr = (struct huge_hdr*)((char*)ptr-HUGE_HDRSZ);
+    void *mem = huge_malloc(size, placement);
+    if (!mem) {
+        return NULL;
+    }
+    memcpy(mem, ptr, hdr->size < size ? hdr->size : size);
+    huge_free(ptr);
+    return mem;
+}
 
-    do {
-        if (*i >= map->nbuckets) return false;
+// The allocator callbacks take no context, so every placement gets its own
+// set of functions.
+#define HUGE_ALLOCATOR(name, placement) \
+static void *name##_malloc(size_t size) { \
+    return huge_malloc(size, (placement)); \
+} \
+static void *name##_realloc(void *ptr, size_t size) { \
+    return huge_realloc(ptr, size, (placement)); \
+} \
+static const struct hashmap_allocator name = { \
+    name##_malloc, name##_realloc, huge_free \
+};
 
-        bucket = bucket_at(map, *i);
-        (*i)++;
-    } while (!bucket->dib);
+HUGE_ALLOCATOR(huge_default, HASHMAP_NUMA_DEFAULT)
+HUGE_ALLOCATOR(huge_interleave, HASHMAP_NUMA_INTERLEAVE)
+HUGE_ALLOCATOR(huge_node0, 0)
+HUGE_ALLOCATOR(huge_node1, 1)
+HUGE_ALLOCATOR(huge_node2, 2)
+HUGE_ALLOCATOR(huge_node3, 3)
+HUGE_ALLOCATOR(huge_node4, 4)
+HUGE_ALLOCATOR(huge_node5, 5)
+HUGE_ALLOCATOR(huge_node6, 6)
+HUGE_ALLOCATOR(huge_node7, 7)
 
-    *item = bucket_item(bucket);
+static const struct hashmap_allocator *huge_nodes[HASHMAP_NUMA_MAXNODES] = {
+    &huge_node0, &huge_node1, &huge_node2, &huge_node3,
+    &huge_node4, &huge_node5, &huge_node6, &huge_node7,
+};
 
-    return true;
+// hashmap_huge_allocator returns an allocator that places large allocations
+// on huge pages. It's meant to be passed to hashmap_new_with_allocator.
+// Param `placement` is HASHMAP_NUMA_DEFAULT to keep the kernel's first-touch
+// policy, HASHMAP_NUMA_INTERLEAVE to spread pages over all online nodes, or a
+// node number to bind the memory to that node, which is useful for giving
+// each shard of a sharded map its own node. Returns NULL for an unsupported
+// node number.
+const struct hashmap_allocator *hashmap_huge_allocator(int placement) {
+    if (placement == HASHMAP_NUMA_DEFAULT) {
+        return &huge_default;
+    }
+    if (placement == HASHMAP_NUMA_INTERLEAVE) {
+        return &huge_interleave;
+    }
+    if (placement < 0 || placement >= HASHMAP_NUMA_MAXNODES) {
+        return NULL;
+    }
+    return huge_nodes[placement];
 }
 
-
 //-----------------------------------------------------------------------------
 // SipHash reference C implementation
 //
@@ -618,17 +3349,6 @@ uint64_t hashmap_murmur(const void *data, size_t len,
 //==============================================================================
 #ifdef HASHMAP_TEST
 
-static size_t deepcount(struct hashmap *map) {
-    size_t count = 0;
-    for (size_t i = 0; i < map->nbuckets; i++) {
-        if (bucket_at(map, i)->dib) {
-            count++;
-        }
-    }
-    return count;
-}
-
-
 #pragma GCC diagnostic ignored "-Wextra"
 
 
@@ -639,6 +3359,20 @@ static size_t deepcount(struct hashmap *map) {
 #include <stdio.h>
 #include "hashmap.h"
 
+// deepcount counts the occupied buckets, checking the occupancy bitmap
+// against every bucket on the way.
+static size_t deepcount(struct hashmap *map) {
+    size_t count = 0;
+    for (size_t i = 0; i < map->nbuckets; i++) {
+        bool used = (map->used[i>>6]>>(i&63))&1;
+        assert(used == (entry_dib(map, bucket_at(map, i)) != 0));
+        if (used) {
+            count++;
+        }
+    }
+    return count;
+}
+
 static bool rand_alloc_fail = false;
 static int rand_alloc_fail_odds = 3; // 1 in 3 chance malloc will fail.
 static uintptr_t total_allocs = 0;
@@ -705,6 +3439,659 @@ static void free_str(void *item) {
     xfree(*(char**)item);
 }
 
+static void huge_alloc() {
+    int N = 100000;
+    const struct hashmap_allocator *a = hashmap_huge_allocator(HASHMAP_NUMA_DEFAULT);
+    assert(a);
+    assert(hashmap_huge_allocator(HASHMAP_NUMA_INTERLEAVE));
+    assert(hashmap_huge_allocator(0));
+    assert(!hashmap_huge_allocator(HASHMAP_NUMA_MAXNODES));
+    struct hashmap *map = hashmap_new_with_allocator(a->malloc, a->realloc,
+        a->free, sizeof(int), 0, 0, 0, hash_int, compare_ints_udata, NULL, NULL);
+    assert(map);
+    for (int i = 0; i < N; i++) {
+        assert(!hashmap_set(map, &i));
+    }
+    for (int i = 0; i < N; i++) {
+        int *v = hashmap_get(map, &i);
+        assert(v && *v == i);
+    }
+    for (int i = 0; i < N; i++) {
+        int *v = hashmap_delete(map, &i);
+        assert(v && *v == i);
+    }
+    assert(hashmap_count(map) == 0);
+    hashmap_free(map);
+}
+
+static bool keep_odd(void *item, void *udata) {
+    return *(int*)item % 2;
+}
+
+static void filter_and_load() {
+    int N = 10000;
+    struct hashmap *map;
+    while (!(map = hashmap_new(sizeof(int), 0, 1, 2, hash_int, 
+                               compare_ints_udata, NULL, NULL))) {}
+    for (int i = 0; i < N; i++) {
+        while (!hashmap_set(map, &i) && hashmap_oom(map)) {}
+    }
+    assert(hashmap_filter(map, keep_odd, NULL) == N/2);
+    assert(map->count == N/2);
+    assert(map->count == deepcount(map));
+    for (int i = 0; i < N; i++) {
+        int *v = hashmap_get(map, &i);
+        assert(i % 2 ? (v && *v == i) : !v);
+    }
+
+    struct hashmap *map2;
+    while (!(map2 = hashmap_new(sizeof(int), 0, 1, 2, hash_int, 
+                                compare_ints_udata, NULL, NULL))) {}
+    size_t nbuckets, bucketsz;
+    const void *buckets = hashmap_buckets(map, &nbuckets, &bucketsz);
+    while (!hashmap_load(map2, buckets, nbuckets, bucketsz)) {
+        assert(hashmap_oom(map2));
+    }
+    assert(map2->count == map->count);
+    for (int i = 1; i < N; i += 2) {
+        int *v = hashmap_get(map2, &i);
+        assert(v && *v == i);
+        v = hashmap_delete(map, &i);
+        assert(v && *v == i);
+    }
+    assert(map->count == 0 && deepcount(map) == 0);
+    hashmap_free(map2);
+    hashmap_free(map);
+}
+
+struct chm_worker {
+    pthread_t tid;
+    struct chashmap *map;
+    int id;
+    int N;
+};
+
+// Every worker owns the keys equal to its id modulo 4, and checks that the
+// keys of the others are never seen half written.
+static void *chm_work(void *arg) {
+    struct chm_worker *w = arg;
+    int kv[2];
+    for (int round = 0; round < 3; round++) {
+        for (int i = w->id; i < w->N; i += 4) {
+            kv[0] = i, kv[1] = i*2;
+            chashmap_set(w->map, kv);
+        }
+        for (int i = 0; i < w->N; i++) {
+            chashmap_enter();
+            int *v = chashmap_get(w->map, &i);
+            assert(!v || v[1] == i*2);
+            if (i%4 == w->id) assert(v);
+            chashmap_leave();
+        }
+        for (int i = w->id; i < w->N; i += 8) {
+            assert(chashmap_delete(w->map, &i));
+        }
+    }
+    return NULL;
+}
+
+static bool even_val(const void *item, void *udata) {
+    return ((const int*)item)[1] % 2 == 0;
+}
+
+static void concurrent() {
+    int N = 20000, kv[2];
+    struct chashmap *map;
+    struct chm_worker ws[4];
+    rand_alloc_fail = false;
+    // the allocator of the tests is not thread-safe
+    map = chashmap_new_with_allocator(malloc, free, sizeof(kv), 0, 1, 2,
+                                      hash_int, compare_ints_udata, NULL, NULL);
+    for (int i = 0; i < 4; i++) {
+        ws[i] = (struct chm_worker){.map = map, .id = i, .N = N};
+        assert(pthread_create(&ws[i].tid, NULL, chm_work, &ws[i]) == 0);
+    }
+    for (int i = 0; i < 4; i++) {
+        pthread_join(ws[i].tid, NULL);
+    }
+    assert(chashmap_count(map) == (size_t)N/2);
+    size_t iter = 0, n = 0;
+    void *item;
+    while (chashmap_iter(map, &iter, &item)) n++;
+    assert(n == chashmap_count(map));
+    chashmap_free(map);
+
+    map = chashmap_new(sizeof(kv), 0, 1, 2, hash_int, compare_ints_udata,
+                       NULL, NULL);
+    for (int i = 0; i < N; i++) {
+        kv[0] = i, kv[1] = i;
+        assert(!chashmap_set(map, kv));
+    }
+    kv[0] = 7, kv[1] = 8;
+    assert(((int*)chashmap_set(map, kv))[1] == 7);
+    assert(chashmap_delete_if(map, &kv[0], even_val, NULL));
+    kv[0] = 9;
+    assert(!chashmap_delete_if(map, &kv[0], even_val, NULL));
+    assert(chashmap_count(map) == (size_t)N-1);
+    kv[0] = 9, kv[1] = 10;
+    assert(!chashmap_set_if(map, kv, even_val, NULL));
+    assert(!chashmap_set_if(map, kv, NULL, NULL));
+    assert(((int*)chashmap_get(map, &kv[0]))[1] == 9);
+    kv[0] = 8, kv[1] = 11;
+    assert(chashmap_set_if(map, kv, even_val, NULL));
+    assert(((int*)chashmap_get(map, &kv[0]))[1] == 11);
+    kv[0] = N;
+    assert(chashmap_set_if(map, kv, NULL, NULL));
+    assert(chashmap_count(map) == (size_t)N);
+    chashmap_clear(map, false);
+    assert(chashmap_count(map) == 0 && !chashmap_get(map, &kv[0]));
+    chashmap_free(map);
+}
+
+static void parallel_resize() {
+    int N = 400000;
+    struct hashmap *map;
+    rand_alloc_fail = false;
+    // 3 threads split the table into ranges that are not a power of two
+    for (int nthreads = 3; nthreads <= 4; nthreads++) {
+        map = hashmap_new(sizeof(int), 0, 1, 2, hash_int, compare_ints_udata, 
+                          NULL, NULL);
+        hashmap_set_resizers(map, nthreads);
+        for (int i = 0; i < N; i++) {
+            assert(!hashmap_set(map, &i));
+        }
+        assert(map->nbuckets > RESIZE_PAR_MIN*2);
+        assert(hashmap_count(map) == (size_t)N && deepcount(map) == (size_t)N);
+        for (int i = 0; i < N; i++) {
+            int *v = hashmap_get(map, &i);
+            assert(v && *v == i);
+        }
+        for (int i = 0; i < N; i += 2) {
+            assert(hashmap_delete(map, &i));
+        }
+        for (int i = 0; i < N; i++) {
+            assert(!hashmap_get(map, &i) == (i % 2 == 0));
+        }
+        assert(deepcount(map) == (size_t)N/2);
+        hashmap_free(map);
+    }
+}
+
+// upsert_check verifies that the dib of every item is its distance from its
+// home bucket, and that no item is further from home than the one after it
+// would allow, which is what robin-hood insertion guarantees.
+static void upsert_check(struct hashmap *map) {
+    for (size_t i = 0; i < map->nbuckets; i++) {
+        struct bucket *bucket = bucket_at(map, i);
+        if (!bucket->dib) continue;
+        size_t home = bucket->hash & map->mask;
+        assert(bucket->dib-1 == ((i-home) & map->mask));
+        struct bucket *next = bucket_at(map, (i+1) & map->mask);
+        assert(!next->dib || next->dib <= bucket->dib+1);
+    }
+}
+
+static void upsert() {
+    int N = 20000;
+    int *vals = xmalloc(N * sizeof(int));
+    for (int i = 0; i < N; i++) {
+        vals[i] = i;
+    }
+    shuffle(vals, N, sizeof(int));
+    rand_alloc_fail = false;
+    struct hashmap *map = hashmap_new(sizeof(int), 0, 1, 2, hash_int,
+                                      compare_ints_udata, NULL, NULL);
+    struct shashmap *smap = shashmap_new(sizeof(int), 0, 1, 2, hash_int,
+                                         compare_ints_udata, NULL, NULL);
+    bool found;
+    for (int i = 0; i < N; i++) {
+        int *v = hashmap_upsert(map, &vals[i], &found);
+        assert(v && !found);
+        *v = vals[i];
+        v = shashmap_upsert(smap, &vals[i], &found);
+        assert(v && !found);
+        *v = vals[i];
+        if (i % 3 == 0) {
+            assert(hashmap_delete(map, &vals[i/2]));
+            assert(shashmap_delete(smap, &vals[i/2]));
+            v = hashmap_upsert(map, &vals[i/2], &found);
+            assert(v && !found);
+            *v = vals[i/2];
+            v = shashmap_upsert(smap, &vals[i/2], &found);
+            assert(v && !found);
+            *v = vals[i/2];
+        }
+    }
+    upsert_check(map);
+    assert(hashmap_count(map) == (size_t)N && deepcount(map) == (size_t)N);
+    assert(shashmap_count(smap) == (size_t)N);
+    for (int i = 0; i < N; i++) {
+        int *v = hashmap_upsert(map, &i, &found);
+        assert(v && found && *v == i);
+        v = shashmap_upsert(smap, &i, &found);
+        assert(v && found && *v == i);
+        assert(*(int*)hashmap_get(map, &i) == i);
+        assert(*(int*)shashmap_get(smap, &i) == i);
+    }
+    hashmap_free(map);
+    shashmap_free(smap);
+    xfree(vals);
+}
+
+struct counter {
+    int key;
+    int n;
+};
+
+static uint64_t hash_counter(const void *item, uint64_t seed0,
+                             uint64_t seed1)
+{
+    return hashmap_murmur(item, sizeof(int), seed0, seed1);
+}
+
+// hash_clump puts runs of 200 keys on one hash, with the hashes 4096 apart,
+// so only a table of 4096 buckets per run keeps the dibs of a compact map
+// in range.
+static uint64_t hash_clump(const void *item, uint64_t seed0, uint64_t seed1) {
+    return (uint64_t)(*(int*)item/200) << 12;
+}
+
+static bool keep_even(void *item, void *udata) {
+    return ((struct counter*)item)->key % 2 == 0;
+}
+
+// compact_check verifies the dib and the fingerprint of every item in a
+// compact map, and that no item is further from home than the one after it
+// would allow.
+static void compact_check(struct hashmap *map) {
+    assert(map->compact);
+    for (size_t i = 0; i < map->nbuckets; i++) {
+        struct cbucket *bucket = cbucket_at(map, i);
+        if (!bucket->dib) continue;
+        uint64_t hash = get_hash(map, cbucket_item(bucket));
+        assert(bucket->fp == cbucket_fp(hash));
+        assert(bucket->dib-1 == ((i-(hash & map->mask)) & map->mask));
+        struct cbucket *next = cbucket_at(map, (i+1) & map->mask);
+        assert(!next->dib || next->dib <= bucket->dib+1);
+    }
+}
+
+static void compact() {
+    int N = 20000;
+    int *vals = xmalloc(N * sizeof(int));
+    for (int i = 0; i < N; i++) {
+        vals[i] = i;
+    }
+    shuffle(vals, N, sizeof(int));
+    rand_alloc_fail = false;
+    struct hashmap *map = hashmap_new(sizeof(struct counter), 0, 1, 2,
+                                      hash_counter, compare_ints_udata,
+                                      NULL, NULL);
+    assert(hashmap_set_compact(map));
+    assert(map->bucketsz == 12);
+    // count every key i%3+1 times
+    bool found;
+    for (int r = 0; r < 3; r++) {
+        for (int i = 0; i < N; i++) {
+            if (vals[i] % 3 < r) continue;
+            struct counter *c = hashmap_upsert(map, &vals[i], &found);
+            assert(c && found == (r > 0));
+            if (!found) {
+                c->key = vals[i];
+                c->n = 0;
+            }
+            c->n++;
+        }
+    }
+    compact_check(map);
+    assert(hashmap_count(map) == (size_t)N && deepcount(map) == (size_t)N);
+    for (int i = 0; i < N; i++) {
+        struct counter *c = hashmap_get(map, &i);
+        assert(c && c->key == i && c->n == i%3+1);
+    }
+    for (int i = 0; i < N; i += 4) {
+        struct counter *c = hashmap_delete(map, &i);
+        assert(c && c->key == i);
+        assert(!hashmap_get(map, &i));
+        c = hashmap_set(map, &(struct counter){ .key = i, .n = -1 });
+        assert(!c);
+        c = hashmap_set(map, &(struct counter){ .key = i, .n = -2 });
+        assert(c && c->n == -1);
+    }
+    compact_check(map);
+
+    // raw tables only load into a map of the same layout
+    size_t nbuckets, bucketsz;
+    const void *buckets = hashmap_buckets(map, &nbuckets, &bucketsz);
+    struct hashmap *map2 = hashmap_new(sizeof(struct counter), 0, 1, 2,
+                                       hash_counter, compare_ints_udata,
+                                       NULL, NULL);
+    assert(!hashmap_load(map2, buckets, nbuckets, bucketsz));
+    hashmap_set(map2, &(struct counter){ .key = 1 });
+    assert(!hashmap_set_compact(map2));
+    hashmap_delete(map2, &(int){1});
+    assert(hashmap_set_compact(map2));
+    assert(hashmap_load(map2, buckets, nbuckets, bucketsz));
+    assert(hashmap_count(map2) == (size_t)N && deepcount(map2) == (size_t)N);
+    assert(((struct counter*)hashmap_get(map2, &(int){4}))->n == -2);
+    hashmap_free(map2);
+
+    assert(hashmap_filter(map, keep_even, NULL) == (size_t)N/2);
+    compact_check(map);
+    assert(deepcount(map) == (size_t)N/2);
+    for (int i = 0; i < N; i++) {
+        assert(!hashmap_get(map, &i) == (i%2 == 1));
+        if (i%2 == 0) {
+            assert(hashmap_delete(map, &i));
+        }
+    }
+    assert(hashmap_count(map) == 0 && deepcount(map) == 0);
+    assert(map->nbuckets < 1024);
+    hashmap_free(map);
+
+    // clustered hashes grow the table until every dib fits in 8 bits
+    map = hashmap_new(sizeof(int), 0, 1, 2, hash_clump, compare_ints_udata,
+                      NULL, NULL);
+    assert(hashmap_set_compact(map));
+    assert(map->bucketsz == 8);
+    for (int i = 0; i < 2000; i++) {
+        assert(!hashmap_set(map, &i) && !hashmap_oom(map));
+    }
+    compact_check(map);
+    assert(map->nbuckets >= 10*4096);
+    for (int i = 0; i < 2000; i++) {
+        assert(*(int*)hashmap_get(map, &i) == i);
+    }
+    hashmap_free(map);
+    xfree(vals);
+}
+
+// hash_oneseg keeps every key in the segment of directory entry 0.
+static uint64_t hash_oneseg(const void *item, uint64_t seed0, uint64_t seed1) {
+    return (uint64_t)*(int*)item << SHM_MAXDEPTH;
+}
+
+static void segmented() {
+    int N = 50000;
+    struct shashmap *map;
+    rand_alloc_fail = false;
+    map = shashmap_new(sizeof(int), 0, 1, 2, hash_int, compare_ints_udata, 
+                       NULL, NULL);
+    for (int i = 0; i < N; i++) {
+        assert(!shashmap_set(map, &i));
+        assert(*(int*)shashmap_set(map, &i) == i);
+    }
+    assert(shashmap_count(map) == (size_t)N);
+    assert(map->nsegments > 1 && map->nsegments*SHM_GROWAT >= (size_t)N);
+    for (int i = 0; i < N; i += 3) {
+        assert(*(int*)shashmap_delete(map, &i) == i);
+        assert(!shashmap_delete(map, &i));
+    }
+    size_t iter = 0, n = 0;
+    void *item;
+    while (shashmap_iter(map, &iter, &item)) {
+        assert(*(int*)item % 3 != 0);
+        n++;
+    }
+    assert(n == shashmap_count(map));
+    for (int i = 0; i < N; i++) {
+        int *v = shashmap_get(map, &i);
+        assert(i % 3 == 0 ? !v : (v && *v == i));
+    }
+    shashmap_clear(map, true);
+    assert(shashmap_count(map) == 0 && map->nsegments > 1);
+    shashmap_clear(map, false);
+    assert(shashmap_count(map) == 0 && map->nsegments == 1);
+    for (int i = 0; i < N; i++) {
+        assert(!shashmap_set(map, &i));
+    }
+    assert(shashmap_count(map) == (size_t)N);
+    shashmap_free(map);
+
+    // fill one segment that can't split: inserts fail, replaces still work
+    map = shashmap_new(sizeof(int), 0, 1, 2, hash_oneseg, compare_ints_udata,
+                       NULL, NULL);
+    rand_alloc_fail = true;
+    rand_alloc_fail_odds = 1;
+    for (int i = 0; i < SHM_SEGMENT-1; i++) {
+        assert(!shashmap_set(map, &i) && !shashmap_oom(map));
+    }
+    int i = SHM_SEGMENT-1;
+    assert(!shashmap_set(map, &i) && shashmap_oom(map));
+    for (i = 0; i < SHM_SEGMENT-1; i++) {
+        assert(*(int*)shashmap_set(map, &i) == i && !shashmap_oom(map));
+    }
+    rand_alloc_fail = false;
+    rand_alloc_fail_odds = 3;
+    assert(shashmap_count(map) == SHM_SEGMENT-1 && map->nsegments == 1);
+    shashmap_free(map);
+}
+
+static bool cursor_iter(const void *item, void *udata) {
+    int *seen = udata;
+    int i = *(int*)item;
+    if (i < 10000) seen[i]++;
+    return true;
+}
+
+// cursor_put sets or deletes key i in a hashmap (0), chashmap (1),
+// shashmap (2) or compact hashmap (3).
+static void cursor_put(int kind, void *map, int i, bool del) {
+    switch (kind) {
+    case 0: case 3: del ? hashmap_delete(map, &i) : hashmap_set(map, &i); break;
+    case 1: del ? chashmap_delete(map, &i) : chashmap_set(map, &i); break;
+    default: del ? shashmap_delete(map, &i) : shashmap_set(map, &i); break;
+    }
+}
+
+// cursor_step runs one step of a cursor scan and then sets or deletes the
+// keys 10000+[from, to), so that the map grows and shrinks while scanned.
+static int cursor_step(int kind, void *map, size_t *cursor, int *seen,
+                       int from, int to, bool del)
+{
+    int more;
+    switch (kind) {
+    case 0: case 3: more = hashmap_scan_cursor(map, cursor, 16, cursor_iter, seen); break;
+    case 1: more = chashmap_scan_cursor(map, cursor, 16, cursor_iter, seen); break;
+    default: more = shashmap_scan_cursor(map, cursor, 16, cursor_iter, seen); break;
+    }
+    for (int i = 10000+from; i < 10000+to; i++) {
+        cursor_put(kind, map, i, del);
+    }
+    return more;
+}
+
+static bool stop_iter(const void *item, void *udata) {
+    (void)item;
+    return ++*(int*)udata != 1;
+}
+
+// cursor_stop runs one step of a cursor scan whose iter stops at the item
+// that brings *stops to 1.
+static int cursor_stop(int kind, void *map, size_t *cursor, int *stops) {
+    switch (kind) {
+    case 0: case 3: return hashmap_scan_cursor(map, cursor, 16, stop_iter, stops);
+    case 1: return chashmap_scan_cursor(map, cursor, 16, stop_iter, stops);
+    default: return shashmap_scan_cursor(map, cursor, 16, stop_iter, stops);
+    }
+}
+
+static void cursor_scan() {
+    int N = 10000;
+    int *seen = xmalloc(N*sizeof(int));
+    rand_alloc_fail = false;
+    for (int kind = 0; kind < 4; kind++) {
+        void *map;
+        switch (kind) {
+        case 0: case 3: map = hashmap_new(sizeof(int), 0, 1, 2, hash_int,
+                                          compare_ints_udata, NULL, NULL);
+                if (kind == 3) assert(hashmap_set_compact(map));
+                break;
+        case 1: map = chashmap_new(sizeof(int), 0, 1, 2, hash_int,
+                                   compare_ints_udata, NULL, NULL); break;
+        default: map = shashmap_new(sizeof(int), 0, 1, 2, hash_int,
+                                    compare_ints_udata, NULL, NULL); break;
+        }
+        for (int i = 0; i < N; i++) {
+            cursor_put(kind, map, i, false);
+        }
+        memset(seen, 0, N*sizeof(int));
+        // grow to several times the size during the first half of the scan,
+        // then delete the extra keys again so that tables shrink
+        size_t cursor = 0;
+        int step = 0, grow = 200000;
+        for (;;) {
+            int from = step*2000 % (2*grow);
+            bool del = from >= grow;
+            if (del) from -= grow;
+            step++;
+            int more = cursor_step(kind, map, &cursor, seen, from, from+2000,
+                                   del);
+            assert(more >= 0);
+            if (!more) {
+                break;
+            }
+        }
+        assert(step > 1);
+        for (int i = 0; i < N; i++) {
+            assert(seen[i] >= 1);
+        }
+        // a scan stopped by iter returns -1, even in bucket 0 where the
+        // cursor stays 0, and its cursor resumes it in the bucket it stopped
+        int stops = 0, ret;
+        cursor = 0;
+        while ((ret = cursor_stop(kind, map, &cursor, &stops)) > 0) {}
+        assert(ret == -1);
+        assert(stops == 1);
+        assert(cursor_stop(kind, map, &cursor, &stops) >= 0);
+        assert(stops > 1);
+        switch (kind) {
+        case 0: case 3: hashmap_free(map); break;
+        case 1: chashmap_free(map); break;
+        default: shashmap_free(map); break;
+        }
+    }
+    xfree(seen);
+}
+
+struct psum {
+    size_t count;
+    long long sum;
+};
+
+static bool psum_iter(const void *item, void *udata) {
+    struct psum *p = udata;
+    p->count++;
+    p->sum += *(int*)item;
+    return *(int*)item != -1;
+}
+
+static void psum_reduce(void *into, void *from) {
+    struct psum *a = into, *b = from;
+    a->count += b->count;
+    a->sum += b->sum;
+}
+
+static void parallel_scan() {
+    int N = 100000;
+    struct psum sums[4];
+    void *udata[4] = { &sums[0], &sums[1], &sums[2], &sums[3] };
+    rand_alloc_fail = false;
+    for (int kind = 0; kind < 4; kind++) {
+        void *map;
+        switch (kind) {
+        case 0: case 3: map = hashmap_new(sizeof(int), 0, 1, 2, hash_int,
+                                          compare_ints_udata, NULL, NULL);
+                if (kind == 3) assert(hashmap_set_compact(map));
+                break;
+        case 1: map = chashmap_new(sizeof(int), 0, 1, 2, hash_int,
+                                   compare_ints_udata, NULL, NULL); break;
+        default: map = shashmap_new(sizeof(int), 0, 1, 2, hash_int,
+                                    compare_ints_udata, NULL, NULL); break;
+        }
+        for (int i = 0; i < N; i++) {
+            cursor_put(kind, map, i, false);
+        }
+        for (int nthreads = 1; nthreads <= 4; nthreads++) {
+            bool ok;
+            memset(sums, 0, sizeof(sums));
+            switch (kind) {
+            case 0: case 3: ok = hashmap_scan_parallel(map, nthreads,
+                                                       psum_iter, udata,
+                                                       psum_reduce); break;
+            case 1: ok = chashmap_scan_parallel(map, nthreads, psum_iter,
+                                                udata, psum_reduce); break;
+            default: ok = shashmap_scan_parallel(map, nthreads, psum_iter,
+                                                 udata, psum_reduce); break;
+            }
+            assert(ok);
+            assert(sums[0].count == (size_t)N);
+            assert(sums[0].sum == (long long)N*(N-1)/2);
+        }
+        // an iter returning false stops all threads
+        cursor_put(kind, map, -1, false);
+        memset(sums, 0, sizeof(sums));
+        switch (kind) {
+        case 0: case 3: assert(!hashmap_scan_parallel(map, 4, psum_iter,
+                                                      udata, NULL)); break;
+        case 1: assert(!chashmap_scan_parallel(map, 4, psum_iter, udata,
+                                               NULL)); break;
+        default: assert(!shashmap_scan_parallel(map, 4, psum_iter, udata,
+                                                NULL)); break;
+        }
+        switch (kind) {
+        case 0: case 3: hashmap_free(map); break;
+        case 1: chashmap_free(map); break;
+        default: shashmap_free(map); break;
+        }
+    }
+}
+
+static void snapshot() {
+    int N = 20000;
+    struct hashmap *map, *map2;
+    size_t nbuckets, bucketsz, count;
+    rand_alloc_fail = false;
+    map = hashmap_new(sizeof(int), 0, 1, 2, hash_int, compare_ints_udata, 
+                      NULL, NULL);
+    for (int i = 0; i < N; i += 2) {
+        assert(!hashmap_set(map, &i));
+    }
+    assert(hashmap_snapshot_begin(map, &nbuckets, &bucketsz, &count));
+    assert(!hashmap_snapshot_begin(map, &nbuckets, &bucketsz, &count));
+    assert(count == (size_t)N/2);
+    char *image = xmalloc(nbuckets*bucketsz);
+    size_t off = 0, n;
+    int next = 1;
+    for (;;) {
+        n = 100;
+        assert(hashmap_snapshot_next(map, image+off*bucketsz, &n));
+        if (n == 0) {
+            break;
+        }
+        off += n;
+        // mutate between steps, growing the table past a resize
+        for (int j = 0; j < 200; j++, next += 2) {
+            assert(!hashmap_set(map, &next));
+            int del = next-1;
+            assert(del >= N || hashmap_delete(map, &del));
+        }
+    }
+    assert(off == nbuckets);
+    hashmap_snapshot_end(map);
+    map2 = hashmap_new(sizeof(int), 0, 1, 2, hash_int, compare_ints_udata, 
+                       NULL, NULL);
+    assert(hashmap_load(map2, image, nbuckets, bucketsz));
+    assert(hashmap_count(map2) == (size_t)N/2 && deepcount(map2) == (size_t)N/2);
+    for (int i = 0; i < N; i++) {
+        int *v = hashmap_get(map2, &i);
+        assert(i % 2 ? !v : (v && *v == i));
+    }
+    xfree(image);
+    hashmap_free(map2);
+    hashmap_free(map);
+}
+
 static void all() {
     int seed = getenv("SEED")?atoi(getenv("SEED")):time(NULL);
     int N = getenv("N")?atoi(getenv("N")):2000;
@@ -968,6 +4355,16 @@ int main() {
     } else {
         printf("Running hashmap.c tests...\n");
         all();
+        filter_and_load();
+        snapshot();
+        concurrent();
+        parallel_resize();
+        segmented();
+        upsert();
+        compact();
+        cursor_scan();
+        parallel_scan();
+        huge_alloc();
         printf("PASSED\n");
     }
 }
@@ -11,6 +11,33 @@
 
 struct hashmap;
 
+struct hashmap_allocator {
+    void *(*malloc)(size_t);
+    void *(*realloc)(void *, size_t);
+    void (*free)(void*);
+};
+
+#define HASHMAP_NUMA_DEFAULT    -1
+#define HASHMAP_NUMA_INTERLEAVE -2
+#define HASHMAP_NUMA_MAXNODES   8
+
+// Statistics are only collected when compiled with -DTTLMAP_STATS.
+#define HASHMAP_PROBE_HIST      16
+
+struct hashmap_stats {
+    size_t count;
+    size_t nbuckets;
+    uint64_t gets;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t probes;        // buckets visited by gets
+    uint64_t resizes;
+    uint64_t resize_ns;     // time spent in resizes
+    // bin i counts gets that visited i+1 buckets, the last bin counts the
+    // longer ones as well
+    uint64_t probe_hist[HASHMAP_PROBE_HIST];
+};
+
 struct hashmap *hashmap_new(size_t elsize, size_t cap, 
                             uint64_t seed0, uint64_t seed1,
                             uint64_t (*hash)(const void *item, 
@@ -37,11 +64,127 @@ size_t hashmap_count(struct hashmap *map);
 bool hashmap_oom(struct hashmap *map);
 void *hashmap_get(struct hashmap *map, const void *item);
 void *hashmap_set(struct hashmap *map, const void *item);
+void *hashmap_upsert(struct hashmap *map, const void *key, bool *found);
 void *hashmap_delete(struct hashmap *map, void *item);
 void *hashmap_probe(struct hashmap *map, uint64_t position);
 bool hashmap_scan(struct hashmap *map,
                   bool (*iter)(const void *item, void *udata), void *udata);
 bool hashmap_iter(struct hashmap *map, size_t *i, void **item);
+int hashmap_scan_cursor(struct hashmap *map, size_t *cursor, size_t count,
+                        bool (*iter)(const void *item, void *udata),
+                        void *udata);
+bool hashmap_scan_parallel(struct hashmap *map, int nthreads,
+                           bool (*iter)(const void *item, void *udata),
+                           void **udata,
+                           void (*reduce)(void *into, void *from));
+const void *hashmap_buckets(struct hashmap *map, size_t *nbuckets, 
+                            size_t *bucketsz);
+bool hashmap_load(struct hashmap *map, const void *buckets, size_t nbuckets,
+                  size_t bucketsz);
+size_t hashmap_filter(struct hashmap *map, 
+                      bool (*keep)(void *item, void *udata), void *udata);
+bool hashmap_snapshot_begin(struct hashmap *map, size_t *nbuckets,
+                            size_t *bucketsz, size_t *count);
+bool hashmap_snapshot_next(struct hashmap *map, void *buf, size_t *n);
+void hashmap_snapshot_end(struct hashmap *map);
+
+bool hashmap_stats(struct hashmap *map, struct hashmap_stats *stats);
+void hashmap_set_resizers(struct hashmap *map, int nthreads);
+bool hashmap_set_compact(struct hashmap *map);
+const struct hashmap_allocator *hashmap_huge_allocator(int placement);
+
+// concurrent engine with lock-free reads, see chashmap_new
+struct chashmap;
+
+struct chashmap *chashmap_new(size_t elsize, size_t cap,
+                            uint64_t seed0, uint64_t seed1,
+                            uint64_t (*hash)(const void *item,
+                                             uint64_t seed0, uint64_t seed1),
+                            int (*compare)(const void *a, const void *b,
+                                           void *udata),
+                            void (*elfree)(void *item),
+                            void *udata);
+struct chashmap *chashmap_new_with_allocator(
+                            void *(*malloc)(size_t),
+                            void (*free)(void*),
+                            size_t elsize, size_t cap,
+                            uint64_t seed0, uint64_t seed1,
+                            uint64_t (*hash)(const void *item,
+                                             uint64_t seed0, uint64_t seed1),
+                            int (*compare)(const void *a, const void *b,
+                                           void *udata),
+                            void (*elfree)(void *item),
+                            void *udata);
+void chashmap_free(struct chashmap *map);
+void chashmap_clear(struct chashmap *map, bool update_cap);
+size_t chashmap_count(struct chashmap *map);
+bool chashmap_oom(struct chashmap *map);
+void *chashmap_get(struct chashmap *map, const void *key);
+void *chashmap_set(struct chashmap *map, const void *item);
+bool chashmap_set_if(struct chashmap *map, const void *item,
+                     bool (*cond)(const void *item, void *udata),
+                     void *udata);
+void *chashmap_delete(struct chashmap *map, const void *key);
+void *chashmap_delete_if(struct chashmap *map, const void *key,
+                         bool (*cond)(const void *item, void *udata),
+                         void *udata);
+void *chashmap_probe(struct chashmap *map, uint64_t position);
+bool chashmap_scan(struct chashmap *map,
+                   bool (*iter)(const void *item, void *udata), void *udata);
+bool chashmap_iter(struct chashmap *map, size_t *i, void **item);
+int chashmap_scan_cursor(struct chashmap *map, size_t *cursor, size_t count,
+                         bool (*iter)(const void *item, void *udata),
+                         void *udata);
+bool chashmap_scan_parallel(struct chashmap *map, int nthreads,
+                            bool (*iter)(const void *item, void *udata),
+                            void **udata,
+                           void (*reduce)(void *into, void *from));
+bool chashmap_stats(struct chashmap *map, struct hashmap_stats *stats);
+void chashmap_enter(void);
+void chashmap_leave(void);
+
+// segmented engine that grows one segment at a time, see shashmap_new
+struct shashmap;
+
+struct shashmap *shashmap_new(size_t elsize, size_t cap,
+                            uint64_t seed0, uint64_t seed1,
+                            uint64_t (*hash)(const void *item,
+                                             uint64_t seed0, uint64_t seed1),
+                            int (*compare)(const void *a, const void *b,
+                                           void *udata),
+                            void (*elfree)(void *item),
+                            void *udata);
+struct shashmap *shashmap_new_with_allocator(
+                            void *(*malloc)(size_t),
+                            void (*free)(void*),
+                            size_t elsize, size_t cap,
+                            uint64_t seed0, uint64_t seed1,
+                            uint64_t (*hash)(const void *item,
+                                             uint64_t seed0, uint64_t seed1),
+                            int (*compare)(const void *a, const void *b,
+                                           void *udata),
+                            void (*elfree)(void *item),
+                            void *udata);
+void shashmap_free(struct shashmap *map);
+void shashmap_clear(struct shashmap *map, bool update_cap);
+size_t shashmap_count(struct shashmap *map);
+bool shashmap_oom(struct shashmap *map);
+void *shashmap_get(struct shashmap *map, const void *key);
+void *shashmap_set(struct shashmap *map, const void *item);
+void *shashmap_upsert(struct shashmap *map, const void *key, bool *found);
+void *shashmap_delete(struct shashmap *map, const void *key);
+void *shashmap_probe(struct shashmap *map, uint64_t position);
+bool shashmap_scan(struct shashmap *map,
+                   bool (*iter)(const void *item, void *udata), void *udata);
+bool shashmap_iter(struct shashmap *map, size_t *i, void **item);
+int shashmap_scan_cursor(struct shashmap *map, size_t *cursor, size_t count,
+                         bool (*iter)(const void *item, void *udata),
+                         void *udata);
+bool shashmap_scan_parallel(struct shashmap *map, int nthreads,
+                            bool (*iter)(const void *item, void *udata),
+                            void **udata,
+                           void (*reduce)(void *into, void *from));
+bool shashmap_stats(struct shashmap *map, struct hashmap_stats *stats);
 
 uint64_t hashmap_sip(const void *data, size_t len, 
                      uint64_t seed0, uint64_t seed1);
@@ -1,4 +1,6 @@
 #include "timewheel.h"
+#include <errno.h>
+#include <sched.h>
 
 #define L1SHIFT	(TIMEWHEEL_WIDTH * 2)
 #define L2SHIFT	TIMEWHEEL_WIDTH
@@ -7,61 +9,212 @@
 
 #define MAX(a,b) (((a)>(b))?(a):(b))
 #define MIN(a,b) (((a)<(b))?(a):(b))
-#define GET_CUR_TICK(tw)	(tw->cur_tick)
-#define	MS_TO_TICKS(tw,ms)	((ms&((1 << tw->_ticksize)-1))==0?(ms>>tw->_ticksize):(ms>>tw->_ticksize)+1)
+#define GET_CUR_TICK(tw)	__atomic_load_n(&(tw)->cur_tick, __ATOMIC_SEQ_CST)
+#define	MS_TO_TICKS(tw,ms)	_ns_to_ticks(tw, (uint64_t)(ms) * 1000000)
 #define CAL_IDXL1(tick)	((tick>>L1SHIFT)&LXMUSK)
 #define CAL_IDXL2(tick)	((tick>>L2SHIFT)&LXMUSK)
 #define CAL_IDXL3(tick)	((tick>>L3SHIFT)&LXMUSK)
+#define TICK_MASK	((1u << (3 * TIMEWHEEL_WIDTH)) - 1)
+#define MAX_TICKS	((1 << (3 * TIMEWHEEL_WIDTH)) - (1 << (2 * TIMEWHEEL_WIDTH)))
 
-static void _nop(void *arg) { return; }
+// _ns_to_ticks rounds a duration up to whole ticks, saturating at MAX_TICKS.
+static unsigned int _ns_to_ticks(timewheel_t *tw, uint64_t ns)
+{
+	uint64_t ticks = (ns + tw->tick_ns - 1) / tw->tick_ns;
+	return ticks < MAX_TICKS ? (unsigned int)ticks : MAX_TICKS;
+}
 
-static unsigned int incID;
-pthread_mutex_t incIDLock = PTHREAD_MUTEX_INITIALIZER;
-unsigned int _generateID() {
-	unsigned int ret;
-	pthread_mutex_lock(&incIDLock);
-	ret = incID++;
-	pthread_mutex_unlock(&incIDLock);
-	return ret;
+static void _nop(void *arg) { (void)arg; }
+void tw_nexttick(timewheel_t *tw);
+static void _runticks(timewheel_t *tw, uint64_t n);
+
+static uint64_t _now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#ifdef TTLMAP_STATS
+#define STAT_INC(tw, field)	((tw)->stats.field++)
+#define STAT_INC_ATOMIC(tw, field)	__atomic_fetch_add(&(tw)->stats.field, 1, __ATOMIC_RELAXED)
+#else
+#define STAT_INC(tw, field)	do {} while (0)
+#define STAT_INC_ATOMIC(tw, field)	do {} while (0)
+#endif
+
+// Task ids are only unique within a wheel, so wheels that are private to a
+// core never share the counter's cache line.
+static unsigned int _generateID(timewheel_t *tw)
+{
+	return __atomic_fetch_add(&tw->next_id, 1, __ATOMIC_RELAXED);
+}
+
+// Nodes are kept on a per-wheel free list and reused, so arming and
+// cancelling timers at a high rate does not go through malloc. The list is
+// refilled a chunk at a time. Must be called with free_lock held.
+static void _growchunks(timewheel_t *tw)
+{
+	twtasknode_t *chunk, **page;
+	unsigned int c = tw->nchunks;
+	int j;
+	if (tw->chunks == NULL || c == TW_MAX_CHUNKS)
+		return;
+	page = tw->chunks[c >> TW_DIR_BITS];
+	if (page == NULL) {
+		// published with the chunk by the release store of nchunks
+		page = (twtasknode_t**)calloc(TW_DIR_SIZE, sizeof(twtasknode_t*));
+		if (page == NULL)
+			return;
+		tw->chunks[c >> TW_DIR_BITS] = page;
+	}
+	chunk = (twtasknode_t*)malloc(sizeof(twtasknode_t) * TW_CHUNK_SIZE);
+	if (chunk == NULL)
+		return;
+	for (j = TW_CHUNK_SIZE - 1; j >= 0; j--) {
+		chunk[j].slot = (c << TW_CHUNK_BITS) | j;
+		chunk[j].gen = 1;
+		chunk[j].bucket = NULL;
+		chunk[j].next = tw->free_list;
+		tw->free_list = &chunk[j];
+	}
+	page[c & (TW_DIR_SIZE - 1)] = chunk;
+	__atomic_store_n(&tw->nchunks, c + 1, __ATOMIC_RELEASE);
+}
+
+static twtasknode_t* _allocnode(timewheel_t *tw)
+{
+	twtasknode_t *node;
+	pthread_mutex_lock(&tw->free_lock);
+	if (tw->free_list == NULL)
+		_growchunks(tw);
+	node = tw->free_list;
+	if (node != NULL)
+		tw->free_list = node->next;
+	pthread_mutex_unlock(&tw->free_lock);
+	return node;
+}
+
+static void _freenode(timewheel_t *tw, twtasknode_t *node)
+{
+	__atomic_fetch_sub(&tw->pending, 1, __ATOMIC_RELAXED);
+	unsigned int gen = (__atomic_load_n(&node->gen, __ATOMIC_RELAXED) + 1) & ~TW_GEN_CANCEL;
+	__atomic_store_n(&node->gen, gen == 0 ? 1 : gen, __ATOMIC_RELEASE);
+	pthread_mutex_lock(&tw->free_lock);
+	node->next = tw->free_list;
+	tw->free_list = node;
+	pthread_mutex_unlock(&tw->free_lock);
+}
+
+static twtasknode_t* _handlenode(timewheel_t *tw, twhandle_t handle)
+{
+	unsigned int slot = (unsigned int)handle;
+	unsigned int c = slot >> TW_CHUNK_BITS;
+	if ((handle >> 32) == 0 || c >= __atomic_load_n(&tw->nchunks, __ATOMIC_ACQUIRE))
+		return NULL;
+	return &tw->chunks[c >> TW_DIR_BITS][c & (TW_DIR_SIZE - 1)][slot & (TW_CHUNK_SIZE - 1)];
+}
+
+static int _cancelrequested(twtasknode_t *node)
+{
+	return (__atomic_load_n(&node->gen, __ATOMIC_ACQUIRE) & TW_GEN_CANCEL) != 0;
+}
+
+// Bucket lists are doubly linked through pprev so a node can be unlinked in
+// O(1). node->bucket is only changed under the bucket's lock.
+static void _unlinknode(twtasknode_t *node)
+{
+	*node->pprev = node->next;
+	if (node->next != NULL)
+		node->next->pprev = node->pprev;
+	__atomic_store_n(&node->bucket, NULL, __ATOMIC_RELEASE);
+}
+
+static void _linknode(twbucket_t *bucket, twtasknode_t *node)
+{
+	node->next = bucket->task_list;
+	if (node->next != NULL)
+		node->next->pprev = &node->next;
+	node->pprev = &bucket->task_list;
+	__atomic_store_n(&bucket->task_list, node, __ATOMIC_RELAXED);
+	__atomic_store_n(&node->bucket, bucket, __ATOMIC_RELEASE);
 }
 
 static void _insertToBucket(twbucket_t *bucket, twtasknode_t *node)
 {
 	pthread_mutex_lock(&bucket->lock);
-	node->next = bucket->task_list;
-	bucket->task_list = node;
+	_linknode(bucket, node);
 	pthread_mutex_unlock(&bucket->lock);
 }
 
 static twtasknode_t* _pluckFromBucket(twbucket_t *bucket)
 {
-	twtasknode_t* nodelist;
+	twtasknode_t *nodelist, *p;
+	// most slots are empty on a fine-grained wheel
+	if (__atomic_load_n(&bucket->task_list, __ATOMIC_RELAXED) == NULL)
+		return NULL;
 	pthread_mutex_lock(&bucket->lock);
 	nodelist = bucket->task_list;
 	bucket->task_list = NULL;
+	for (p = nodelist; p != NULL; p = p->next)
+		__atomic_store_n(&p->bucket, NULL, __ATOMIC_RELEASE);
 	pthread_mutex_unlock(&bucket->lock);
 	return nodelist;
 }
 
+// _slotfor returns the bucket that holds a task due at exec_tick while the
+// wheel is at tick cur. The slot pointers are the low bits of cur.
+static twbucket_t* _slotfor(timewheel_t *tw, unsigned int cur, unsigned int exec_tick)
+{
+	if (CAL_IDXL1(exec_tick) != CAL_IDXL1(cur))
+		return &tw->twL1[CAL_IDXL1(exec_tick)];
+	if (CAL_IDXL2(exec_tick) != CAL_IDXL2(cur))
+		return &tw->twL2[CAL_IDXL2(exec_tick)];
+	return &tw->twL3[CAL_IDXL3(exec_tick)];
+}
+
+// _addtasknode links a node from within a tick, which holds tick_lock, so
+// cur_tick can't move underneath it.
 static twtask_t* _addtasknode(timewheel_t *tw, unsigned int exec_tick, twtasknode_t* node)
 {
-	unsigned char idxl1 = 0, idxl2 = 0, idxl3 = 0;
-	idxl1 = CAL_IDXL1(exec_tick);
-	if (idxl1 != tw->ptrL1) {
-		_insertToBucket(&tw->twL1[idxl1], node);
-		goto done;
-	}
-	idxl2 = CAL_IDXL2(exec_tick);
-	if (idxl2 != tw->ptrL2) {
-		_insertToBucket(&tw->twL2[idxl2], node);
-		goto done;
-	}
-	idxl3 = CAL_IDXL3(exec_tick);
-	_insertToBucket(&tw->twL3[idxl3], node);
-done:
+	_insertToBucket(_slotfor(tw, tw->cur_tick, exec_tick), node);
 	return &node->task;
 }
 
+// _linktask links a node from outside a tick. A tick that starts meanwhile
+// could take the node's slot before the node is in it, so the link is
+// checked against tick_seq once made, and redone on the new tick if a tick
+// got in between. The fence pairs with the one in tw_nexttick: either the
+// tick sees the node in its slot, or this sees the tick. A deadline that
+// the wheel passed in the meantime moves to the next tick.
+static twtask_t* _linktask(timewheel_t *tw, unsigned int exec_tick, twtasknode_t *node)
+{
+	unsigned int seq, cur, ahead;
+	twbucket_t *bucket;
+	for (;;) {
+		seq = __atomic_load_n(&tw->tick_seq, __ATOMIC_SEQ_CST);
+		if (seq & 1) {
+			sched_yield();
+			continue;
+		}
+		cur = GET_CUR_TICK(tw);
+		ahead = exec_tick - cur;
+		if (ahead == 0 || ahead >= MAX_TICKS)
+			exec_tick = cur + 1;
+		bucket = _slotfor(tw, cur, exec_tick);
+		pthread_mutex_lock(&bucket->lock);
+		__atomic_store_n(&node->exec_tick, exec_tick, __ATOMIC_RELAXED);
+		_linknode(bucket, node);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&tw->tick_seq, __ATOMIC_RELAXED) == seq) {
+			pthread_mutex_unlock(&bucket->lock);
+			return &node->task;
+		}
+		_unlinknode(node);
+		pthread_mutex_unlock(&bucket->lock);
+	}
+}
+
 timewheel_t* tw_new()
 {
 	timewheel_t *tw = (timewheel_t*)malloc(sizeof(timewheel_t));
@@ -69,36 +222,62 @@ timewheel_t* tw_new()
 	return tw;
 }
 
+// The default wheel is created on first use, driven by a single clock thread
+// and shared by everything that does not bring its own wheel. It holds a
+// reference of its own, so it lives until the process exits and must not be
+// passed to tw_free. Returns NULL when the wheel or its thread can't be
+// created, in which case the next call tries again.
+static pthread_mutex_t _defaultlock = PTHREAD_MUTEX_INITIALIZER;
+static timewheel_t *_defaultwheel;
+
+static timewheel_t* _newdefault()
+{
+	timewheel_t *tw = tw_new();
+	if (tw == NULL)
+		return NULL;
+	if (tw_runthread(tw) == 0) {
+		tw_free(tw);
+		return NULL;
+	}
+	return tw;
+}
+
+timewheel_t* tw_default()
+{
+	timewheel_t *tw = __atomic_load_n(&_defaultwheel, __ATOMIC_ACQUIRE);
+	if (tw != NULL)
+		return tw;
+	pthread_mutex_lock(&_defaultlock);
+	tw = _defaultwheel;
+	if (tw == NULL) {
+		tw = _newdefault();
+		__atomic_store_n(&_defaultwheel, tw, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&_defaultlock);
+	return tw;
+}
+
 void tw_free(timewheel_t *tw)
 {
 	void *ret;
 	if (tw->loop_tid != 0) {
 		tw->tw_status = TW_STATUS_EXITED;
+		pthread_join(tw->loop_tid, &ret);
 	}
-	pthread_join(tw->loop_tid, &ret);
+	if (tw->timer_fd >= 0)
+		close(tw->timer_fd);
 	pthread_mutex_destroy(&tw->ref_lock);
-	int i;
-	twtasknode_t *p, *q;
+	pthread_mutex_destroy(&tw->tick_lock);
+	pthread_mutex_destroy(&tw->free_lock);
+	unsigned int i;
+	for (i = 0; i < tw->nchunks; i++)
+		free(tw->chunks[i >> TW_DIR_BITS][i & (TW_DIR_SIZE - 1)]);
+	for (i = 0; tw->chunks != NULL && i < TW_DIR_SIZE; i++)
+		free(tw->chunks[i]);
+	free(tw->chunks);
+	for (i = 0; i < (unsigned int)tw->nbatch; i++)
+		free(tw->batch[i].args);
 	for (i = 0; i < TIMEWHEEL_SIZE; i++) {
-		p = tw->twL1[i].task_list;
-		while (p) {
-			q = p->next;
-			free(p);
-			p = q;
-		}
-		p = tw->twL2[i].task_list;
-		while (p) {
-			q = p->next;
-			free(p);
-			p = q;
-		}
-		p = tw->twL3[i].task_list;
-		while (p) {
-			q = p->next;
-			free(p);
-			p = q;
-		}
-
 		pthread_mutex_destroy(&tw->twL1[i].lock);
 		pthread_mutex_destroy(&tw->twL2[i].lock);
 		pthread_mutex_destroy(&tw->twL3[i].lock);
@@ -106,32 +285,39 @@ void tw_free(timewheel_t *tw)
 	free(tw);
 }
 
-void tw_init(timewheel_t *tw, unsigned char ticksize)
+static void _initwheel(timewheel_t *tw, unsigned char ticksize, uint64_t tick_ns)
 {
-	if (tw == NULL) return;
 	pthread_mutex_t init_mutex = PTHREAD_MUTEX_INITIALIZER;
-	ticksize = MIN(ticksize, TW_TICKSIZE_1024MS);
 	tw->cur_tick = 0;
-	tw->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	tw->tick_seq = 0;
+	tw->timer_fd = -1;
 	tw->loop_tid = 0;
 	memcpy(&tw->ref_lock, &init_mutex, sizeof(init_mutex));
+	memcpy(&tw->tick_lock, &init_mutex, sizeof(init_mutex));
 	tw->ref_count = 1;
 	tw->tw_status = TW_STATUS_READY;
 	tw->_ticksize = ticksize;
 	tw->ptrL1 = 0;
 	tw->ptrL2 = 0;
 	tw->ptrL3 = 0;
+	tw->tick_ns = tick_ns;
+	tw->manual = 0;
+	tw->nticks = 0;
+	tw->vnow_ns = 0;
+	tw->pending = 0;
+	tw->next_id = 0;
+	memcpy(&tw->free_lock, &init_mutex, sizeof(init_mutex));
+	tw->free_list = NULL;
+	tw->chunks = (twtasknode_t***)calloc(TW_DIR_SIZE, sizeof(twtasknode_t**));
+	tw->nchunks = 0;
+	memset(tw->batch, 0, sizeof(tw->batch));
+	tw->nbatch = 0;
+	tw->budget = 0;
+	memset(tw->owners, 0, sizeof(tw->owners));
+	tw->nowned = 0;
+	memset(&tw->stats, 0, sizeof(tw->stats));
+	tw->start_ns = _now_ns();
 
-	struct itimerspec timersetting;
-	// printf("timer setting: %u, %u, %u, %u\n", (1 << ticksize) / 1000, ((1 << ticksize) % 1000) * 1000000, (1 << ticksize) / 1000, ((1 << ticksize) % 1000) * 1000000);
-	timersetting.it_value.tv_sec = (1 << ticksize) / 1000;
-	timersetting.it_value.tv_nsec = ((1 << ticksize) % 1000) * 1000000;
-	timersetting.it_interval.tv_sec = (1 << ticksize) / 1000;
-	timersetting.it_interval.tv_nsec = ((1 << ticksize) % 1000) * 1000000;
-
-	timerfd_settime(tw->timer_fd, 0, &timersetting, NULL);
-
-	
 	int i;
 	for (i = 0; i < TIMEWHEEL_SIZE; i++) {
 		tw->twL1[i].task_list = NULL;
@@ -140,49 +326,449 @@ void tw_init(timewheel_t *tw, unsigned char ticksize)
 		tw->twL2[i].task_list = NULL;
 		memcpy(&tw->twL2[i].lock, &init_mutex, sizeof(init_mutex));
 
-		tw->twL2[i].task_list = NULL;
-		memcpy(&tw->twL2[i].lock, &init_mutex, sizeof(init_mutex));
+		tw->twL3[i].task_list = NULL;
+		memcpy(&tw->twL3[i].lock, &init_mutex, sizeof(init_mutex));
 	}
+}
+
+// _starttimer arms the timerfd on absolute tick boundaries, so tick n is due
+// exactly at start_ns + n * tick_ns and absolute deadlines map onto ticks.
+static void _starttimer(timewheel_t *tw)
+{
+	struct itimerspec timersetting;
+	uint64_t first = tw->start_ns + tw->tick_ns;
+	tw->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	timersetting.it_value.tv_sec = first / 1000000000;
+	timersetting.it_value.tv_nsec = first % 1000000000;
+	timersetting.it_interval.tv_sec = tw->tick_ns / 1000000000;
+	timersetting.it_interval.tv_nsec = tw->tick_ns % 1000000000;
+	timerfd_settime(tw->timer_fd, TFD_TIMER_ABSTIME, &timersetting, NULL);
+}
+
+void tw_init(timewheel_t *tw, unsigned char ticksize)
+{
+	if (tw == NULL) return;
+	ticksize = MIN(ticksize, TW_TICKSIZE_1024MS);
+	_initwheel(tw, ticksize, (uint64_t)(1 << ticksize) * 1000000);
+	_starttimer(tw);
 	return;
 }
 
+// tw_init_us initializes a wheel with a tick of tick_us microseconds, for
+// timers that need finer resolution than 1ms. Idle ticks are cheap: while
+// the wheel is empty elapsed ticks are skipped without visiting any slot.
+void tw_init_us(timewheel_t *tw, unsigned int tick_us)
+{
+	if (tw == NULL) return;
+	_initwheel(tw, 0, (uint64_t)MAX(tick_us, 1) * 1000);
+	_starttimer(tw);
+}
 
-twtask_t* tw_addtask(timewheel_t *tw, unsigned int timeout_ms, void (*cb)(void *arg), void *arg)
+timewheel_t* tw_new_us(unsigned int tick_us)
+{
+	timewheel_t *tw = (timewheel_t*)malloc(sizeof(timewheel_t));
+	tw_init_us(tw, tick_us);
+	return tw;
+}
+
+// tw_init_manual initializes a wheel that is driven by a virtual clock
+// instead of a timerfd. Time only moves when tw_advance is called, and tasks
+// fire from within that call, so expiry can be simulated at full speed and
+// without wall-clock noise.
+void tw_init_manual(timewheel_t *tw, unsigned char ticksize)
+{
+	if (tw == NULL) return;
+	ticksize = MIN(ticksize, TW_TICKSIZE_1024MS);
+	_initwheel(tw, ticksize, (uint64_t)(1 << ticksize) * 1000000);
+	tw->start_ns = 0;
+	tw->manual = 1;
+	tw->tw_status = TW_STATUS_RUNNING;
+}
+
+timewheel_t* tw_new_manual(unsigned char ticksize)
+{
+	timewheel_t *tw = (timewheel_t*)malloc(sizeof(timewheel_t));
+	tw_init_manual(tw, ticksize);
+	return tw;
+}
+
+// tw_now_ms returns the current time of the wheel's clock in ms. That is the
+// virtual time for a manual wheel and CLOCK_MONOTONIC otherwise.
+uint64_t tw_now_ms(timewheel_t *tw)
+{
+	return tw_now_ns(tw) / 1000000;
+}
+
+uint64_t tw_now_ns(timewheel_t *tw)
+{
+	if (tw->manual)
+		return __atomic_load_n(&tw->vnow_ns, __ATOMIC_RELAXED);
+	return _now_ns();
+}
+
+// tw_advance moves the virtual clock of a manual wheel forward by ms and runs
+// every tick passed on the way. During a callback the clock reads the time of
+// the tick being run.
+void tw_advance(timewheel_t *tw, unsigned int ms)
+{
+	if (tw == NULL || !tw->manual) return;
+	uint64_t target = tw->vnow_ns + (uint64_t)ms * 1000000;
+	_runticks(tw, target / tw->tick_ns - tw->nticks);
+	__atomic_store_n(&tw->vnow_ns, target, __ATOMIC_RELAXED);
+}
+
+
+// _deadline_ticks converts an absolute deadline on the wheel's clock into
+// ticks from now. A deadline that already passed fires on the next tick.
+static unsigned int _deadline_ticks(timewheel_t *tw, uint64_t deadline_ns)
+{
+	uint64_t nticks = __atomic_load_n(&tw->nticks, __ATOMIC_RELAXED);
+	uint64_t due = tw->start_ns + nticks * tw->tick_ns;
+	if (deadline_ns <= due)
+		return 1;
+	return _ns_to_ticks(tw, deadline_ns - due);
+}
+
+// An idle skip sets TW_PENDING_SKIP in pending while it moves cur_tick, which
+// it only does when pending is 0. An adder counts its task first and waits
+// for a skip in progress to end before reading cur_tick, so a skip either
+// sees the task or finishes before the task's tick is computed.
+#define TW_PENDING_SKIP	0x80000000u
+
+static void _holdpending(timewheel_t *tw)
+{
+	unsigned int p = __atomic_fetch_add(&tw->pending, 1, __ATOMIC_ACQ_REL);
+	while (p & TW_PENDING_SKIP)
+		p = __atomic_load_n(&tw->pending, __ATOMIC_ACQUIRE);
+}
+
+// _newtask fills a fresh node and stores its handle in *handle before the
+// node is linked, after which it may fire at any time.
+static twtask_t* _newtask(timewheel_t *tw, unsigned int timeout_ticks, void *owner,
+				void (*cb)(void *arg), void *arg, twhandle_t *handle)
 {
-	unsigned int timeout_ticks = MS_TO_TICKS(tw, timeout_ms);
 	// printf("timeout ticks=%u, ", timeout_ticks);
-	if (((1 << (3 * TIMEWHEEL_WIDTH)) - (1 << (2 * TIMEWHEEL_WIDTH))) <= timeout_ticks) 
+	if (MAX_TICKS <= timeout_ticks) 
 		return NULL;
+	// the current slot has already run
+	if (timeout_ticks == 0)
+		timeout_ticks = 1;
 
+	_holdpending(tw);
 	unsigned int exec_tick = timeout_ticks + GET_CUR_TICK(tw);
 	// printf("execute tick=%u\n", exec_tick);
-	twtasknode_t *ttnode = (twtasknode_t*)malloc(sizeof(twtasknode_t));
+	twtasknode_t *ttnode = _allocnode(tw);
+	if (ttnode == NULL) {
+		__atomic_fetch_sub(&tw->pending, 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
 	ttnode->exec_tick = exec_tick;
 	ttnode->next = NULL;
+	ttnode->tw = tw;
 	ttnode->task.arg = arg;
 	ttnode->task.cb = cb;
-	ttnode->task.taskid = _generateID();
+	ttnode->task.owner = owner;
+	ttnode->task.taskid = _generateID(tw);
 	ttnode->task.flags = TWTASK_FLAG_EXECONECE;
 	ttnode->task.period = 0;
+	STAT_INC_ATOMIC(tw, scheduled);
+	if (handle != NULL)
+		*handle = ((uint64_t)ttnode->gen << 32) | ttnode->slot;
 
-	return _addtasknode(tw, exec_tick, ttnode);
+	return _linktask(tw, exec_tick, ttnode);
+}
+
+twtask_t* tw_addtask(timewheel_t *tw, unsigned int timeout_ms, void (*cb)(void *arg), void *arg)
+{
+	return _newtask(tw, MS_TO_TICKS(tw, timeout_ms), NULL, cb, arg, NULL);
+}
+
+// tw_addtask_at schedules a task at an absolute deadline in ns on the wheel's
+// clock (tw_now_ns), rounded up to the next tick boundary. Unlike a relative
+// timeout it does not drift by the time the caller already spent waiting.
+twtask_t* tw_addtask_at(timewheel_t *tw, uint64_t deadline_ns, void (*cb)(void *arg), void *arg)
+{
+	return _newtask(tw, _deadline_ticks(tw, deadline_ns), NULL, cb, arg, NULL);
+}
+
+// tw_add is tw_addtask returning a handle instead of a task pointer. Returns
+// TW_HANDLE_INVALID when the timeout is out of range or on allocation failure.
+twhandle_t tw_add(timewheel_t *tw, unsigned int timeout_ms, void (*cb)(void *arg), void *arg)
+{
+	twhandle_t handle;
+	if (_newtask(tw, MS_TO_TICKS(tw, timeout_ms), NULL, cb, arg, &handle) == NULL)
+		return TW_HANDLE_INVALID;
+	return handle;
+}
+
+// tw_addtask_slack schedules a task that may fire up to slack_ms late. The
+// tick is rounded up to a multiple of the largest power of two that fits in
+// the slack, so tasks with nearby deadlines land in the same slot and fire
+// together.
+twtask_t* tw_addtask_slack(timewheel_t *tw, unsigned int timeout_ms, unsigned int slack_ms,
+				void (*cb)(void *arg), void *arg)
+{
+	return tw_addtask_owned(tw, timeout_ms, slack_ms, NULL, cb, arg);
+}
+
+// tw_addtask_owned is tw_addtask_slack for a task that counts against the
+// per-tick budget of owner, see tw_setbudget. A NULL owner is never limited.
+twtask_t* tw_addtask_owned(timewheel_t *tw, unsigned int timeout_ms, unsigned int slack_ms,
+				void *owner, void (*cb)(void *arg), void *arg)
+{
+	unsigned int timeout_ticks = MS_TO_TICKS(tw, timeout_ms);
+	unsigned int slack_ticks = (unsigned int)(((uint64_t)slack_ms * 1000000) / tw->tick_ns);
+	unsigned int align = 1, cur, exec_tick;
+	if (MAX_TICKS <= timeout_ticks)
+		return NULL;
+	while (align * 2 <= slack_ticks + 1 && align < (1u << (2 * TIMEWHEEL_WIDTH)))
+		align *= 2;
+	cur = GET_CUR_TICK(tw);
+	exec_tick = (cur + MAX(timeout_ticks, 1) + align - 1) & ~(align - 1);
+	if (MAX_TICKS <= exec_tick - cur)
+		exec_tick = cur + timeout_ticks;
+	return _newtask(tw, exec_tick - cur, owner, cb, arg, NULL);
+}
+
+// tw_setbudget limits how many tasks of one owner a tick fires. The rest of
+// that owner's due tasks are deferred to the next tick, so a mass expiry of
+// one owner can't delay the timers of others sharing the wheel. 0 removes
+// the limit.
+void tw_setbudget(timewheel_t *tw, unsigned int per_owner)
+{
+	tw->budget = per_owner;
+}
+
+// _overbudget charges a firing task to its owner and returns nonzero when
+// the owner has used up its budget for this tick. Owners are counted in a
+// small table that is reset at the end of every tick; once it is full,
+// further owners go unlimited for the rest of the tick.
+static int _overbudget(timewheel_t *tw, twtask_t *task)
+{
+	unsigned int i, n;
+	if (task->owner == NULL)
+		return 0;
+	i = (unsigned int)(((uintptr_t)task->owner >> 4) * 0x9E3779B1u) % TW_OWNER_SLOTS;
+	for (n = 0; n < TW_OWNER_SLOTS; n++, i = (i + 1) % TW_OWNER_SLOTS) {
+		if (tw->owners[i].owner == task->owner)
+			return ++tw->owners[i].fired > tw->budget;
+		if (tw->owners[i].owner == NULL) {
+			tw->owners[i].owner = task->owner;
+			tw->owners[i].fired = 1;
+			tw->owned[tw->nowned++] = i;
+			return 1 > tw->budget;
+		}
+	}
+	return 0;
+}
+
+static void _resetbudgets(timewheel_t *tw)
+{
+	unsigned int i;
+	for (i = 0; i < tw->nowned; i++)
+		tw->owners[tw->owned[i]].owner = NULL;
+	tw->nowned = 0;
+}
+
+// tw_setbatch makes the wheel collect the args of all tasks with callback cb
+// that fire in one tick and pass them to fn in a single call instead, so the
+// callee can take its locks once per tick rather than once per task. Up to
+// TW_MAX_BATCH callbacks can be batched per wheel. Setting the same cb again
+// replaces fn.
+int tw_setbatch(timewheel_t *tw, void (*cb)(void *arg), void (*fn)(void **args, unsigned int n))
+{
+	int i, ret = -1;
+	pthread_mutex_lock(&tw->tick_lock);
+	for (i = 0; i < tw->nbatch; i++) {
+		if (tw->batch[i].cb == cb) {
+			tw->batch[i].fn = fn;
+			ret = 0;
+			break;
+		}
+	}
+	if (ret != 0 && tw->nbatch < TW_MAX_BATCH) {
+		tw->batch[tw->nbatch].cb = cb;
+		tw->batch[tw->nbatch].fn = fn;
+		tw->nbatch++;
+		ret = 0;
+	}
+	pthread_mutex_unlock(&tw->tick_lock);
+	return ret;
+}
+
+// _batchtask queues the arg of a firing task for its batch callback. Returns
+// 0 when the task has no batch callback or the queue can't grow, in which
+// case the caller runs it directly.
+static int _batchtask(timewheel_t *tw, twtask_t *task)
+{
+	int i;
+	twbatch_t *b;
+	for (i = 0; i < tw->nbatch; i++) {
+		b = &tw->batch[i];
+		if (b->cb != task->cb)
+			continue;
+		if (b->n == b->cap) {
+			unsigned int cap = b->cap ? b->cap * 2 : 64;
+			void **args = (void**)realloc(b->args, sizeof(void*) * cap);
+			if (args == NULL)
+				return 0;
+			b->args = args;
+			b->cap = cap;
+		}
+		b->args[b->n++] = task->arg;
+		return 1;
+	}
+	return 0;
+}
+
+static void _runbatches(timewheel_t *tw)
+{
+	int i;
+	for (i = 0; i < tw->nbatch; i++) {
+		if (tw->batch[i].n > 0) {
+			tw->batch[i].fn(tw->batch[i].args, tw->batch[i].n);
+#ifdef TTLMAP_STATS
+			tw->stats.fired += tw->batch[i].n;
+#endif
+			tw->batch[i].n = 0;
+		}
+	}
+}
+
+twhandle_t tw_add_at(timewheel_t *tw, uint64_t deadline_ns, void (*cb)(void *arg), void *arg)
+{
+	twhandle_t handle;
+	if (_newtask(tw, _deadline_ticks(tw, deadline_ns), NULL, cb, arg, &handle) == NULL)
+		return TW_HANDLE_INVALID;
+	return handle;
+}
+
+// _lockhandle locks the bucket of the task named by handle and returns its
+// node, or returns NULL with *running set when the task is being run by a
+// tick, or NULL when the handle is stale.
+static twtasknode_t* _lockhandle(timewheel_t *tw, twhandle_t handle, int *running)
+{
+	twtasknode_t *node = _handlenode(tw, handle);
+	unsigned int gen = handle >> 32;
+	twbucket_t *bucket;
+	*running = 0;
+	if (node == NULL)
+		return NULL;
+	while ((bucket = __atomic_load_n(&node->bucket, __ATOMIC_ACQUIRE)) != NULL) {
+		pthread_mutex_lock(&bucket->lock);
+		if (node->bucket == bucket) {
+			if (node->gen == gen)
+				return node;
+			pthread_mutex_unlock(&bucket->lock);
+			return NULL;
+		}
+		pthread_mutex_unlock(&bucket->lock);
+	}
+	*running = __atomic_load_n(&node->gen, __ATOMIC_ACQUIRE) == gen;
+	return NULL;
+}
+
+// tw_cancel cancels the task named by handle. A pending task is unlinked and
+// its slot released at once, and 0 is returned. A task that a tick is running
+// is too late to stop: its callback is running or has just returned. It is
+// not run again, and 1 is returned. Returns -1 when the task already fired or
+// was cancelled.
+int tw_cancel(timewheel_t *tw, twhandle_t handle)
+{
+	int running;
+	unsigned int gen = handle >> 32;
+	twtasknode_t *node = _lockhandle(tw, handle, &running);
+	if (node != NULL) {
+		twbucket_t *bucket = node->bucket;
+		_unlinknode(node);
+		pthread_mutex_unlock(&bucket->lock);
+		STAT_INC_ATOMIC(tw, cancelled);
+		_freenode(tw, node);
+		return 0;
+	}
+	if (running) {
+		node = _handlenode(tw, handle);
+		if (__atomic_compare_exchange_n(&node->gen, &gen, gen | TW_GEN_CANCEL, 0,
+						__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			return 1;
+	}
+	return -1;
+}
+
+// tw_reschedule moves a pending task to fire timeout_ms from now, keeping its
+// handle. Returns -1 when the handle is stale, the task is running or the
+// timeout is out of range.
+int tw_reschedule(timewheel_t *tw, twhandle_t handle, unsigned int timeout_ms)
+{
+	int running;
+	unsigned int timeout_ticks = MS_TO_TICKS(tw, timeout_ms);
+	if (MAX_TICKS <= timeout_ticks)
+		return -1;
+	twtasknode_t *node = _lockhandle(tw, handle, &running);
+	if (node == NULL)
+		return -1;
+	twbucket_t *bucket = node->bucket;
+	_unlinknode(node);
+	pthread_mutex_unlock(&bucket->lock);
+	_linktask(tw, timeout_ticks + GET_CUR_TICK(tw), node);
+	return 0;
 }
 
 twtask_t* tw_settaskperiod(timewheel_t *tw, twtask_t *task, unsigned int period_ms)
 {
 	unsigned int period_ticks = MS_TO_TICKS(tw, period_ms);
-	if (((1 << (3 * TIMEWHEEL_WIDTH)) - (1 << (2 * TIMEWHEEL_WIDTH))) <= period_ticks)
+	if (MAX_TICKS <= period_ticks)
 		return NULL;
 	task->flags = TWTASK_FLAG_PERIODIC;
 	task->period = period_ms;
 	return task;
 }
 
+#ifdef TTLMAP_STATS
+static void _stat_tick(timewheel_t *tw)
+{
+	uint64_t due = tw->start_ns + tw->nticks * tw->tick_ns;
+	uint64_t now = _now_ns();
+	uint64_t lag = now > due && !tw->manual ? now - due : 0;
+	tw->stats.ticks++;
+	tw->stats.lag_total_ns += lag;
+	if (lag > tw->stats.lag_max_ns)
+		tw->stats.lag_max_ns = lag;
+}
+
+static void _stat_callback(timewheel_t *tw, twtask_t *task)
+{
+	uint64_t start = _now_ns(), took;
+	int bin = 0;
+	task->cb(task->arg);
+	took = _now_ns() - start;
+	while (took > 1 && bin < TW_STATS_HIST - 1) {
+		took >>= 1;
+		bin++;
+	}
+	tw->stats.cb_hist[bin]++;
+	tw->stats.fired++;
+}
+#define STAT_TICK(tw)	_stat_tick(tw)
+#define RUN_CALLBACK(tw, task)	_stat_callback((tw), (task))
+#else
+#define STAT_TICK(tw)	do {} while (0)
+#define RUN_CALLBACK(tw, task)	(task)->cb((task)->arg)
+#endif
+
 void tw_nexttick(timewheel_t *tw)
 {
 	int l1move, l2move;
 	l1move = 0, l2move = 0;
-	tw->cur_tick++;
+	pthread_mutex_lock(&tw->tick_lock);
+	// odd until the slots of the tick are taken, see _linktask
+	__atomic_store_n(&tw->tick_seq, tw->tick_seq + 1, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&tw->cur_tick, tw->cur_tick + 1, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	__atomic_store_n(&tw->nticks, tw->nticks + 1, __ATOMIC_RELAXED);
+	if (tw->manual)
+		__atomic_store_n(&tw->vnow_ns, tw->nticks * tw->tick_ns, __ATOMIC_RELAXED);
+	STAT_TICK(tw);
 	tw->ptrL3++;
 	if (tw->ptrL3 == 0) {
 		// printf("l2move\n");
@@ -200,10 +786,13 @@ void tw_nexttick(timewheel_t *tw)
 		ttnode = _pluckFromBucket(&tw->twL1[tw->ptrL1]);
 		while (ttnode != NULL) {
 			ptr = ttnode->next;
-			if (ttnode->task.flags != TWTASK_FLAG_CANCELLED) {
-				_insertToBucket(&tw->twL2[CAL_IDXL2(ttnode->exec_tick)], ttnode);
+			if (ttnode->task.flags != TWTASK_FLAG_CANCELLED && !_cancelrequested(ttnode)) {
+				// placed by exec_tick, which tw_resettask may have pushed out
+				_addtasknode(tw, __atomic_load_n(&ttnode->exec_tick, __ATOMIC_RELAXED), ttnode);
+				STAT_INC(tw, cascaded);
 			} else {
-				free(ttnode);
+				_freenode(tw, ttnode);
+				STAT_INC(tw, cancelled);
 			}
 			ttnode = ptr;
 		}
@@ -212,36 +801,115 @@ void tw_nexttick(timewheel_t *tw)
 		ttnode = _pluckFromBucket(&tw->twL2[tw->ptrL2]);
 		while (ttnode != NULL) {
 			ptr = ttnode->next;
-			if (ttnode->task.flags != TWTASK_FLAG_CANCELLED) {
-				_insertToBucket(&tw->twL3[CAL_IDXL3(ttnode->exec_tick)], ttnode);
+			if (ttnode->task.flags != TWTASK_FLAG_CANCELLED && !_cancelrequested(ttnode)) {
+				_addtasknode(tw, __atomic_load_n(&ttnode->exec_tick, __ATOMIC_RELAXED), ttnode);
+				STAT_INC(tw, cascaded);
 			} else {
-				free(ttnode);
+				_freenode(tw, ttnode);
+				STAT_INC(tw, cancelled);
 			}
 			ttnode = ptr;
 		}
 	}
+	uint64_t fired = 0;
+	unsigned int exec_tick, ahead;
 	ttnode = _pluckFromBucket(&tw->twL3[tw->ptrL3]);
+	__atomic_store_n(&tw->tick_seq, tw->tick_seq + 1, __ATOMIC_RELEASE);
 	while (ttnode != NULL) {
 		ptr = ttnode->next;
-		if (ttnode->task.flags != TWTASK_FLAG_CANCELLED) {
+		exec_tick = __atomic_load_n(&ttnode->exec_tick, __ATOMIC_RELAXED);
+		ahead = (exec_tick - tw->cur_tick) & TICK_MASK;
+		if (ahead != 0 && ahead < MAX_TICKS &&
+		    ttnode->task.flags != TWTASK_FLAG_CANCELLED && !_cancelrequested(ttnode)) {
+			// deadline pushed out by tw_resettask
+			_addtasknode(tw, exec_tick, ttnode);
+			ttnode = ptr;
+			continue;
+		}
+		if (tw->budget != 0 && ttnode->task.flags != TWTASK_FLAG_CANCELLED &&
+		    !_cancelrequested(ttnode) && _overbudget(tw, &ttnode->task)) {
+			// carried into the next tick
+			ttnode->exec_tick = tw->cur_tick + 1;
+			_addtasknode(tw, ttnode->exec_tick, ttnode);
+			STAT_INC(tw, deferred);
+			ttnode = ptr;
+			continue;
+		}
+		if (ttnode->task.flags != TWTASK_FLAG_CANCELLED && !_cancelrequested(ttnode)) {
 			// printf("task %u called in tick %u.\n", ttnode->task.taskid, tw->cur_tick);
-			if (tw->tw_status == TW_STATUS_RUNNING)
-				ttnode->task.cb(ttnode->task.arg);
+			if (tw->tw_status == TW_STATUS_RUNNING) {
+				if (!_batchtask(tw, &ttnode->task))
+					RUN_CALLBACK(tw, &ttnode->task);
+				fired++;
+			}
+		} else {
+			STAT_INC(tw, cancelled);
 		}
 		
-		if (ttnode->task.flags == TWTASK_FLAG_PERIODIC) {
+		if (ttnode->task.flags == TWTASK_FLAG_PERIODIC && !_cancelrequested(ttnode)) {
 			// printf("task %u reload.\n", ttnode->task.taskid);
-			_addtasknode(tw, MS_TO_TICKS(tw, ttnode->task.period) + GET_CUR_TICK(tw), ttnode);
+			ttnode->exec_tick = MS_TO_TICKS(tw, ttnode->task.period) + GET_CUR_TICK(tw);
+			_addtasknode(tw, ttnode->exec_tick, ttnode);
 		} else {
 			// printf("task %u freed.\n", ttnode->task.taskid);
-			free(ttnode);
+			_freenode(tw, ttnode);
 		}
 		ttnode = ptr;
 	}
+	_runbatches(tw);
+	if (tw->nowned != 0)
+		_resetbudgets(tw);
+#ifdef TTLMAP_STATS
+	tw->stats.last_fired = fired;
+	if (fired > tw->stats.max_fired)
+		tw->stats.max_fired = fired;
+#endif
+	(void)fired;
 	// printf("tick [%u:%u:%u]\n", tw->ptrL1, tw->ptrL2, tw->ptrL3);
+	pthread_mutex_unlock(&tw->tick_lock);
 	return;
 }
 
+// _skipticks moves an empty wheel forward by n ticks without visiting the
+// slots in between. The slot pointers are the low bits of cur_tick. Returns
+// 0 without moving when a task was added since the caller saw none.
+static int _skipticks(timewheel_t *tw, uint64_t n)
+{
+	unsigned int idle = 0;
+	pthread_mutex_lock(&tw->tick_lock);
+	if (!__atomic_compare_exchange_n(&tw->pending, &idle, TW_PENDING_SKIP, 0,
+					 __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+		pthread_mutex_unlock(&tw->tick_lock);
+		return 0;
+	}
+	__atomic_store_n(&tw->cur_tick, tw->cur_tick + (unsigned int)n, __ATOMIC_SEQ_CST);
+	tw->ptrL1 = CAL_IDXL1(tw->cur_tick);
+	tw->ptrL2 = CAL_IDXL2(tw->cur_tick);
+	tw->ptrL3 = CAL_IDXL3(tw->cur_tick);
+	__atomic_store_n(&tw->nticks, tw->nticks + n, __ATOMIC_RELAXED);
+	if (tw->manual)
+		__atomic_store_n(&tw->vnow_ns, tw->nticks * tw->tick_ns, __ATOMIC_RELAXED);
+#ifdef TTLMAP_STATS
+	tw->stats.ticks += n;
+#endif
+	__atomic_fetch_and(&tw->pending, ~TW_PENDING_SKIP, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&tw->tick_lock);
+	return 1;
+}
+
+// _runticks runs n elapsed ticks. Runs of ticks with no task in the wheel are
+// skipped in one step, so an idle fine-grained wheel costs next to nothing.
+static void _runticks(timewheel_t *tw, uint64_t n)
+{
+	while (n > 0) {
+		if (__atomic_load_n(&tw->pending, __ATOMIC_RELAXED) == 0 &&
+		    _skipticks(tw, n))
+			return;
+		tw_nexttick(tw);
+		n--;
+	}
+}
+
 void tw_changetask(twtask_t *task, void (*cb)(void *arg), void *arg)
 {
 	task->cb = cb;
@@ -249,46 +917,220 @@ void tw_changetask(twtask_t *task, void (*cb)(void *arg), void *arg)
 	return;
 }
 
+// tw_resettask makes a pending task fire timeout_ms from now, keeping its
+// node and id. Pushing the deadline out only records the new tick under the
+// bucket lock and the wheel re-buckets the task when it reaches the old
+// slot, so extending a timeout never relinks the node. Pulling it in moves
+// the node at once. The tick plucks a slot under the same lock, so a task
+// is either still linked when the new tick is stored or reported as
+// running. Returns -1 when the timeout is out of range or the task is being
+// run by a tick.
+int tw_resettask(timewheel_t *tw, twtask_t *task, unsigned int timeout_ms)
+{
+	twtasknode_t *node = (twtasknode_t*)task;
+	twbucket_t *bucket;
+	unsigned int timeout_ticks = MS_TO_TICKS(tw, timeout_ms);
+	if (MAX_TICKS <= timeout_ticks)
+		return -1;
+	unsigned int cur = GET_CUR_TICK(tw);
+	unsigned int exec_tick = timeout_ticks + cur;
+	unsigned int gen = __atomic_load_n(&node->gen, __ATOMIC_ACQUIRE);
+	unsigned int old;
+	while ((bucket = __atomic_load_n(&node->bucket, __ATOMIC_ACQUIRE)) != NULL) {
+		pthread_mutex_lock(&bucket->lock);
+		if (node->bucket != bucket) {
+			// moved by a cascade in the meantime
+			pthread_mutex_unlock(&bucket->lock);
+			continue;
+		}
+		if (node->gen != gen) {
+			// fired and reused while we waited for the lock
+			pthread_mutex_unlock(&bucket->lock);
+			return -1;
+		}
+		old = node->exec_tick;
+		if (exec_tick - cur >= old - cur && old - cur < MAX_TICKS) {
+			__atomic_store_n(&node->exec_tick, exec_tick, __ATOMIC_RELAXED);
+			pthread_mutex_unlock(&bucket->lock);
+			return 0;
+		}
+		_unlinknode(node);
+		pthread_mutex_unlock(&bucket->lock);
+		_linktask(tw, exec_tick, node);
+		return 0;
+	}
+	return -1;
+}
+
+// tw_canceltask unlinks a pending task from its bucket and recycles the node
+// at once. A task that a tick is running right now can't be unlinked; it is
+// marked cancelled instead and dropped by the tick.
+// The task pointer is only valid until the task fires or is cancelled: its
+// node is then reused, and cancelling through a stale pointer cancels
+// whichever task holds the node now. Use tw_add and tw_cancel when the
+// caller can't tell whether the task already fired.
 void tw_canceltask(twtask_t *task)
 {
+	twtasknode_t *node = (twtasknode_t*)task;
+	twbucket_t *bucket;
+	while ((bucket = __atomic_load_n(&node->bucket, __ATOMIC_ACQUIRE)) != NULL) {
+		pthread_mutex_lock(&bucket->lock);
+		if (node->bucket == bucket) {
+			_unlinknode(node);
+			pthread_mutex_unlock(&bucket->lock);
+			STAT_INC_ATOMIC(node->tw, cancelled);
+			_freenode(node->tw, node);
+			return;
+		}
+		// moved by a cascade in the meantime
+		pthread_mutex_unlock(&bucket->lock);
+	}
 	tw_changetask(task, _nop, NULL);
 	task->flags = TWTASK_FLAG_CANCELLED;
 	return;
 }
 
+static unsigned int _cancelBucket(twbucket_t *bucket, int (*match)(twtask_t *task, void *udata), void *udata)
+{
+	unsigned int n = 0;
+	twtasknode_t *p, *q, *dead = NULL;
+	pthread_mutex_lock(&bucket->lock);
+	for (p = bucket->task_list; p != NULL; p = q) {
+		q = p->next;
+		if (p->task.flags != TWTASK_FLAG_CANCELLED && match(&p->task, udata)) {
+			_unlinknode(p);
+			p->next = dead;
+			dead = p;
+			n++;
+		}
+	}
+	pthread_mutex_unlock(&bucket->lock);
+	for (p = dead; p != NULL; p = q) {
+		q = p->next;
+		_freenode(p->tw, p);
+	}
+	return n;
+}
 
-void* _clockdriver(void *arg) {
-	timewheel_t *tw = arg;
+// tw_canceltasks cancels every pending task for which match returns nonzero
+// and returns how many were cancelled. match may release the task's arg. It
+// waits for a running tick to finish, so once it returns no matched callback
+// is running or will run again. Must not be called from a callback of the
+// same wheel.
+unsigned int tw_canceltasks(timewheel_t *tw, int (*match)(twtask_t *task, void *udata), void *udata)
+{
+	unsigned int n = 0;
+	int i;
+	pthread_mutex_lock(&tw->tick_lock);
+	for (i = 0; i < TIMEWHEEL_SIZE; i++) {
+		n += _cancelBucket(&tw->twL1[i], match, udata);
+		n += _cancelBucket(&tw->twL2[i], match, udata);
+		n += _cancelBucket(&tw->twL3[i], match, udata);
+	}
+	pthread_mutex_unlock(&tw->tick_lock);
+	return n;
+}
 
-	int epfd = epoll_create(1);
+static unsigned int _countBucket(twbucket_t *bucket)
+{
+	unsigned int n = 0;
+	twtasknode_t *p;
+	pthread_mutex_lock(&bucket->lock);
+	for (p = bucket->task_list; p != NULL; p = p->next)
+		n++;
+	pthread_mutex_unlock(&bucket->lock);
+	return n;
+}
+
+// tw_stats copies the statistics of the wheel into stats and counts the
+// pending tasks on each level. Returns -1, leaving stats zeroed, unless
+// compiled with -DTTLMAP_STATS.
+int tw_stats(timewheel_t *tw, twstats_t *stats)
+{
+	memset(stats, 0, sizeof(twstats_t));
+#ifdef TTLMAP_STATS
+	int i;
+	memcpy(stats, &tw->stats, sizeof(twstats_t));
+	stats->scheduled = __atomic_load_n(&tw->stats.scheduled, __ATOMIC_RELAXED);
+	for (i = 0; i < TIMEWHEEL_SIZE; i++) {
+		stats->occupancy[0] += _countBucket(&tw->twL1[i]);
+		stats->occupancy[1] += _countBucket(&tw->twL2[i]);
+		stats->occupancy[2] += _countBucket(&tw->twL3[i]);
+	}
+	return 0;
+#else
+	(void)tw;
+	(void)_countBucket;
+	return -1;
+#endif
+}
+
+// tw_attach registers the wheel's timerfd on an epoll instance with data.ptr
+// pointing at the wheel and marks the wheel running. Any number of wheels can
+// share one epoll; tw_pollwheels dispatches their events. The caller must
+// tw_detach (or free the wheel) before closing epfd.
+int tw_attach(timewheel_t *tw, int epfd)
+{
 	struct epoll_event ev;
+	if (tw == NULL || tw->timer_fd < 0) return -1;
 	ev.events = EPOLLIN | EPOLLET;
 	ev.data.ptr = (void*)tw;
-	epoll_ctl(epfd, EPOLL_CTL_ADD, tw->timer_fd, &ev);
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, tw->timer_fd, &ev) != 0)
+		return -1;
+	tw->tw_status = TW_STATUS_RUNNING;
+	return 0;
+}
 
-	int i, j, nevents, ret;
+int tw_detach(timewheel_t *tw, int epfd)
+{
+	if (tw == NULL || tw->timer_fd < 0) return -1;
+	return epoll_ctl(epfd, EPOLL_CTL_DEL, tw->timer_fd, NULL);
+}
+
+// tw_pollwheels waits up to timeout ms on an epoll holding only wheels and
+// runs the elapsed ticks of each ready wheel. Returns the number of events,
+// or -1 on error. A wheel whose timerfd reports an error does not keep the
+// other ready wheels from running; -1 is returned with errno set to EIO once
+// they all ran. An application loop can add epfd to its own epoll and call
+// this with a zero timeout when it becomes readable.
+int tw_pollwheels(int epfd, int timeout)
+{
 	struct epoll_event events[4];
-	timewheel_t* evtw;
-	uint64_t exp;
+	int i, nevents, failed = 0;
+	nevents = epoll_wait(epfd, events, 4, timeout);
+	for (i = 0; i < nevents; i++) {
+		if (events[i].events & EPOLLERR || events[i].events & EPOLLHUP) {
+			failed = 1;
+			continue;
+		}
+		tw_proctimerev((timewheel_t*)events[i].data.ptr);
+	}
+	if (failed) {
+		errno = EIO;
+		return -1;
+	}
+	return nevents;
+}
+
+void* _clockdriver(void *arg) {
+	timewheel_t *tw = arg;
+
+	int epfd = epoll_create(1);
+	if (tw_attach(tw, epfd) != 0) {
+		close(epfd);
+		pthread_exit(NULL);
+	}
 	// printf("clock driver loop start\n");
 	while (1) {
 		if (tw->tw_status == TW_STATUS_EXITED) {
 			break;
 		}
-		nevents = epoll_wait(epfd, events, 4, -1);
-		for (i = 0; i < nevents; i++) {
-			if (events[i].events & EPOLLERR || events[i].events & EPOLLHUP) {
-				// printf("timewheel clock driver shutdown...\n");
-				pthread_exit(NULL);
-			}
-
-			evtw = (timewheel_t*)events[i].data.ptr;
-			ret = read(evtw->timer_fd, &exp, sizeof(uint64_t));
-			for (j = 0; j < exp; j++) {
-				tw_nexttick(evtw);
-			}
+		if (tw_pollwheels(epfd, -1) < 0 && errno != EINTR) {
+			// printf("timewheel clock driver shutdown...\n");
+			break;
 		}
 	}
+	close(epfd);
 	pthread_exit(NULL);
 }
 
@@ -313,14 +1155,14 @@ int tw_gettimerfd(timewheel_t *tw)
 }
 
 
+// tw_proctimerev runs the ticks that elapsed since the last call. Call it
+// when the wheel's timerfd becomes readable; with edge triggering it must run
+// on every wakeup.
 void tw_proctimerev(timewheel_t *tw)
 {
 	uint64_t exp;
-	int ret, j;
+	int ret;
 	ret = read(tw->timer_fd, &exp, sizeof(uint64_t));
-	if (ret > 0) {
-		for (j = 0; j < exp; j++) {
-			tw_nexttick(tw);
-		}
-	}
+	if (ret > 0)
+		_runticks(tw, exp);
 }
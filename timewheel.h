@@ -2,6 +2,7 @@
 #define TIMEWHEEL_H
 
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -21,28 +22,92 @@ typedef struct twtask {
 
 	void		(*cb)(void *arg);
 	void		*arg;
+	void		*owner;	// tasks of one owner share a per-tick budget
 }twtask_t;
 #define TWTASK_FLAG_EXECONECE	0x0
 #define TWTASK_FLAG_CANCELLED	0x1
 #define TWTASK_FLAG_PERIODIC	0x2
 
+// A handle names a task by slot index (low 32 bits) and generation (high 32
+// bits). The generation changes whenever a slot is released, so a handle
+// kept after the task fired or was cancelled is rejected instead of touching
+// a reused slot. 0 is never a valid handle.
+typedef uint64_t twhandle_t;
+#define TW_HANDLE_INVALID	0
+
 typedef struct twtasknode {
 	twtask_t	task;
 	unsigned int 	exec_tick;
 	struct twtasknode*	next;
+	struct twtasknode**	pprev;	// link pointing at this node
+	struct twbucket*	bucket;	// NULL while a tick is running the node
+	struct timewheel*	tw;
+	unsigned int	slot;
+	unsigned int	gen;	// TW_GEN_CANCEL is set by tw_cancel on a running task
 }twtasknode_t;
+#define TW_GEN_CANCEL	0x80000000u
+
+// Nodes are allocated in chunks that are never moved or freed before the
+// wheel, so a slot index always maps to the same node. Chunks are found
+// through a two-level directory whose pages are added as the wheel grows, up
+// to the 2^32 slots a handle can name.
+#define TW_CHUNK_BITS	10
+#define TW_CHUNK_SIZE	(1 << TW_CHUNK_BITS)
+#define TW_DIR_BITS	11
+#define TW_DIR_SIZE	(1 << TW_DIR_BITS)
+#define TW_MAX_CHUNKS	(TW_DIR_SIZE * TW_DIR_SIZE)
+
+// A batch callback receives the args of every task with the matching
+// callback that fired in one tick, see tw_setbatch.
+#define TW_MAX_BATCH	4
+
+typedef struct twbatch {
+	void		(*cb)(void *arg);
+	void		(*fn)(void **args, unsigned int n);
+	void		**args;
+	unsigned int	n;
+	unsigned int	cap;
+}twbatch_t;
+
+// Tasks fired per owner in the current tick, see tw_setbudget.
+#define TW_OWNER_SLOTS	64
+
+typedef struct twowner {
+	void		*owner;
+	unsigned int	fired;
+}twowner_t;
 
 typedef struct twbucket {
 	pthread_mutex_t	lock;
 	twtasknode_t*	task_list;
 }twbucket_t;
 
+// Statistics are only collected when compiled with -DTTLMAP_STATS.
+#define TW_STATS_HIST	24
+
+typedef struct twstats {
+	uint64_t	ticks;
+	uint64_t	scheduled;
+	uint64_t	fired;
+	uint64_t	cancelled;	// cancelled tasks dropped by the wheel
+	uint64_t	cascaded;	// tasks moved down a level
+	uint64_t	last_fired;	// tasks fired by the last tick
+	uint64_t	max_fired;	// most tasks fired by a single tick
+	uint64_t	lag_total_ns;	// how late ticks ran behind the clock
+	uint64_t	lag_max_ns;
+	uint64_t	deferred;	// tasks pushed to the next tick by an owner's budget
+	uint64_t	cb_hist[TW_STATS_HIST];	// callback time, bin i counts [2^i, 2^(i+1)) ns
+	unsigned int	occupancy[3];	// pending tasks per level, L1 to L3
+}twstats_t;
+
 typedef struct timewheel {
 	unsigned int	cur_tick;
+	unsigned int	tick_seq;	// odd while a tick moves cur_tick and takes its slots
 	int		timer_fd;
 	pthread_t	loop_tid;
 	pthread_mutex_t	ref_lock;
-	unsigned short	ref_count;
+	pthread_mutex_t	tick_lock;	// held while a tick runs
+	unsigned int	ref_count;
 	unsigned short	tw_status;
 
 	unsigned char	_ticksize;
@@ -54,6 +119,26 @@ typedef struct timewheel {
 	twbucket_t	twL1[TIMEWHEEL_SIZE];
 	twbucket_t	twL2[TIMEWHEEL_SIZE];
 	twbucket_t	twL3[TIMEWHEEL_SIZE];
+
+	unsigned char	manual;
+	uint64_t	tick_ns;	// tick length
+	uint64_t	nticks;		// ticks run since start, not wrapping
+	uint64_t	vnow_ns;	// virtual clock of a manual wheel
+	unsigned int	pending;	// tasks in the wheel, 0 lets idle ticks be skipped
+	unsigned int	next_id;
+	pthread_mutex_t	free_lock;
+	twtasknode_t*	free_list;	// released nodes kept for reuse
+	twtasknode_t***	chunks;		// directory pages of chunk pointers
+	unsigned int	nchunks;
+	twbatch_t	batch[TW_MAX_BATCH];
+	int		nbatch;
+	unsigned int	budget;		// tasks per owner per tick, 0 for no limit
+	twowner_t	owners[TW_OWNER_SLOTS];
+	unsigned char	owned[TW_OWNER_SLOTS];	// slots used this tick
+	unsigned int	nowned;
+
+	uint64_t	start_ns;	// tick n is due at start_ns + n * tick_ns
+	twstats_t	stats;
 }timewheel_t;
 
 #define TW_STATUS_READY		0
@@ -74,22 +159,58 @@ typedef struct timewheel {
 #define TW_TICKSIZE_1024MS	10
 
 timewheel_t* tw_new();
+timewheel_t* tw_default();
+timewheel_t* tw_new_us(unsigned int tick_us);
 void tw_free(timewheel_t *tw);
 void tw_init(timewheel_t *tw, unsigned char ticksize);
+void tw_init_us(timewheel_t *tw, unsigned int tick_us);
+uint64_t tw_now_ms(timewheel_t *tw);
+uint64_t tw_now_ns(timewheel_t *tw);
 
+// task pointer API: a twtask_t pointer must not be used once its task has
+// fired or been cancelled, as the node is reused by a later task. Use the
+// handle API below when that can't be ruled out.
 twtask_t* tw_addtask(timewheel_t *tw, unsigned int timeout_ms,
 				void (*cb)(void *arg), void *arg);
+twtask_t* tw_addtask_at(timewheel_t *tw, uint64_t deadline_ns,
+				void (*cb)(void *arg), void *arg);
+twtask_t* tw_addtask_slack(timewheel_t *tw, unsigned int timeout_ms, unsigned int slack_ms,
+				void (*cb)(void *arg), void *arg);
+twtask_t* tw_addtask_owned(timewheel_t *tw, unsigned int timeout_ms, unsigned int slack_ms,
+				void *owner, void (*cb)(void *arg), void *arg);
+void tw_setbudget(timewheel_t *tw, unsigned int per_owner);
+int tw_setbatch(timewheel_t *tw, void (*cb)(void *arg), void (*fn)(void **args, unsigned int n));
 void tw_changetask(twtask_t *task, void (*cb)(void *arg), void *arg);
 void tw_canceltask(twtask_t *task);
+int tw_resettask(timewheel_t *tw, twtask_t *task, unsigned int timeout_ms);
+unsigned int tw_canceltasks(timewheel_t *tw, int (*match)(twtask_t *task, void *udata), void *udata);
 twtask_t* tw_settaskperiod(timewheel_t *tw, twtask_t *task, unsigned int period_ms);
 
+// handle API
+twhandle_t tw_add(timewheel_t *tw, unsigned int timeout_ms, void (*cb)(void *arg), void *arg);
+twhandle_t tw_add_at(timewheel_t *tw, uint64_t deadline_ns, void (*cb)(void *arg), void *arg);
+// 0 cancelled before firing, 1 too late: the callback runs or ran, but a
+// periodic task is not run again, -1 stale handle
+int tw_cancel(timewheel_t *tw, twhandle_t handle);
+int tw_reschedule(timewheel_t *tw, twhandle_t handle, unsigned int timeout_ms);
+
 // void tw_nexttick(timewheel_t *tw);
 
+int tw_stats(timewheel_t *tw, twstats_t *stats);
+
 // pthread API
 pthread_t tw_runthread(timewheel_t *tw);
 
 // timerfd API
 int tw_gettimerfd(timewheel_t *tw);
 void tw_proctimerev(timewheel_t *tw);
+int tw_attach(timewheel_t *tw, int epfd);
+int tw_detach(timewheel_t *tw, int epfd);
+int tw_pollwheels(int epfd, int timeout);
+
+// virtual clock API
+timewheel_t* tw_new_manual(unsigned char ticksize);
+void tw_init_manual(timewheel_t *tw, unsigned char ticksize);
+void tw_advance(timewheel_t *tw, unsigned int ms);
 
 #endif
\ No newline at end of file
@@ -1,7 +1,262 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include "ttlmap.h"
 
-#define TTLMAP_LOCK(map)	do {if ((map)->safe == 0) pthread_mutex_lock(&((map)->hlock));} while(0);	
-#define TTLMAP_UNLOCK(map)	do {if ((map)->safe == 0) pthread_mutex_unlock(&((map)->hlock));} while(0);	
+#define TTLMAP_LOCK(map)	do {if ((map)->safe != 0) pthread_mutex_lock(&((map)->hlock));} while(0);	
+#define TTLMAP_UNLOCK(map)	do {if ((map)->safe != 0) pthread_mutex_unlock(&((map)->hlock));} while(0);	
+
+#ifdef TTLMAP_STATS
+#define TTLMAP_STAT_INC(map, field)	((map)->stats.field++)
+#define TTLMAP_STAT_INC_ATOMIC(map, field)	__atomic_fetch_add(&(map)->stats.field, 1, __ATOMIC_RELAXED)
+#else
+#define TTLMAP_STAT_INC(map, field)	do {} while (0)
+#define TTLMAP_STAT_INC_ATOMIC(map, field)	do {} while (0)
+#endif
+
+// Every item is stored with a trailing ttlmeta, so the hashmap element is
+// slightly larger than the user element. Hash and compare functions only look
+// at the user part, so lookups still take a plain user element.
+struct ttlmeta {
+	uint64_t	deadline;	// wheel clock ms (tw_now_ms), 0 means no ttl
+};
+#define TTLMAP_META(map, item)	((struct ttlmeta*)((char*)(item) + (map)->metaoff))
+
+// The deadline of a placeholder that holds the key while its item is being
+// loaded, see ttlmap_get_or_load.
+#define TTLMAP_LOADING	UINT64_MAX
+
+// Expiry timer argument, a copy of the item's key with the deadline it was
+// armed for.
+struct _delitemarg {
+	ttlmap *map;
+	uint64_t deadline;
+	char item[];
+};
+void _deleteitem(void *arg);
+static void _deleteitems(void **args, unsigned int n);
+static int _armtimer(ttlmap *map, struct _delitemarg *darg, uint64_t ttl_ms);
+
+static uint64_t _now_ms(clockid_t clk)
+{
+	struct timespec ts;
+	clock_gettime(clk, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static size_t _itemsz(size_t elsize, size_t *metaoff)
+{
+	*metaoff = (elsize + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1);
+	return *metaoff + sizeof(struct ttlmeta);
+}
+
+static void _holdwheel(timewheel_t *tw)
+{
+	pthread_mutex_lock(&tw->ref_lock);
+	tw->ref_count++;
+	pthread_mutex_unlock(&tw->ref_lock);
+}
+
+static void _releasewheel(timewheel_t *tw)
+{
+	int shouldbefree = 0;
+	pthread_mutex_lock(&tw->ref_lock);
+	if (--tw->ref_count == 0) {
+		shouldbefree = 1;
+	}
+	pthread_mutex_unlock(&tw->ref_lock);
+	if (shouldbefree) {
+		tw_free(tw);
+	}
+}
+
+// _ttlmap_init sets up everything but the engine. Returns -1 when the
+// scratch item or the default wheel can't be created.
+static int _ttlmap_init(ttlmap *map, size_t elsize, uint64_t seed0, uint64_t seed1,
+			    void (*elfree)(void *item), timewheel_t *twptr, int safe)
+{
+	map->cmap = NULL;
+	map->smap = NULL;
+	map->elsize = elsize;
+	map->keysize = elsize;
+	map->itemsz = _itemsz(elsize, &map->metaoff);
+	map->scratch = calloc(1, map->itemsz);
+	map->seed0 = seed0;
+	map->seed1 = seed1;
+	map->elfree = elfree;
+	map->snap = NULL;
+	map->log = NULL;
+	map->lsn = 0;
+	map->wheels = NULL;
+	map->nwheels = 0;
+	map->slack = 0;
+	memset(&map->stats, 0, sizeof(map->stats));
+	// maps without a wheel of their own share the process-wide default one
+	if (twptr == NULL)
+		twptr = tw_default();
+	if (map->scratch == NULL || twptr == NULL) {
+		free(map->scratch);
+		return -1;
+	}
+	_holdwheel(twptr);
+	map->tw = twptr;
+	tw_setbatch(map->tw, _deleteitem, _deleteitems);
+
+	pthread_mutex_t init_mutex = PTHREAD_MUTEX_INITIALIZER;
+	memcpy(&map->hlock, &init_mutex, sizeof(init_mutex));
+	pthread_cond_t init_cond = PTHREAD_COND_INITIALIZER;
+	memcpy(&map->loaded, &init_cond, sizeof(init_cond));
+	map->safe = safe ? 1 : 0;
+	return 0;
+}
+
+// The engines used under the map lock, a hashmap or a segmented shashmap.
+static void *_hget(ttlmap *map, const void *item)
+{
+	return map->smap != NULL ? shashmap_get(map->smap, item) : hashmap_get(map->hmap, item);
+}
+
+static void *_hset(ttlmap *map, const void *item)
+{
+	return map->smap != NULL ? shashmap_set(map->smap, item) : hashmap_set(map->hmap, item);
+}
+
+static void *_hupsert(ttlmap *map, const void *key, bool *found)
+{
+	return map->smap != NULL ? shashmap_upsert(map->smap, key, found) : hashmap_upsert(map->hmap, key, found);
+}
+
+static void *_hdelete(ttlmap *map, void *item)
+{
+	return map->smap != NULL ? shashmap_delete(map->smap, item) : hashmap_delete(map->hmap, item);
+}
+
+static size_t _hcount(ttlmap *map)
+{
+	return map->smap != NULL ? shashmap_count(map->smap) : hashmap_count(map->hmap);
+}
+
+static bool _hoom(ttlmap *map)
+{
+	return map->smap != NULL ? shashmap_oom(map->smap) : hashmap_oom(map->hmap);
+}
+
+// Change log. Records are appended to in-memory buffers while the map lock
+// is held, which keeps them in operation order, and are written out with
+// writev by whichever caller finds the group commit due.
+#define TTLMAP_LOG_SET		1
+#define TTLMAP_LOG_DELETE	2
+#define TTLMAP_LOG_EXPIRE	3
+#define TTLMAP_LOG_CLEAR	4
+
+#define TTLMAP_LOG_BUFSZ	(64 * 1024)
+#define TTLMAP_LOG_MAXFULL	16
+
+struct ttlmap_logrec {
+	uint64_t	lsn;
+	uint64_t	deadline;	// CLOCK_REALTIME ms, 0 means no ttl
+	uint32_t	op;
+	uint32_t	len;		// bytes of the item that follows, zero padded
+};
+
+struct _logbuf {
+	struct _logbuf	*next;
+	size_t		len;
+	char		data[TTLMAP_LOG_BUFSZ];
+};
+
+struct ttlmap_log {
+	int		fd;
+	int		sync;
+	int		err;
+	uint64_t	commit_ms;
+	uint64_t	last_commit;
+	int64_t		realoff;	// CLOCK_REALTIME - CLOCK_MONOTONIC
+	size_t		recsz;
+	pthread_mutex_t	lock;		// protects the buffers
+	pthread_mutex_t	iolock;		// serializes writes to fd
+	struct _logbuf	*cur;
+	struct _logbuf	*full;
+	struct _logbuf	**fulltail;
+	int		nfull;
+	struct _logbuf	*freelist;
+};
+
+static struct _logbuf *_logbuf_get(struct ttlmap_log *log)
+{
+	struct _logbuf *buf = log->freelist;
+	if (buf != NULL)
+		log->freelist = buf->next;
+	else
+		buf = malloc(sizeof(struct _logbuf));
+	if (buf != NULL) {
+		buf->next = NULL;
+		buf->len = 0;
+	}
+	return buf;
+}
+
+// _reclen returns the size of the item a record of op carries: the whole
+// item for a set, the key for deletes and expiries and nothing for a clear.
+static size_t _reclen(ttlmap *map, uint32_t op)
+{
+	switch (op) {
+	case TTLMAP_LOG_SET:
+		return map->elsize;
+	case TTLMAP_LOG_CLEAR:
+		return 0;
+	default:
+		return map->keysize;
+	}
+}
+
+// _log_append must be called with the map locked. Returns 1 when the caller
+// should commit the log once it has released the map lock.
+static int _log_append(ttlmap *map, uint32_t op, const void *item, uint64_t deadline)
+{
+	struct ttlmap_log *log = map->log;
+	struct ttlmap_logrec rec;
+	struct _logbuf *buf;
+	size_t len = _reclen(map, op);
+	int due;
+
+	rec.lsn = ++map->lsn;
+	rec.deadline = deadline ? deadline + log->realoff : 0;
+	rec.op = op;
+	rec.len = len;
+	pthread_mutex_lock(&log->lock);
+	if (log->cur == NULL || log->cur->len + log->recsz > TTLMAP_LOG_BUFSZ) {
+		buf = _logbuf_get(log);
+		if (buf == NULL) {
+			log->err = ENOMEM;
+			pthread_mutex_unlock(&log->lock);
+			return 1;
+		}
+		if (log->cur != NULL) {
+			*log->fulltail = log->cur;
+			log->fulltail = &log->cur->next;
+			log->nfull++;
+		}
+		log->cur = buf;
+	}
+	buf = log->cur;
+	memcpy(buf->data + buf->len, &rec, sizeof(rec));
+	if (item != NULL)
+		memcpy(buf->data + buf->len + sizeof(rec), item, len);
+	memset(buf->data + buf->len + sizeof(rec) + len, 0, map->elsize - len);
+	buf->len += log->recsz;
+	due = log->nfull >= TTLMAP_LOG_MAXFULL ||
+		(log->commit_ms != 0 && _now_ms(CLOCK_MONOTONIC_COARSE) - log->last_commit >= log->commit_ms);
+	pthread_mutex_unlock(&log->lock);
+	return due;
+}
+
+#define TTLMAP_LOG(map, op, item, deadline) \
+	((map)->log != NULL ? _log_append((map), (op), (item), (deadline)) : 0)
 
 ttlmap *_ttlmap_new(size_t elsize, size_t cap, 
                             uint64_t seed0, uint64_t seed1,
@@ -13,34 +268,23 @@ ttlmap *_ttlmap_new(size_t elsize, size_t cap,
                             void *udata,
 			    timewheel_t *twptr, int safe)
 {
+	size_t metaoff;
 	ttlmap *map = (ttlmap*)malloc(sizeof(ttlmap));
-	map->hmap = hashmap_new(elsize, cap, seed0, seed1, hash, compare, elfree, udata);
-	map->elsize = elsize;
-	if (twptr == NULL) {
-		map->tw = tw_new();
-		tw_runthread(map->tw);
-	} else {
-		pthread_mutex_lock(&twptr->ref_lock);
-		twptr->ref_count++;
-		pthread_mutex_unlock(&twptr->ref_lock);
-		map->tw = twptr;
+	if (map == NULL)
+		return NULL;
+	map->hmap = hashmap_new(_itemsz(elsize, &metaoff), cap, seed0, seed1, hash, compare, elfree, udata);
+	if (map->hmap == NULL || _ttlmap_init(map, elsize, seed0, seed1, elfree, twptr, safe) < 0) {
+		hashmap_free(map->hmap);
+		free(map);
+		return NULL;
 	}
-
-	if (safe == 0) {
-		map->safe = 0;
-	} else {
-		map->safe = 1;
-		pthread_mutex_t init_mutex = PTHREAD_MUTEX_INITIALIZER;
-		memcpy(&map->hlock, &init_mutex, sizeof(init_mutex));
-	}
-	
 	return map;
 }
 
 ttlmap *_ttlmap_new_with_allocator(
-                            void *(*malloc)(size_t), 
-                            void *(*realloc)(void *, size_t), 
-                            void (*free)(void*),
+                            void *(*_malloc)(size_t), 
+                            void *(*_realloc)(void *, size_t), 
+                            void (*_free)(void*),
                             size_t elsize, size_t cap, 
                             uint64_t seed0, uint64_t seed1,
                             uint64_t (*hash)(const void *item, 
@@ -51,26 +295,16 @@ ttlmap *_ttlmap_new_with_allocator(
                             void *udata, 
 			    timewheel_t *twptr, int safe)
 {
+	size_t metaoff;
 	ttlmap *map = (ttlmap*)malloc(sizeof(ttlmap));
-	map->hmap = hashmap_new_with_allocator(malloc, realloc, free, elsize, cap, seed0, seed1, hash, compare, elfree, udata);
-	if (twptr == NULL) {
-		map->tw = tw_new();
-		tw_runthread(map->tw);
-	} else {
-		pthread_mutex_lock(&twptr->ref_lock);
-		twptr->ref_count++;
-		pthread_mutex_unlock(&twptr->ref_lock);
-		map->tw = twptr;
-	}
-	
-	if (safe == 0) {
-		map->safe = 0;
-	} else {
-		map->safe = 1;
-		pthread_mutex_t init_mutex = PTHREAD_MUTEX_INITIALIZER;
-		memcpy(&map->hlock, &init_mutex, sizeof(init_mutex));
+	if (map == NULL)
+		return NULL;
+	map->hmap = hashmap_new_with_allocator(_malloc, _realloc, _free, _itemsz(elsize, &metaoff), cap, seed0, seed1, hash, compare, elfree, udata);
+	if (map->hmap == NULL || _ttlmap_init(map, elsize, seed0, seed1, elfree, twptr, safe) < 0) {
+		hashmap_free(map->hmap);
+		free(map);
+		return NULL;
 	}
-
 	return map;
 }
 
@@ -134,103 +368,950 @@ ttlmap *ttlmap_new_with_allocator_threadunsafe(
 	return _ttlmap_new_with_allocator(malloc, realloc, free, elsize, cap, seed0, seed1, hash, compare, elfree, udata, twptr, 0);
 }
 
-void ttlmap_free(ttlmap *map)
+// ttlmap_new_concurrent creates a map on the concurrent engine (chashmap_new)
+// instead of a hashmap behind one mutex. Gets never block, and sets and
+// deletes only contend when they fall on the same lock stripe. Items returned
+// by get, set and delete stay valid until the calling thread leaves its
+// section, so wrap the call and the use of the item in ttlmap_enter and
+// ttlmap_leave. Persistence and the change log work on the bucket array of a
+// hashmap and are not available; they fail with ENOTSUP.
+ttlmap *ttlmap_new_concurrent(size_t elsize, size_t cap, 
+                            uint64_t seed0, uint64_t seed1,
+                            uint64_t (*hash)(const void *item, 
+                                             uint64_t seed0, uint64_t seed1),
+                            int (*compare)(const void *a, const void *b, 
+                                           void *udata),
+                            void (*elfree)(void *item),
+                            void *udata,
+			    timewheel_t *twptr)
 {
-	hashmap_free(map->hmap);
-	pthread_mutex_destroy(&map->hlock);
-	
-	int shouldbefree = 0;
-	pthread_mutex_lock(&map->tw->ref_lock);
-	if (--map->tw->ref_count == 0) {
-		shouldbefree = 1;
+	size_t metaoff;
+	ttlmap *map = (ttlmap*)malloc(sizeof(ttlmap));
+	if (map == NULL)
+		return NULL;
+	map->hmap = NULL;
+	if (_ttlmap_init(map, elsize, seed0, seed1, elfree, twptr, 0) < 0) {
+		free(map);
+		return NULL;
 	}
-	pthread_mutex_unlock(&map->tw->ref_lock);
-	if (shouldbefree) {
-		tw_free(map->tw);
+	map->cmap = chashmap_new(_itemsz(elsize, &metaoff), cap, seed0, seed1, hash, compare, elfree, udata);
+	if (map->cmap == NULL) {
+		ttlmap_free(map);
+		return NULL;
+	}
+	return map;
+}
+
+// ttlmap_new_segmented creates a map on the segmented engine (shashmap_new),
+// which grows by splitting one fixed-size segment at a time instead of
+// doubling the whole table. It is used like a map from ttlmap_new, except
+// that ttlmap_save and snapshots, which write a single bucket array, fail
+// with ENOTSUP. The change log works as usual.
+ttlmap *ttlmap_new_segmented(size_t elsize, size_t cap, 
+                            uint64_t seed0, uint64_t seed1,
+                            uint64_t (*hash)(const void *item, 
+                                             uint64_t seed0, uint64_t seed1),
+                            int (*compare)(const void *a, const void *b, 
+                                           void *udata),
+                            void (*elfree)(void *item),
+                            void *udata,
+			    timewheel_t *twptr)
+{
+	size_t metaoff;
+	ttlmap *map = (ttlmap*)malloc(sizeof(ttlmap));
+	if (map == NULL)
+		return NULL;
+	map->hmap = NULL;
+	if (_ttlmap_init(map, elsize, seed0, seed1, elfree, twptr, 1) < 0) {
+		free(map);
+		return NULL;
+	}
+	map->smap = shashmap_new(_itemsz(elsize, &metaoff), cap, seed0, seed1, hash, compare, elfree, udata);
+	if (map->smap == NULL) {
+		ttlmap_free(map);
+		return NULL;
 	}
+	return map;
+}
+
+// ttlmap_enter starts a section in which items returned by a concurrent map
+// stay valid, ttlmap_leave ends it. Sections may be nested. Both do nothing
+// for the other maps.
+void ttlmap_enter(ttlmap *map)
+{
+	if (map->cmap != NULL)
+		chashmap_enter();
+}
+
+void ttlmap_leave(ttlmap *map)
+{
+	if (map->cmap != NULL)
+		chashmap_leave();
+}
+
+// ttlmap_setwheels spreads the expiry timers of the map over n wheels, one
+// per cpu. A set schedules its timer on wheels[cpu % n] of the cpu it runs
+// on, so producers pinned to different cores never touch each other's wheel.
+// Each wheel is typically attached to the event loop of its core. The wheels
+// must run on the same clock as the map's own wheel, which keeps providing
+// deadlines. May only be called once, before the map is shared.
+int ttlmap_setwheels(ttlmap *map, timewheel_t **wheels, int n)
+{
+	int i;
+	if (map->nwheels != 0 || wheels == NULL || n <= 0)
+		return -1;
+	map->wheels = malloc(sizeof(timewheel_t*) * n);
+	if (map->wheels == NULL)
+		return -1;
+	for (i = 0; i < n; i++) {
+		_holdwheel(wheels[i]);
+		tw_setbatch(wheels[i], _deleteitem, _deleteitems);
+		map->wheels[i] = wheels[i];
+	}
+	map->nwheels = n;
+	return 0;
+}
+
+static int _ownedtimer(twtask_t *task, void *udata)
+{
+	struct _delitemarg *darg = task->arg;
+	if (task->cb != _deleteitem || darg->map != udata)
+		return 0;
+	free(darg);
+	return 1;
+}
+
+// _dropwheel cancels the map's pending expiry timers on a wheel, which may
+// outlive the map, and releases the map's reference to it.
+static void _dropwheel(ttlmap *map, timewheel_t *tw)
+{
+	tw_canceltasks(tw, _ownedtimer, map);
+	_releasewheel(tw);
+}
+
+// ttlmap_setresizers lets the table of a large map be grown by nthreads
+// threads, see hashmap_set_resizers. Has no effect on the other engines.
+void ttlmap_setresizers(ttlmap *map, int nthreads)
+{
+	if (map->hmap == NULL)
+		return;
+	TTLMAP_LOCK(map);
+	hashmap_set_resizers(map->hmap, nthreads);
+	TTLMAP_UNLOCK(map);
+}
+
+// ttlmap_setkeysize declares that the first keysize bytes of an item are its
+// key, such as offsetof(struct user, age) for a struct user keyed by name.
+// The hash and compare functions must then only read the key. Gets and
+// deletes take a pointer to just the key, and expiry timers and log records
+// of deletes only keep a copy of the key. Must be called before the map is
+// used. Returns -1 if keysize is 0 or larger than the item.
+int ttlmap_setkeysize(ttlmap *map, size_t keysize)
+{
+	if (keysize == 0 || keysize > map->elsize)
+		return -1;
+	map->keysize = keysize;
+	return 0;
+}
+
+// ttlmap_setslack lets expiry run up to percent of an item's ttl late, so the
+// wheel can group nearby expiries into one tick and reap them under a single
+// lock hold. Expired items stay hidden from ttlmap_get at their exact
+// deadline; only reclaiming them is deferred.
+void ttlmap_setslack(ttlmap *map, unsigned int percent)
+{
+	map->slack = percent;
+}
+
+void ttlmap_free(ttlmap *map)
+{
+	int i;
+	for (i = 0; i < map->nwheels; i++)
+		_dropwheel(map, map->wheels[i]);
+	free(map->wheels);
+	_dropwheel(map, map->tw);
+	ttlmap_snapshot_abort(map);
+	ttlmap_log_close(map);
+	if (map->cmap != NULL)
+		chashmap_free(map->cmap);
+	else if (map->smap != NULL)
+		shashmap_free(map->smap);
+	else
+		hashmap_free(map->hmap);
+	pthread_mutex_destroy(&map->hlock);
+	pthread_cond_destroy(&map->loaded);
+	free(map->scratch);
 	free(map);
 }
 
 
 void ttlmap_clear(ttlmap *map, bool update_cap)
 {
+	int commit;
+	if (map->cmap != NULL) {
+		chashmap_clear(map->cmap, update_cap);
+		return;
+	}
 	TTLMAP_LOCK(map);
-	hashmap_clear(map->hmap, update_cap);
+	if (map->smap != NULL)
+		shashmap_clear(map->smap, update_cap);
+	else
+		hashmap_clear(map->hmap, update_cap);
+	commit = TTLMAP_LOG(map, TTLMAP_LOG_CLEAR, NULL, 0);
 	TTLMAP_UNLOCK(map);
+	if (commit)
+		ttlmap_log_flush(map);
 }
 
 size_t ttlmap_count(ttlmap *map)
 {
 	size_t ret;
+	if (map->cmap != NULL)
+		return chashmap_count(map->cmap);
 	TTLMAP_LOCK(map);
-	hashmap_count(map->hmap);
+	ret = _hcount(map);
 	TTLMAP_UNLOCK(map);
+	return ret;
 }
 
 
 bool ttlmap_oom(ttlmap *map)
 {
 	bool ret;
+	if (map->cmap != NULL)
+		return chashmap_oom(map->cmap);
 	TTLMAP_LOCK(map);
-	ret = hashmap_oom(map->hmap);
+	ret = _hoom(map);
 	TTLMAP_UNLOCK(map);
 	return ret;
 }
 
 
+// _live tells whether a stored item may be returned. An item the wheel has
+// not reaped yet is already gone, and the placeholder of a load is not there
+// yet.
+static bool _live(ttlmap *map, const void *item)
+{
+	uint64_t deadline = TTLMAP_META(map, item)->deadline;
+	if (deadline == TTLMAP_LOADING)
+		return false;
+	return deadline == 0 || deadline > tw_now_ms(map->tw);
+}
+
 void *ttlmap_get(ttlmap *map, const void *item)
 {
 	void *ret;
 	TTLMAP_LOCK(map);
-	ret = hashmap_get(map->hmap, item);
+	if (map->cmap != NULL) {
+		chashmap_enter();
+		ret = chashmap_get(map->cmap, item);
+	} else {
+		ret = _hget(map, item);
+	}
+	if (ret != NULL && !_live(map, ret))
+		ret = NULL;
+	if (map->cmap != NULL)
+		chashmap_leave();
 	TTLMAP_UNLOCK(map);
 	return ret;
 }
 
-struct _delitemarg {
-	ttlmap *map;
+static bool _armedfor(const void *item, void *udata)
+{
+	struct _delitemarg *darg = udata;
+	return TTLMAP_META(darg->map, item)->deadline == darg->deadline;
+}
+
+// _early re-arms darg for the rest of its ttl when the wheel fired it before
+// the deadline, which it may as ticks are counted from the start of the
+// current one. Returns 1 when darg went back on a wheel. If the wheel can't
+// take it the item expires now, less than a tick early.
+static int _early(ttlmap *map, struct _delitemarg *darg)
+{
+	uint64_t now = tw_now_ms(map->tw);
+	if (darg->deadline <= now)
+		return 0;
+	return _armtimer(map, darg, darg->deadline - now);
+}
+
+// _expire must be called with the map locked. Returns 1 when the change log
+// is due for a commit. *rearmed is set when the timer fired early and darg
+// was put back on a wheel, it must not be freed then.
+static int _expire(ttlmap *map, struct _delitemarg *darg, int *rearmed)
+{
 	void *item;
-};
+	*rearmed = 0;
+	if (map->cmap != NULL) {
+		chashmap_enter();
+		item = chashmap_get(map->cmap, darg->item);
+		if (item != NULL && TTLMAP_META(map, item)->deadline == darg->deadline)
+			*rearmed = _early(map, darg);
+		chashmap_leave();
+		if (*rearmed)
+			return 0;
+		if (chashmap_delete_if(map->cmap, darg->item, _armedfor, darg) != NULL)
+			TTLMAP_STAT_INC_ATOMIC(map, expired);
+		return 0;
+	}
+	item = _hget(map, darg->item);
+	// only the timer of the latest ttl owns the item
+	if (item != NULL && TTLMAP_META(map, item)->deadline == darg->deadline) {
+		if ((*rearmed = _early(map, darg)))
+			return 0;
+		_hdelete(map, darg->item);
+		TTLMAP_STAT_INC(map, expired);
+		return TTLMAP_LOG(map, TTLMAP_LOG_EXPIRE, darg->item, 0);
+	}
+	return 0;
+}
+
 void _deleteitem(void *arg) {
 	// printf("call delete\n");
 	struct _delitemarg *darg = arg;
-	ttlmap_delete(darg->map, darg->item);
-	free(darg->item);
-	free(darg);
+	ttlmap *map = darg->map;
+	int commit, rearmed;
+	TTLMAP_LOCK(map);
+	commit = _expire(map, darg, &rearmed);
+	TTLMAP_UNLOCK(map);
+	if (commit)
+		ttlmap_log_flush(map);
+	if (!rearmed)
+		free(darg);
 }
 
-void *ttlmap_set(ttlmap *map, const void *item, int ttl_ms)
+// _deleteitems is the batch form of _deleteitem the wheels call with all
+// expiries of a tick. Runs of timers for the same map share one lock hold.
+static void _deleteitems(void **args, unsigned int n)
 {
+	unsigned int i = 0, j;
+	ttlmap *map;
+	int commit, rearmed;
+	while (i < n) {
+		map = ((struct _delitemarg*)args[i])->map;
+		commit = 0;
+		TTLMAP_LOCK(map);
+		for (j = i; j < n && ((struct _delitemarg*)args[j])->map == map; j++) {
+			commit |= _expire(map, args[j], &rearmed);
+			if (rearmed)
+				args[j] = NULL;
+		}
+		TTLMAP_UNLOCK(map);
+		if (commit)
+			ttlmap_log_flush(map);
+		for (; i < j; i++)
+			free(args[i]);
+	}
+}
+
+// _settimer arms the expiry of item. When out of memory the item is left
+// without a timer and counted as unarmed. It is still hidden once its
+// deadline passed, but is only removed by a later set or delete.
+static void _settimer(ttlmap *map, const void *item, uint64_t ttl_ms, uint64_t deadline)
+{
+	struct _delitemarg *darg = (struct _delitemarg*)malloc(sizeof(struct _delitemarg) + map->keysize);
+	if (darg == NULL) {
+		TTLMAP_STAT_INC_ATOMIC(map, unarmed);
+		return;
+	}
+	memcpy(darg->item, item, map->keysize);
+	darg->map = map;
+	darg->deadline = deadline;
+	if (!_armtimer(map, darg, ttl_ms)) {
+		TTLMAP_STAT_INC_ATOMIC(map, unarmed);
+		free(darg);
+	}
+}
+
+// _armtimer puts darg on the wheel of the calling cpu to fire after ttl_ms.
+// Returns 0 when the wheel can't take it.
+static int _armtimer(ttlmap *map, struct _delitemarg *darg, uint64_t ttl_ms)
+{
+	timewheel_t *tw = map->tw;
+	if (map->nwheels > 0) {
+		int cpu = sched_getcpu();
+		tw = map->wheels[(cpu < 0 ? 0 : cpu) % map->nwheels];
+	}
+	return tw_addtask_owned(tw, ttl_ms, ttl_ms * map->slack / 100, map, _deleteitem, darg) != NULL;
+}
+
+// _cmap_set stores an item in a concurrent map. The item is put together on
+// the stack, as the map's scratch buffer is only usable under the map lock.
+static void *_cmap_set(ttlmap *map, const void *item, uint64_t deadline)
+{
+	char buf[256];
+	char *tmp = map->itemsz <= sizeof(buf) ? buf : malloc(map->itemsz);
 	void *ret;
+	if (tmp == NULL)
+		return NULL;
+	memcpy(tmp, item, map->elsize);
+	TTLMAP_META(map, tmp)->deadline = deadline;
+	ret = chashmap_set(map->cmap, tmp);
+	TTLMAP_STAT_INC_ATOMIC(map, sets);
+	if (tmp != buf)
+		free(tmp);
+	return ret;
+}
+
+static void *_ttlmap_set(ttlmap *map, const void *item, uint64_t ttl_ms, uint64_t deadline)
+{
+	void *ret;
+	int commit = 0;
+	if (map->cmap != NULL) {
+		ret = _cmap_set(map, item, deadline);
+		if (deadline != 0)
+			_settimer(map, item, ttl_ms, deadline);
+		return ret;
+	}
 	TTLMAP_LOCK(map);
-	ret = hashmap_set(map->hmap, item);
+	memcpy(map->scratch, item, map->elsize);
+	TTLMAP_META(map, map->scratch)->deadline = deadline;
+	ret = _hset(map, map->scratch);
+	TTLMAP_STAT_INC(map, sets);
+	if (!_hoom(map))
+		commit = TTLMAP_LOG(map, TTLMAP_LOG_SET, item, deadline);
 	TTLMAP_UNLOCK(map);
-	if (ttl_ms > 0) {
-		struct _delitemarg *darg = (struct _delitemarg*)malloc(sizeof(struct _delitemarg));
-		darg->item = malloc(map->elsize);
-		memcpy(darg->item, item, map->elsize);
-		darg->map = map;
-		tw_addtask(map->tw, ttl_ms, _deleteitem, darg);
+	if (commit)
+		ttlmap_log_flush(map);
+	if (deadline != 0)
+		_settimer(map, item, ttl_ms, deadline);
+	return ret;
+}
+
+void *ttlmap_set(ttlmap *map, const void *item, int ttl_ms)
+{
+	uint64_t deadline = 0;
+	if (ttl_ms > 0)
+		deadline = tw_now_ms(map->tw) + ttl_ms;
+	return _ttlmap_set(map, item, ttl_ms, deadline);
+}
+
+// ttlmap_setkv inserts or replaces the item made of key, which holds the
+// map's keysize bytes (see ttlmap_setkeysize), and value, which holds the
+// remaining elsize - keysize bytes. The value is copied once, straight into
+// the table, instead of through a whole item built by the caller. Returns the
+// replaced item like ttlmap_set. Items of a concurrent map are assembled on
+// the stack first, as they must be complete before they are published.
+void *ttlmap_setkv(ttlmap *map, const void *key, const void *value, int ttl_ms)
+{
+	uint64_t deadline = 0;
+	void *item, *ret = NULL;
+	bool found;
+	int commit = 0;
+	if (ttl_ms > 0)
+		deadline = tw_now_ms(map->tw) + ttl_ms;
+	if (map->cmap != NULL) {
+		char buf[256];
+		char *tmp = map->elsize <= sizeof(buf) ? buf : malloc(map->elsize);
+		if (tmp == NULL)
+			return NULL;
+		memcpy(tmp, key, map->keysize);
+		memcpy(tmp + map->keysize, value, map->elsize - map->keysize);
+		ret = _ttlmap_set(map, tmp, ttl_ms, deadline);
+		if (tmp != buf)
+			free(tmp);
+		return ret;
+	}
+	TTLMAP_LOCK(map);
+	item = _hupsert(map, key, &found);
+	if (item != NULL) {
+		if (found) {
+			memcpy(map->scratch, item, map->itemsz);
+			ret = map->scratch;
+		}
+		memcpy(item, key, map->keysize);
+		memcpy((char*)item + map->keysize, value, map->elsize - map->keysize);
+		memset((char*)item + map->elsize, 0, map->metaoff - map->elsize);
+		TTLMAP_META(map, item)->deadline = deadline;
+		TTLMAP_STAT_INC(map, sets);
+		commit = TTLMAP_LOG(map, TTLMAP_LOG_SET, item, deadline);
 	}
+	TTLMAP_UNLOCK(map);
+	if (commit)
+		ttlmap_log_flush(map);
+	if (item != NULL && deadline != 0)
+		_settimer(map, key, ttl_ms, deadline);
 	return ret;
 }
 
 
+// _lookup finds key for ttlmap_get_or_load, with the map locked. Returns the
+// item if it is live, and otherwise NULL with *loading telling whether the
+// key holds the placeholder of a load.
+static void *_lookup(ttlmap *map, const void *key, bool *loading)
+{
+	void *item;
+	if (map->cmap != NULL) {
+		chashmap_enter();
+		item = chashmap_get(map->cmap, key);
+	} else {
+		item = _hget(map, key);
+	}
+	*loading = item != NULL && TTLMAP_META(map, item)->deadline == TTLMAP_LOADING;
+	if (item != NULL && !_live(map, item))
+		item = NULL;
+	if (map->cmap != NULL)
+		chashmap_leave();
+	return item;
+}
+
+static bool _isloading(const void *item, void *udata)
+{
+	return TTLMAP_META((ttlmap*)udata, item)->deadline == TTLMAP_LOADING;
+}
+
+static bool _notlive(const void *item, void *udata)
+{
+	return !_live((ttlmap*)udata, item);
+}
+
+// _expired tells whether item is past its deadline but not reaped yet.
+static bool _expired(const void *item, void *udata)
+{
+	return !_isloading(item, udata) && _notlive(item, udata);
+}
+
+// _release hands an expired item that a load overwrites in place to elfree,
+// as the wheel will not find it anymore. A concurrent map retires the
+// replaced node instead, as it does for items the wheel reaps.
+static void _release(ttlmap *map, void *item)
+{
+	if (map->elfree != NULL)
+		map->elfree(item);
+}
+
+// _placehold stores tmp, the placeholder of key, with the map locked. It
+// replaces an expired item, but on a concurrent map not an item or a
+// placeholder that another thread stored since key was looked up. Returns 1
+// when the placeholder was stored, 0 when another thread got there first and
+// -1 when out of memory.
+static int _placehold(ttlmap *map, const void *key, const void *tmp)
+{
+	void *item;
+	bool found;
+	if (map->cmap != NULL) {
+		if (chashmap_set_if(map->cmap, tmp, _expired, map))
+			return 1;
+		return chashmap_oom(map->cmap) ? -1 : 0;
+	}
+	item = _hupsert(map, key, &found);
+	if (item == NULL)
+		return -1;
+	if (found)
+		_release(map, item);
+	memcpy(item, tmp, map->itemsz);
+	return 1;
+}
+
+// _endload ends the load of key with the map locked. The loaded item in tmp,
+// or NULL when the load failed, replaces the placeholder, unless an item was
+// set in the meantime, which is kept. Returns the item of key and sets
+// *stored when it is the loaded one.
+static void *_endload(ttlmap *map, const void *key, void *tmp,
+		      uint64_t deadline, bool *stored, int *commit)
+{
+	void *item;
+	bool loading, found;
+	*stored = false;
+	item = _lookup(map, key, &loading);
+	if (item != NULL)
+		return item;
+	if (tmp == NULL) {
+		if (loading && map->cmap != NULL)
+			chashmap_delete_if(map->cmap, key, _isloading, map);
+		else if (loading)
+			_hdelete(map, (void*)key);
+		return NULL;
+	}
+	if (map->cmap != NULL) {
+		// an item set since the lookup is live and stays
+		TTLMAP_META(map, tmp)->deadline = deadline;
+		if (chashmap_set_if(map->cmap, tmp, _notlive, map)) {
+			TTLMAP_STAT_INC_ATOMIC(map, sets);
+			*stored = true;
+		} else if (chashmap_oom(map->cmap)) {
+			chashmap_delete_if(map->cmap, key, _isloading, map);
+			return NULL;
+		}
+		chashmap_enter();
+		item = chashmap_get(map->cmap, key);
+		chashmap_leave();
+		return item;
+	}
+	item = _hupsert(map, key, &found);
+	if (item == NULL) {
+		if (loading)
+			_hdelete(map, (void*)key);
+		return NULL;
+	}
+	if (found && !loading)
+		_release(map, item);
+	memcpy(item, tmp, map->elsize);
+	memset((char*)item + map->elsize, 0, map->metaoff - map->elsize);
+	TTLMAP_META(map, item)->deadline = deadline;
+	TTLMAP_STAT_INC(map, sets);
+	*commit = TTLMAP_LOG(map, TTLMAP_LOG_SET, item, deadline);
+	*stored = true;
+	return item;
+}
+
+// _waitload sleeps until a load of key may have ended. A locked map is waited
+// on under its lock. A concurrent map is not locked, so key is looked up again
+// under hlock, which _wakeload takes after the load ended, and no wakeup is
+// missed. Returns false on a map without a lock, where the load can only be
+// the caller's own.
+static bool _waitload(ttlmap *map, const void *key)
+{
+	bool loading;
+	if (map->cmap == NULL) {
+		if (!map->safe)
+			return false;
+		pthread_cond_wait(&map->loaded, &map->hlock);
+		return true;
+	}
+	pthread_mutex_lock(&map->hlock);
+	if (_lookup(map, key, &loading) == NULL && loading)
+		pthread_cond_wait(&map->loaded, &map->hlock);
+	pthread_mutex_unlock(&map->hlock);
+	return true;
+}
+
+// _wakeload wakes the callers waiting for a load, with a locked map still
+// locked.
+static void _wakeload(ttlmap *map)
+{
+	if (map->cmap != NULL) {
+		pthread_mutex_lock(&map->hlock);
+		pthread_cond_broadcast(&map->loaded);
+		pthread_mutex_unlock(&map->hlock);
+	} else if (map->safe) {
+		pthread_cond_broadcast(&map->loaded);
+	}
+}
+
+// ttlmap_get_or_load returns the item of key like ttlmap_get. When there is
+// none, loader is called to fill one in, which is then inserted with ttl_ms.
+// Only one caller per key runs the loader. It leaves a placeholder for the
+// key in the map, and the callers that find it wait for the load to end and
+// return its result instead of loading the key again, so a hot key that
+// expires is loaded once rather than by every thread that misses it.
+// The loader gets the key, an item that holds the key followed by zeroes
+// and udata, and returns false when the key could not be loaded, in which
+// case all waiting callers get NULL. The loaded item is inserted before the
+// waiters are woken. An item set while the load runs is
+// kept and returned instead. Placeholders are hidden from ttlmap_get, but are
+// counted by ttlmap_count and visited by scans, with zeroes after the key.
+// On a map made thread-unsafe, a loader that asks for its own key gets NULL.
+// Returns NULL when the load failed or the system is out of memory.
+void *ttlmap_get_or_load(ttlmap *map, const void *key,
+			 bool (*loader)(const void *key, void *item, void *udata),
+			 void *udata, int ttl_ms)
+{
+	char buf[256];
+	char *tmp = NULL;
+	void *item;
+	bool loading, waited = false, stored;
+	uint64_t deadline = 0;
+	int commit = 0, placed = 0;
+
+	TTLMAP_LOCK(map);
+	for (;;) {
+		item = _lookup(map, key, &loading);
+		if (item != NULL || (!loading && waited))
+			break;
+		if (!loading) {
+			if (tmp == NULL) {
+				tmp = map->itemsz <= sizeof(buf) ? buf : malloc(map->itemsz);
+				if (tmp == NULL)
+					break;
+				memcpy(tmp, key, map->keysize);
+				memset(tmp + map->keysize, 0, map->itemsz - map->keysize);
+				TTLMAP_META(map, tmp)->deadline = TTLMAP_LOADING;
+			}
+			// on a concurrent map another thread may have stored
+			// the key since, then look again
+			placed = _placehold(map, key, tmp);
+			if (placed != 0)
+				break;
+			continue;
+		}
+		if (!waited)
+			TTLMAP_STAT_INC_ATOMIC(map, loadwaits);
+		waited = true;
+		if (!_waitload(map, key))
+			break;
+	}
+	if (placed <= 0) {
+		TTLMAP_UNLOCK(map);
+		if (tmp != buf)
+			free(tmp);
+		return item;
+	}
+	TTLMAP_STAT_INC_ATOMIC(map, loads);
+	TTLMAP_UNLOCK(map);
+
+	bool ok = loader(key, tmp, udata);
+	if (ttl_ms > 0)
+		deadline = tw_now_ms(map->tw) + ttl_ms;
+	TTLMAP_LOCK(map);
+	item = _endload(map, key, ok ? tmp : NULL, deadline, &stored, &commit);
+	_wakeload(map);
+	TTLMAP_UNLOCK(map);
+	if (tmp != buf)
+		free(tmp);
+	if (commit)
+		ttlmap_log_flush(map);
+	if (stored && deadline != 0)
+		_settimer(map, key, ttl_ms, deadline);
+	return item;
+}
+
 void *ttlmap_delete(ttlmap *map, void *item)
 {
 	void *ret;
+	int commit = 0;
+	if (map->cmap != NULL) {
+		TTLMAP_STAT_INC_ATOMIC(map, deletes);
+		return chashmap_delete(map->cmap, item);
+	}
 	TTLMAP_LOCK(map);
-	ret = hashmap_delete(map->hmap, item);
+	ret = _hdelete(map, item);
+	TTLMAP_STAT_INC(map, deletes);
+	if (ret != NULL)
+		commit = TTLMAP_LOG(map, TTLMAP_LOG_DELETE, item, 0);
 	TTLMAP_UNLOCK(map);
+	if (commit)
+		ttlmap_log_flush(map);
 	return ret;
 }
 
+// ttlmap_log_open attaches a change log to the map. Every set, delete, clear
+// and expiry is appended to `fd` as a fixed-size binary record, in the order
+// the operations were applied. Records are buffered in memory and written in
+// batches with writev. A batch is committed once `commit_ms` elapsed since the
+// last one (0 to only commit when the buffers fill up), and is followed by
+// fdatasync when `sync` is non-zero. Call ttlmap_log_flush to commit from an
+// idle loop, as commits are otherwise only driven by map operations.
+// Returns 0 on success or -1 with errno set.
+int ttlmap_log_open(ttlmap *map, int fd, unsigned int commit_ms, int sync)
+{
+	struct ttlmap_log *log;
+	pthread_mutex_t init_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+	if (map->log != NULL) {
+		errno = EBUSY;
+		return -1;
+	}
+	if (map->cmap != NULL) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	log = calloc(1, sizeof(struct ttlmap_log));
+	if (log == NULL)
+		return -1;
+	log->fd = fd;
+	log->sync = sync;
+	log->commit_ms = commit_ms;
+	log->last_commit = _now_ms(CLOCK_MONOTONIC_COARSE);
+	log->realoff = (int64_t)_now_ms(CLOCK_REALTIME) - (int64_t)tw_now_ms(map->tw);
+	log->recsz = sizeof(struct ttlmap_logrec) + map->elsize;
+	memcpy(&log->lock, &init_mutex, sizeof(init_mutex));
+	memcpy(&log->iolock, &init_mutex, sizeof(init_mutex));
+	log->fulltail = &log->full;
+	TTLMAP_LOCK(map);
+	map->log = log;
+	TTLMAP_UNLOCK(map);
+	return 0;
+}
+
+static int _writevall(int fd, struct iovec *iov, int iovcnt)
+{
+	ssize_t n;
+	while (iovcnt > 0) {
+		n = writev(fd, iov, iovcnt);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char*)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return 0;
+}
+
+// ttlmap_log_flush commits all buffered records to the log.
+// Returns 0 on success or -1 with errno set if a write failed. A failed log
+// keeps failing until it is closed.
+int ttlmap_log_flush(ttlmap *map)
+{
+	struct ttlmap_log *log = map->log;
+	struct _logbuf *list, *buf, *next;
+	struct iovec iov[TTLMAP_LOG_MAXFULL + 1];
+	int n, ret = 0;
+
+	if (log == NULL)
+		return 0;
+	pthread_mutex_lock(&log->iolock);
+	pthread_mutex_lock(&log->lock);
+	if (log->cur != NULL && log->cur->len > 0) {
+		*log->fulltail = log->cur;
+		log->cur = NULL;
+	}
+	list = log->full;
+	log->full = NULL;
+	log->fulltail = &log->full;
+	log->nfull = 0;
+	log->last_commit = _now_ms(CLOCK_MONOTONIC_COARSE);
+	pthread_mutex_unlock(&log->lock);
+
+	while (list != NULL && log->err == 0) {
+		for (n = 0, buf = list; buf != NULL && n < TTLMAP_LOG_MAXFULL + 1; buf = buf->next, n++) {
+			iov[n].iov_base = buf->data;
+			iov[n].iov_len = buf->len;
+		}
+		if (_writevall(log->fd, iov, n) < 0)
+			log->err = errno;
+		while (n-- > 0) {
+			next = list->next;
+			pthread_mutex_lock(&log->lock);
+			list->next = log->freelist;
+			log->freelist = list;
+			pthread_mutex_unlock(&log->lock);
+			list = next;
+		}
+	}
+	while (list != NULL) {
+		next = list->next;
+		free(list);
+		list = next;
+	}
+	if (log->err == 0 && log->sync && fdatasync(log->fd) < 0)
+		log->err = errno;
+	if (log->err != 0) {
+		errno = log->err;
+		ret = -1;
+	}
+	pthread_mutex_unlock(&log->iolock);
+	return ret;
+}
+
+// ttlmap_log_close commits the remaining records and detaches the log. The
+// file descriptor is left open.
+int ttlmap_log_close(ttlmap *map)
+{
+	struct ttlmap_log *log = map->log;
+	struct _logbuf *buf;
+	int ret;
+
+	if (log == NULL)
+		return 0;
+	ret = ttlmap_log_flush(map);
+	TTLMAP_LOCK(map);
+	map->log = NULL;
+	TTLMAP_UNLOCK(map);
+	free(log->cur);
+	while ((buf = log->freelist) != NULL) {
+		log->freelist = buf->next;
+		free(buf);
+	}
+	pthread_mutex_destroy(&log->lock);
+	pthread_mutex_destroy(&log->iolock);
+	free(log);
+	return ret;
+}
+
+// ttlmap_replay applies the records of a change log read from `fd` to the
+// map. Records up to the map's current sequence number, which ttlmap_load
+// restores from the snapshot, are skipped, so a map can be rebuilt from the
+// last snapshot plus the log. Items whose ttl ran out in the meantime are not
+// restored. A truncated record at the end of the log is ignored, a record
+// whose length does not fit its operation fails with EINVAL.
+// Returns the number of applied records, or -1 with errno set.
+long ttlmap_replay(ttlmap *map, int fd)
+{
+	struct ttlmap_logrec rec;
+	size_t recsz = sizeof(rec) + map->elsize;
+	size_t bufsz = recsz * 1024, len = 0, off;
+	char *buf = malloc(bufsz);
+	int64_t mono_real;
+	uint64_t now, deadline;
+	long applied = 0;
+	ssize_t n;
+
+	if (buf == NULL)
+		return -1;
+	now = tw_now_ms(map->tw);
+	mono_real = (int64_t)now - (int64_t)_now_ms(CLOCK_REALTIME);
+	for (;;) {
+		n = read(fd, buf + len, bufsz - len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			free(buf);
+			return -1;
+		}
+		if (n == 0)
+			break;
+		len += n;
+		for (off = 0; len - off >= recsz; off += recsz) {
+			memcpy(&rec, buf + off, sizeof(rec));
+			if (rec.len != _reclen(map, rec.op)) {
+				free(buf);
+				errno = EINVAL;
+				return -1;
+			}
+			if (rec.lsn <= map->lsn)
+				continue;
+			const char *item = buf + off + sizeof(rec);
+			switch (rec.op) {
+			case TTLMAP_LOG_SET:
+				deadline = rec.deadline ? rec.deadline + mono_real : 0;
+				if (deadline == 0)
+					_ttlmap_set(map, item, 0, 0);
+				else if (deadline > now)
+					_ttlmap_set(map, item, deadline - now, deadline);
+				else
+					ttlmap_delete(map, (void*)item);
+				break;
+			case TTLMAP_LOG_DELETE:
+			case TTLMAP_LOG_EXPIRE:
+				ttlmap_delete(map, (void*)item);
+				break;
+			case TTLMAP_LOG_CLEAR:
+				ttlmap_clear(map, true);
+				break;
+			}
+			TTLMAP_LOCK(map);
+			if (rec.lsn > map->lsn)
+				map->lsn = rec.lsn;
+			TTLMAP_UNLOCK(map);
+			applied++;
+		}
+		memmove(buf, buf + off, len - off);
+		len -= off;
+	}
+	free(buf);
+	return applied;
+}
+
 
 void *ttlmap_probe(ttlmap *map, uint64_t position)
 {
 	void *ret;
+	if (map->cmap != NULL)
+		return chashmap_probe(map->cmap, position);
 	TTLMAP_LOCK(map);
-	ret = hashmap_probe(map->hmap, position);
+	if (map->smap != NULL)
+		ret = shashmap_probe(map->smap, position);
+	else
+		ret = hashmap_probe(map->hmap, position);
 	TTLMAP_UNLOCK(map);
 	return ret;
 }
@@ -240,8 +1321,62 @@ bool ttlmap_scan(ttlmap *map,
                   bool (*iter)(const void *item, void *udata), void *udata)
 {
 	bool ret;
+	if (map->cmap != NULL)
+		return chashmap_scan(map->cmap, iter, udata);
+	TTLMAP_LOCK(map);
+	if (map->smap != NULL)
+		ret = shashmap_scan(map->smap, iter, udata);
+	else
+		ret = hashmap_scan(map->hmap, iter, udata);
+	TTLMAP_UNLOCK(map);
+	return ret;
+}
+
+
+// ttlmap_scan_cursor visits the items of at most count buckets, starting at
+// *cursor, under one lock hold and stores the cursor to continue from. Start
+// with a cursor of 0 and call it while it returns 1; it returns 0 once the
+// scan is complete. Unlike ttlmap_iter, the map may be changed and resized in
+// between: every item that stays in the map for the whole scan is visited at
+// least once. If iter returns false the scan stops and -1 is returned. The
+// cursor is left at the bucket it stopped in, and passing it again resumes
+// the scan there.
+int ttlmap_scan_cursor(ttlmap *map, size_t *cursor, size_t count,
+		       bool (*iter)(const void *item, void *udata), void *udata)
+{
+	int ret;
+	if (map->cmap != NULL)
+		return chashmap_scan_cursor(map->cmap, cursor, count, iter, udata);
 	TTLMAP_LOCK(map);
-	ret = hashmap_scan(map->hmap, iter, udata);
+	if (map->smap != NULL)
+		ret = shashmap_scan_cursor(map->smap, cursor, count, iter, udata);
+	else
+		ret = hashmap_scan_cursor(map->hmap, cursor, count, iter, udata);
+	TTLMAP_UNLOCK(map);
+	return ret;
+}
+
+
+// ttlmap_scan_parallel runs iter over all items with nthreads threads, the
+// caller and nthreads-1 helpers, each over its own range of buckets and with
+// its own entry of the udata array. reduce, if not NULL, then folds
+// udata[1..nthreads-1] into udata[0]. The map is locked once for the whole
+// scan, so items do not change or expire while they are visited.
+bool ttlmap_scan_parallel(ttlmap *map, int nthreads,
+			  bool (*iter)(const void *item, void *udata),
+			  void **udata, void (*reduce)(void *into, void *from))
+{
+	bool ret;
+	if (map->cmap != NULL)
+		return chashmap_scan_parallel(map->cmap, nthreads, iter, udata,
+					      reduce);
+	TTLMAP_LOCK(map);
+	if (map->smap != NULL)
+		ret = shashmap_scan_parallel(map->smap, nthreads, iter, udata,
+					     reduce);
+	else
+		ret = hashmap_scan_parallel(map->hmap, nthreads, iter, udata,
+					    reduce);
 	TTLMAP_UNLOCK(map);
 	return ret;
 }
@@ -250,12 +1385,383 @@ bool ttlmap_scan(ttlmap *map,
 bool ttlmap_iter(ttlmap *map, size_t *i, void **item)
 {
 	bool ret;
+	if (map->cmap != NULL)
+		return chashmap_iter(map->cmap, i, item);
 	TTLMAP_LOCK(map);
-	ret = hashmap_iter(map->hmap, i, item);
+	if (map->smap != NULL)
+		ret = shashmap_iter(map->smap, i, item);
+	else
+		ret = hashmap_iter(map->hmap, i, item);
 	TTLMAP_UNLOCK(map);
 	return ret;
 }
 
+// ttlmap_stats copies the statistics of the map and of its hashmap into
+// stats. Wheel statistics, such as expirations per tick and timer lag, are
+// returned by tw_stats on map->tw. Returns -1, leaving stats zeroed, unless
+// compiled with -DTTLMAP_STATS.
+int ttlmap_stats(ttlmap *map, struct ttlmap_stats *stats)
+{
+#ifdef TTLMAP_STATS
+	TTLMAP_LOCK(map);
+	memcpy(stats, &map->stats, sizeof(*stats));
+	if (map->cmap != NULL)
+		chashmap_stats(map->cmap, &stats->hmap);
+	else if (map->smap != NULL)
+		shashmap_stats(map->smap, &stats->hmap);
+	else
+		hashmap_stats(map->hmap, &stats->hmap);
+	TTLMAP_UNLOCK(map);
+	return 0;
+#else
+	(void)map;
+	memset(stats, 0, sizeof(*stats));
+	return -1;
+#endif
+}
+
+// On-disk format written by ttlmap_save. The header is padded to a page so
+// the bucket array that follows can be mapped directly. Deadlines are stored
+// as they are in memory and rebased with the clocks recorded in the header.
+#define TTLMAP_FILE_MAGIC	"TTLMAP\0\1"
+#define TTLMAP_FILE_VERSION	2
+#define TTLMAP_FILE_HDRSZ	4096
+
+struct ttlmap_filehdr {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	hdrsz;
+	uint64_t	elsize;
+	uint64_t	itemsz;
+	uint64_t	bucketsz;
+	uint64_t	nbuckets;
+	uint64_t	count;
+	uint64_t	seed0;
+	uint64_t	seed1;
+	uint64_t	mono_ms;
+	uint64_t	real_ms;
+	uint64_t	lsn;
+	uint64_t	keysize;
+};
+
+static int _writeall(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t n;
+	while (len > 0) {
+		n = write(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+// _writehdr writes the header padded to TTLMAP_FILE_HDRSZ, without seeking
+// so that snapshots can also be streamed to pipes and sockets.
+static int _writehdr(int fd, const struct ttlmap_filehdr *hdr)
+{
+	char page[TTLMAP_FILE_HDRSZ];
+	memset(page, 0, sizeof(page));
+	memcpy(page, hdr, sizeof(*hdr));
+	return _writeall(fd, page, sizeof(page));
+}
+
+static void _fillhdr(ttlmap *map, struct ttlmap_filehdr *hdr, size_t nbuckets, size_t bucketsz,
+			size_t count)
+{
+	memset(hdr, 0, sizeof(*hdr));
+	memcpy(hdr->magic, TTLMAP_FILE_MAGIC, sizeof(hdr->magic));
+	hdr->version = TTLMAP_FILE_VERSION;
+	hdr->hdrsz = TTLMAP_FILE_HDRSZ;
+	hdr->elsize = map->elsize;
+	hdr->itemsz = map->itemsz;
+	hdr->bucketsz = bucketsz;
+	hdr->nbuckets = nbuckets;
+	hdr->count = count;
+	hdr->seed0 = map->seed0;
+	hdr->seed1 = map->seed1;
+	hdr->mono_ms = tw_now_ms(map->tw);
+	hdr->real_ms = _now_ms(CLOCK_REALTIME);
+	hdr->lsn = map->lsn;
+	hdr->keysize = map->keysize;
+}
+
+// ttlmap_save writes the map to `path`. The items must not reference other
+// memory, as only the raw bytes are saved. The file is written to a temporary
+// name and renamed into place, so `path` always holds a complete snapshot.
+// Returns 0 on success or -1 with errno set.
+int ttlmap_save(ttlmap *map, const char *path)
+{
+	struct ttlmap_filehdr hdr;
+	const void *buckets;
+	size_t nbuckets, bucketsz;
+	size_t pathlen = strlen(path);
+	char *tmppath;
+	int fd, ret = 0, err;
+
+	if (map->hmap == NULL) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	tmppath = malloc(pathlen + 5);
+	if (tmppath == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	memcpy(tmppath, path, pathlen);
+	memcpy(tmppath + pathlen, ".tmp", 5);
+	fd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		free(tmppath);
+		return -1;
+	}
+
+	TTLMAP_LOCK(map);
+	buckets = hashmap_buckets(map->hmap, &nbuckets, &bucketsz);
+	_fillhdr(map, &hdr, nbuckets, bucketsz, hashmap_count(map->hmap));
+	if (_writehdr(fd, &hdr) < 0 ||
+	    _writeall(fd, buckets, nbuckets * bucketsz) < 0)
+		ret = -1;
+	TTLMAP_UNLOCK(map);
+
+	if (ret == 0 && fsync(fd) < 0)
+		ret = -1;
+	err = errno;
+	close(fd);
+	if (ret == 0 && rename(tmppath, path) < 0) {
+		err = errno;
+		ret = -1;
+	}
+	if (ret < 0)
+		unlink(tmppath);
+	free(tmppath);
+	errno = err;
+	return ret;
+}
+
+struct ttlmap_snap {
+	int	fd;
+	size_t	bucketsz;
+	size_t	bufcap;
+	char	buf[];
+};
+
+// number of buckets copied per step when the caller passes 0
+#define TTLMAP_SNAP_STEP	1024
+
+// ttlmap_snapshot_begin starts streaming a point-in-time image of the map to
+// `fd` in the format of ttlmap_save, so the result can be read back with
+// ttlmap_load. Unlike ttlmap_save, the map is not locked while the image is
+// written. The buckets are copied in bounded steps by ttlmap_snapshot_step,
+// and writes in between only pay for copying the chunks they touch before the
+// snapshot gets to them.
+// Returns 0 on success or -1 with errno set.
+int ttlmap_snapshot_begin(ttlmap *map, int fd)
+{
+	struct ttlmap_filehdr hdr;
+	struct ttlmap_snap *snap;
+	size_t nbuckets, bucketsz, count;
+	bool ok;
+
+	if (map->snap != NULL) {
+		errno = EBUSY;
+		return -1;
+	}
+	if (map->hmap == NULL) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	TTLMAP_LOCK(map);
+	ok = hashmap_snapshot_begin(map->hmap, &nbuckets, &bucketsz, &count);
+	if (ok)
+		_fillhdr(map, &hdr, nbuckets, bucketsz, count);
+	TTLMAP_UNLOCK(map);
+	if (!ok) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	snap = malloc(sizeof(struct ttlmap_snap) + TTLMAP_SNAP_STEP * bucketsz);
+	if (snap == NULL || _writehdr(fd, &hdr) < 0) {
+		int err = snap ? errno : ENOMEM;
+		free(snap);
+		TTLMAP_LOCK(map);
+		hashmap_snapshot_end(map->hmap);
+		TTLMAP_UNLOCK(map);
+		errno = err;
+		return -1;
+	}
+	snap->fd = fd;
+	snap->bucketsz = bucketsz;
+	snap->bufcap = TTLMAP_SNAP_STEP;
+	map->snap = snap;
+	return 0;
+}
+
+static void _snapshot_end(ttlmap *map)
+{
+	TTLMAP_LOCK(map);
+	hashmap_snapshot_end(map->hmap);
+	TTLMAP_UNLOCK(map);
+	free(map->snap);
+	map->snap = NULL;
+}
+
+// ttlmap_snapshot_step copies up to `nbuckets` buckets of the open snapshot
+// under the map lock and writes them to the snapshot's fd after releasing it.
+// Call it between normal operations, or from a background thread, until it
+// returns 0. Only one thread may drive a snapshot.
+// Returns 1 while there is more to write, 0 once the snapshot is complete,
+// or -1 with errno set if it failed. The snapshot is closed in the last two
+// cases.
+int ttlmap_snapshot_step(ttlmap *map, size_t nbuckets)
+{
+	struct ttlmap_snap *snap = map->snap;
+	size_t n;
+	bool ok;
+
+	if (snap == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	n = nbuckets == 0 || nbuckets > snap->bufcap ? snap->bufcap : nbuckets;
+	TTLMAP_LOCK(map);
+	ok = hashmap_snapshot_next(map->hmap, snap->buf, &n);
+	TTLMAP_UNLOCK(map);
+	if (!ok) {
+		_snapshot_end(map);
+		errno = ENOMEM;
+		return -1;
+	}
+	if (n == 0) {
+		_snapshot_end(map);
+		return 0;
+	}
+	if (_writeall(snap->fd, snap->buf, n * snap->bucketsz) < 0) {
+		int err = errno;
+		_snapshot_end(map);
+		errno = err;
+		return -1;
+	}
+	return 1;
+}
+
+// ttlmap_snapshot_abort closes the open snapshot without finishing it.
+void ttlmap_snapshot_abort(ttlmap *map)
+{
+	if (map->snap != NULL)
+		_snapshot_end(map);
+}
+
+struct _loadarg {
+	ttlmap *map;
+	uint64_t now;
+	int64_t shift;
+};
+
+static bool _loaditem(void *item, void *udata)
+{
+	struct _loadarg *larg = udata;
+	struct ttlmeta *meta = TTLMAP_META(larg->map, item);
+	if (meta->deadline == 0)
+		return true;
+	// the load of a placeholder ended with the process that saved it
+	if (meta->deadline == TTLMAP_LOADING)
+		return false;
+	int64_t deadline = (int64_t)meta->deadline + larg->shift;
+	if (deadline <= (int64_t)larg->now)
+		return false;
+	meta->deadline = deadline;
+	_settimer(larg->map, item, deadline - larg->now, deadline);
+	return true;
+}
+
+// ttlmap_load creates a thread-safe map from a file written by ttlmap_save.
+// The hash and compare functions must be the ones the saved map was using.
+// The bucket array is loaded as-is without rehashing, and items whose ttl
+// ran out while the map was on disk are dropped. The key size set with
+// ttlmap_setkeysize is restored from the file.
+// Returns NULL with errno set on failure.
+ttlmap *ttlmap_load(const char *path,
+                            uint64_t (*hash)(const void *item, 
+                                             uint64_t seed0, uint64_t seed1),
+                            int (*compare)(const void *a, const void *b, 
+                                           void *udata),
+                            void (*elfree)(void *item),
+                            void *udata, 
+			    timewheel_t *twptr)
+{
+	struct ttlmap_filehdr hdr;
+	struct stat st;
+	struct _loadarg larg;
+	ttlmap *map;
+	void *base;
+	size_t len;
+	ssize_t n;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0 || (n = pread(fd, &hdr, sizeof(hdr), 0)) < 0)
+		goto fail;
+	if ((size_t)n != sizeof(hdr)) {
+		errno = EINVAL;
+		goto fail;
+	}
+	if (memcmp(hdr.magic, TTLMAP_FILE_MAGIC, sizeof(hdr.magic)) != 0 ||
+	    hdr.version != TTLMAP_FILE_VERSION ||
+	    hdr.hdrsz != TTLMAP_FILE_HDRSZ ||
+	    hdr.nbuckets == 0 || hdr.bucketsz == 0 ||
+	    hdr.keysize == 0 || hdr.keysize > hdr.elsize ||
+	    // the sizes come from the file, keep the product from overflowing
+	    hdr.nbuckets > (SIZE_MAX - hdr.hdrsz) / hdr.bucketsz ||
+	    (uint64_t)st.st_size < hdr.hdrsz + hdr.nbuckets * hdr.bucketsz) {
+		errno = EINVAL;
+		goto fail;
+	}
+
+	len = hdr.hdrsz + hdr.nbuckets * hdr.bucketsz;
+	base = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (base == MAP_FAILED)
+		goto fail;
+	madvise(base, len, MADV_SEQUENTIAL);
+
+	map = _ttlmap_new(hdr.elsize, 0, hdr.seed0, hdr.seed1, hash, compare, elfree, udata, twptr, 1);
+	if (map == NULL) {
+		munmap(base, len);
+		errno = ENOMEM;
+		goto fail;
+	}
+	if (map->itemsz != hdr.itemsz ||
+	    !hashmap_load(map->hmap, (char*)base + hdr.hdrsz, hdr.nbuckets, hdr.bucketsz)) {
+		munmap(base, len);
+		ttlmap_free(map);
+		errno = EINVAL;
+		goto fail;
+	}
+	munmap(base, len);
+	close(fd);
+	map->lsn = hdr.lsn;
+	// the expiry timers armed below copy keysize bytes of each item
+	map->keysize = hdr.keysize;
+
+	// rebase the deadlines onto this boot's monotonic clock
+	larg.map = map;
+	larg.now = tw_now_ms(map->tw);
+	larg.shift = (int64_t)(larg.now - hdr.mono_ms) - (int64_t)(_now_ms(CLOCK_REALTIME) - hdr.real_ms);
+	hashmap_filter(map->hmap, _loaditem, &larg);
+	return map;
+fail:
+	close(fd);
+	return NULL;
+}
+
 uint64_t ttlmap_sip(const void *data, size_t len, 
                      uint64_t seed0, uint64_t seed1)
 {
@@ -5,14 +5,42 @@
 #include "hashmap.h"
 #include "timewheel.h"
 
+// Statistics are only collected when compiled with -DTTLMAP_STATS.
+struct ttlmap_stats {
+	uint64_t	sets;
+	uint64_t	deletes;
+	uint64_t	expired;	// items removed by their ttl
+	uint64_t	loads;		// loader calls by ttlmap_get_or_load
+	uint64_t	loadwaits;	// callers that waited for another's load
+	uint64_t	unarmed;	// ttls without a timer, out of memory
+	struct hashmap_stats hmap;
+};
+
 typedef struct ttlmap {
 	struct hashmap	*hmap;
+	struct chashmap	*cmap;		// concurrent engine, see ttlmap_new_concurrent
+	struct shashmap	*smap;		// segmented engine, see ttlmap_new_segmented
 	size_t		elsize;
+	size_t		keysize;	// leading bytes of an item that form its key
+	size_t		itemsz;
+	size_t		metaoff;
+	void		*scratch;
+	uint64_t	seed0;
+	uint64_t	seed1;
+	void		(*elfree)(void *item);	// for items a load displaces
+	struct ttlmap_snap *snap;
+	struct ttlmap_log *log;
+	uint64_t	lsn;
+	struct ttlmap_stats stats;
 
         int             safe;
 	pthread_mutex_t	hlock;
+	pthread_cond_t	loaded;		// broadcast when a load ends, see ttlmap_get_or_load
 
 	timewheel_t	*tw;
+	timewheel_t	**wheels;	// per-cpu expiry wheels, see ttlmap_setwheels
+	int		nwheels;
+	unsigned int	slack;		// percent of the ttl expiry may run late
 } ttlmap;
 
 ttlmap *ttlmap_new(size_t elsize, size_t cap, 
@@ -63,17 +91,71 @@ struct ttlmap *ttlmap_new_with_allocator_threadunsafe(
                             void *udata, 
 			    timewheel_t *twptr);
 
+ttlmap *ttlmap_new_concurrent(size_t elsize, size_t cap, 
+                            uint64_t seed0, uint64_t seed1,
+                            uint64_t (*hash)(const void *item, 
+                                             uint64_t seed0, uint64_t seed1),
+                            int (*compare)(const void *a, const void *b, 
+                                           void *udata),
+                            void (*elfree)(void *item),
+                            void *udata, 
+			    timewheel_t *twptr);
+
+ttlmap *ttlmap_new_segmented(size_t elsize, size_t cap, 
+                            uint64_t seed0, uint64_t seed1,
+                            uint64_t (*hash)(const void *item, 
+                                             uint64_t seed0, uint64_t seed1),
+                            int (*compare)(const void *a, const void *b, 
+                                           void *udata),
+                            void (*elfree)(void *item),
+                            void *udata, 
+			    timewheel_t *twptr);
+
 void ttlmap_free(ttlmap *map);
+void ttlmap_enter(ttlmap *map);
+void ttlmap_leave(ttlmap *map);
+int ttlmap_setwheels(ttlmap *map, timewheel_t **wheels, int n);
+void ttlmap_setslack(ttlmap *map, unsigned int percent);
+void ttlmap_setresizers(ttlmap *map, int nthreads);
+int ttlmap_setkeysize(ttlmap *map, size_t keysize);
 void ttlmap_clear(ttlmap *map, bool update_cap);
 size_t ttlmap_count(ttlmap *map);
 bool ttlmap_oom(ttlmap *map);
 void *ttlmap_get(ttlmap *map, const void *item);
 void *ttlmap_set(ttlmap *map, const void *item, int ttl_ms);
+void *ttlmap_setkv(ttlmap *map, const void *key, const void *value, int ttl_ms);
+void *ttlmap_get_or_load(ttlmap *map, const void *key,
+                  bool (*loader)(const void *key, void *item, void *udata),
+                  void *udata, int ttl_ms);
 void *ttlmap_delete(ttlmap *map, void *item);
 void *ttlmap_probe(ttlmap *map, uint64_t position);
 bool ttlmap_scan(ttlmap *map,
                   bool (*iter)(const void *item, void *udata), void *udata);
 bool ttlmap_iter(ttlmap *map, size_t *i, void **item);
+int ttlmap_scan_cursor(ttlmap *map, size_t *cursor, size_t count,
+                  bool (*iter)(const void *item, void *udata), void *udata);
+bool ttlmap_scan_parallel(ttlmap *map, int nthreads,
+                  bool (*iter)(const void *item, void *udata),
+                  void **udata, void (*reduce)(void *into, void *from));
+
+int ttlmap_stats(ttlmap *map, struct ttlmap_stats *stats);
+
+int ttlmap_save(ttlmap *map, const char *path);
+int ttlmap_snapshot_begin(ttlmap *map, int fd);
+int ttlmap_snapshot_step(ttlmap *map, size_t nbuckets);
+void ttlmap_snapshot_abort(ttlmap *map);
+int ttlmap_log_open(ttlmap *map, int fd, unsigned int commit_ms, int sync);
+int ttlmap_log_flush(ttlmap *map);
+int ttlmap_log_close(ttlmap *map);
+long ttlmap_replay(ttlmap *map, int fd);
+ttlmap *ttlmap_load(const char *path,
+                            uint64_t (*hash)(const void *item, 
+                                             uint64_t seed0, uint64_t seed1),
+                            int (*compare)(const void *a, const void *b, 
+                                           void *udata),
+                            void (*elfree)(void *item),
+                            void *udata, 
+			    timewheel_t *twptr);
 
 uint64_t ttlmap_sip(const void *data, size_t len, 
                      uint64_t seed0, uint64_t seed1);
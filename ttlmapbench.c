@@ -0,0 +1,737 @@
+// Benchmarks for ttlmap and timewheel.
+//
+// make:
+// gcc -O2 ttlmapbench.c ttlmap.c timewheel.c hashmap.c -lpthread -lm -o ttlmapbench
+//
+// run:
+// ./ttlmapbench [workload...]
+//
+// workloads (all of them when none is given):
+//   mixed     threads doing gets and sets at a read ratio
+//   scale     mixed on both engines with 1 to 64 threads
+//   churn     threads setting keys with short random ttls
+//   expiry    get latency while a mass expiry is being reaped
+//   resize    set latency while the table keeps growing
+//   pscan     ttlmap_scan_parallel aggregation with 1 to THREADS threads
+//   herd      backend loads of expiring hot keys, get and set or get_or_load
+//   timer     tw_addtask throughput from all threads
+//   reset     tw_resettask keepalive throughput on pending timers
+//   lateness  how late timers fire compared to their deadline
+//
+// environment:
+//   N=1000000       keys in the key space
+//   THREADS=4       worker threads
+//   DURATION=2      seconds per timed workload
+//   READS=90        percentage of gets in the mixed workload
+//   DIST=uniform    key distribution, uniform or zipf
+//   THETA=0.99      zipf skew
+//   TTL=1000        ttl in ms for expiry and the upper bound for churn
+//   SEED=time       random seed
+//   FORMAT=text     text, or json for one object per workload and line
+//   WHEELS=0        per-cpu expiry wheels (ttlmap_setwheels), 0 for one
+//   SLACK=0         percent of the ttl expiry may run late (ttlmap_setslack)
+//   ENGINE=mutex    mutex, concurrent (ttlmap_new_concurrent) or segmented
+//   RESIZERS=0      threads that grow the table (ttlmap_setresizers)
+//
+// Every operation's latency is sampled with a 1 in 16 probability and the
+// percentiles are computed from the samples.
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "ttlmap.h"
+
+struct kv {
+	uint64_t	key;
+	uint64_t	val;
+};
+
+static int kv_compare(const void *a, const void *b, void *udata)
+{
+	const struct kv *ka = a;
+	const struct kv *kb = b;
+	(void)udata;
+	return ka->key < kb->key ? -1 : ka->key > kb->key;
+}
+
+static uint64_t kv_hash(const void *item, uint64_t seed0, uint64_t seed1)
+{
+	const struct kv *kv = item;
+	return ttlmap_murmur(&kv->key, sizeof(kv->key), seed0, seed1);
+}
+
+//-----------------------------------------------------------------------------
+// configuration
+//-----------------------------------------------------------------------------
+
+static size_t N;
+static int nthreads;
+static double duration;
+static int reads;
+static int zipf;
+static double theta;
+static int ttl;
+static unsigned int seed;
+static int json;
+static int nwheels;
+static int slack;
+static int concurrent;
+static int segmented;
+static int resizers;
+static timewheel_t *wheels[256];
+
+static long envint(const char *name, long def)
+{
+	const char *v = getenv(name);
+	return v ? atol(v) : def;
+}
+
+static double envdouble(const char *name, double def)
+{
+	const char *v = getenv(name);
+	return v ? atof(v) : def;
+}
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+//-----------------------------------------------------------------------------
+// random numbers and key distributions
+//-----------------------------------------------------------------------------
+
+static uint64_t xorshift(uint64_t *s)
+{
+	uint64_t x = *s;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return *s = x;
+}
+
+static double uniform01(uint64_t *s)
+{
+	return (xorshift(s) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Zipfian generator from "Quickly Generating Billion-Record Synthetic
+// Databases", Gray et al.
+static double zeta_n, zipf_alpha, zipf_eta;
+
+static void zipf_init(size_t n, double t)
+{
+	double zeta2 = 0;
+	size_t i;
+	zeta_n = 0;
+	for (i = 1; i <= n; i++)
+		zeta_n += 1.0 / pow((double)i, t);
+	for (i = 1; i <= 2; i++)
+		zeta2 += 1.0 / pow((double)i, t);
+	zipf_alpha = 1.0 / (1.0 - t);
+	zipf_eta = (1.0 - pow(2.0 / n, 1.0 - t)) / (1.0 - zeta2 / zeta_n);
+}
+
+static uint64_t nextkey(uint64_t *s)
+{
+	if (!zipf)
+		return xorshift(s) % N;
+	double u = uniform01(s);
+	double uz = u * zeta_n;
+	if (uz < 1.0)
+		return 0;
+	if (uz < 1.0 + pow(0.5, theta))
+		return 1;
+	uint64_t k = (uint64_t)(N * pow(zipf_eta * u - zipf_eta + 1.0, zipf_alpha));
+	// scatter the hot keys over the key space
+	return (k * 0x9E3779B97F4A7C15ULL) % N;
+}
+
+//-----------------------------------------------------------------------------
+// latency samples and reporting
+//-----------------------------------------------------------------------------
+
+#define SAMPLE_MASK	15
+
+struct samples {
+	uint64_t	*v;
+	size_t		len;
+	size_t		cap;
+};
+
+static void sample_add(struct samples *s, uint64_t ns)
+{
+	if (s->len == s->cap) {
+		s->cap = s->cap ? s->cap * 2 : 4096;
+		s->v = realloc(s->v, s->cap * sizeof(uint64_t));
+	}
+	s->v[s->len++] = ns;
+}
+
+static void samples_merge(struct samples *dst, struct samples *src)
+{
+	size_t i;
+	for (i = 0; i < src->len; i++)
+		sample_add(dst, src->v[i]);
+	free(src->v);
+	memset(src, 0, sizeof(*src));
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+	return x < y ? -1 : x > y;
+}
+
+static uint64_t percentile(struct samples *s, double p)
+{
+	if (s->len == 0)
+		return 0;
+	size_t i = (size_t)(p / 100.0 * (s->len - 1) + 0.5);
+	return s->v[i];
+}
+
+// report prints one result line. Extra fields are passed as a preformatted
+// list of `"name":value` pairs, which is used as-is for json and with the
+// quotes stripped for text.
+static void report(const char *name, uint64_t ops, double secs, struct samples *s,
+		   const char *extra)
+{
+	qsort(s->v, s->len, sizeof(uint64_t), cmp_u64);
+	if (json) {
+		printf("{\"workload\":\"%s\",\"threads\":%d,\"keys\":%zu,\"dist\":\"%s\","
+		       "\"ops\":%llu,\"secs\":%.3f,\"ops_per_sec\":%.0f,"
+		       "\"p50_ns\":%llu,\"p90_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu,\"max_ns\":%llu%s%s}\n",
+		       name, nthreads, N, zipf ? "zipf" : "uniform",
+		       (unsigned long long)ops, secs, secs > 0 ? ops / secs : 0,
+		       (unsigned long long)percentile(s, 50), (unsigned long long)percentile(s, 90),
+		       (unsigned long long)percentile(s, 99), (unsigned long long)percentile(s, 99.9),
+		       (unsigned long long)percentile(s, 100), extra[0] ? "," : "", extra);
+	} else {
+		char buf[512];
+		size_t i, j = 0;
+		for (i = 0; extra[i] && j < sizeof(buf) - 1; i++) {
+			if (extra[i] == '"')
+				continue;
+			buf[j++] = extra[i] == ',' ? ' ' : extra[i] == ':' ? '=' : extra[i];
+		}
+		buf[j] = 0;
+		printf("%-9s %12llu ops in %.3f secs, %10.0f op/sec, "
+		       "p50 %llu ns, p99 %llu ns, p99.9 %llu ns, max %llu ns %s\n",
+		       name, (unsigned long long)ops, secs, secs > 0 ? ops / secs : 0,
+		       (unsigned long long)percentile(s, 50), (unsigned long long)percentile(s, 99),
+		       (unsigned long long)percentile(s, 99.9), (unsigned long long)percentile(s, 100),
+		       buf);
+	}
+	fflush(stdout);
+	free(s->v);
+	memset(s, 0, sizeof(*s));
+}
+
+//-----------------------------------------------------------------------------
+// worker threads
+//-----------------------------------------------------------------------------
+
+struct worker {
+	pthread_t	tid;
+	int		id;
+	ttlmap		*map;
+	timewheel_t	*tw;
+	uint64_t	rnd;
+	uint64_t	ops;
+	struct samples	lat;
+	volatile int	*stop;
+	void		(*op)(struct worker *w);
+};
+
+static pthread_barrier_t barrier;
+
+static void *worker_main(void *arg)
+{
+	struct worker *w = arg;
+	uint64_t start;
+	pthread_barrier_wait(&barrier);
+	while (!*w->stop) {
+		if ((xorshift(&w->rnd) & SAMPLE_MASK) == 0) {
+			start = now_ns();
+			w->op(w);
+			sample_add(&w->lat, now_ns() - start);
+		} else {
+			w->op(w);
+		}
+		w->ops++;
+	}
+	return NULL;
+}
+
+// run_workers runs op on all threads for the configured duration and merges
+// the latency samples into lat. Returns the total number of operations.
+static uint64_t run_workers(ttlmap *map, timewheel_t *tw, void (*op)(struct worker *w),
+			   struct samples *lat, double *secs)
+{
+	struct worker *ws = calloc(nthreads, sizeof(struct worker));
+	volatile int stop = 0;
+	uint64_t ops = 0, start;
+	int i;
+
+	pthread_barrier_init(&barrier, NULL, nthreads + 1);
+	for (i = 0; i < nthreads; i++) {
+		ws[i].id = i;
+		ws[i].map = map;
+		ws[i].tw = tw;
+		ws[i].rnd = seed * 2654435761u + i + 1;
+		ws[i].stop = &stop;
+		ws[i].op = op;
+		pthread_create(&ws[i].tid, NULL, worker_main, &ws[i]);
+	}
+	pthread_barrier_wait(&barrier);
+	start = now_ns();
+	usleep((useconds_t)(duration * 1000000));
+	stop = 1;
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(ws[i].tid, NULL);
+		ops += ws[i].ops;
+		samples_merge(lat, &ws[i].lat);
+	}
+	*secs = (now_ns() - start) / 1e9;
+	pthread_barrier_destroy(&barrier);
+	free(ws);
+	return ops;
+}
+
+static ttlmap *newmap(size_t cap)
+{
+	int i;
+	ttlmap *map;
+	if (concurrent)
+		map = ttlmap_new_concurrent(sizeof(struct kv), cap, seed, seed,
+					    kv_hash, kv_compare, NULL, NULL, NULL);
+	else if (segmented)
+		map = ttlmap_new_segmented(sizeof(struct kv), cap, seed, seed,
+					   kv_hash, kv_compare, NULL, NULL, NULL);
+	else
+		map = ttlmap_new(sizeof(struct kv), cap, seed, seed,
+				 kv_hash, kv_compare, NULL, NULL, NULL);
+	ttlmap_setslack(map, slack);
+	ttlmap_setresizers(map, resizers);
+	if (nwheels > 0) {
+		for (i = 0; i < nwheels; i++) {
+			wheels[i] = tw_new();
+			tw_runthread(wheels[i]);
+		}
+		ttlmap_setwheels(map, wheels, nwheels);
+	}
+	return map;
+}
+
+static void freemap(ttlmap *map)
+{
+	int i;
+	ttlmap_free(map);
+	for (i = 0; i < nwheels; i++)
+		tw_free(wheels[i]);
+}
+
+static void fill(ttlmap *map, size_t n, int ttl_ms)
+{
+	size_t i;
+	for (i = 0; i < n; i++)
+		ttlmap_set(map, &(struct kv){.key = i, .val = i}, ttl_ms);
+}
+
+//-----------------------------------------------------------------------------
+// workloads
+//-----------------------------------------------------------------------------
+
+static void op_mixed(struct worker *w)
+{
+	struct kv kv = {.key = nextkey(&w->rnd)};
+	if ((int)(xorshift(&w->rnd) % 100) < reads) {
+		ttlmap_get(w->map, &kv);
+	} else {
+		kv.val = w->ops;
+		ttlmap_set(w->map, &kv, 0);
+	}
+}
+
+static void bench_mixed()
+{
+	struct samples lat = {0};
+	char extra[64];
+	double secs;
+	ttlmap *map = newmap(N);
+	fill(map, N, 0);
+	uint64_t ops = run_workers(map, NULL, op_mixed, &lat, &secs);
+	snprintf(extra, sizeof(extra), "\"reads\":%d", reads);
+	report("mixed", ops, secs, &lat, extra);
+	freemap(map);
+}
+
+// bench_scale runs the mixed workload on the mutex and the concurrent engine
+// with 1, 2, 4 ... 64 threads.
+static void bench_scale()
+{
+	struct samples lat = {0};
+	char extra[96];
+	double secs;
+	int saved = nthreads, engine = concurrent;
+	uint64_t ops;
+	ttlmap *map;
+	for (concurrent = 0; concurrent < 2; concurrent++) {
+		map = newmap(N);
+		fill(map, N, 0);
+		for (nthreads = 1; nthreads <= 64; nthreads *= 2) {
+			ops = run_workers(map, NULL, op_mixed, &lat, &secs);
+			snprintf(extra, sizeof(extra), "\"reads\":%d,\"engine\":\"%s\",\"workers\":%d",
+				 reads, concurrent ? "concurrent" : "mutex", nthreads);
+			report("scale", ops, secs, &lat, extra);
+		}
+		freemap(map);
+	}
+	nthreads = saved;
+	concurrent = engine;
+}
+
+static void op_churn(struct worker *w)
+{
+	struct kv kv = {.key = nextkey(&w->rnd), .val = w->ops};
+	ttlmap_set(w->map, &kv, 1 + xorshift(&w->rnd) % ttl);
+}
+
+static void bench_churn()
+{
+	struct samples lat = {0};
+	char extra[64];
+	double secs;
+	ttlmap *map = newmap(0);
+	uint64_t ops = run_workers(map, NULL, op_churn, &lat, &secs);
+	snprintf(extra, sizeof(extra), "\"live\":%zu", ttlmap_count(map));
+	report("churn", ops, secs, &lat, extra);
+	freemap(map);
+}
+
+static void op_get(struct worker *w)
+{
+	struct kv kv = {.key = nextkey(&w->rnd)};
+	ttlmap_get(w->map, &kv);
+}
+
+// bench_expiry fills the map with items that all expire at once and measures
+// gets while the wheel reaps them. It also reports how long the reaping took.
+static void bench_expiry()
+{
+	struct samples lat = {0};
+	char extra[96];
+	double secs, saved = duration;
+	uint64_t start, reaped = 0;
+	ttlmap *map = newmap(N);
+	fill(map, N, ttl);
+	start = now_ns();
+	duration = ttl / 1000.0 + saved;
+	uint64_t ops = run_workers(map, NULL, op_get, &lat, &secs);
+	duration = saved;
+	while (ttlmap_count(map) > 0 && now_ns() - start < 60 * 1000000000ULL)
+		usleep(1000);
+	reaped = now_ns() - start;
+	snprintf(extra, sizeof(extra), "\"expired\":%zu,\"reap_ms\":%.1f",
+		 N, reaped / 1e6 - ttl);
+	report("expiry", ops, secs, &lat, extra);
+	freemap(map);
+}
+
+// bench_resize measures every set into a map that starts at the default
+// capacity, so the tail shows the cost of growing the table.
+static void bench_resize()
+{
+	struct samples lat = {0};
+	char extra[64];
+	uint64_t start, begin;
+	size_t i;
+	ttlmap *map = newmap(0);
+	begin = now_ns();
+	for (i = 0; i < N; i++) {
+		start = now_ns();
+		ttlmap_set(map, &(struct kv){.key = i, .val = i}, 0);
+		sample_add(&lat, now_ns() - start);
+	}
+	double secs = (now_ns() - begin) / 1e9;
+	snprintf(extra, sizeof(extra), "\"final_count\":%zu", ttlmap_count(map));
+	report("resize", N, secs, &lat, extra);
+	freemap(map);
+}
+
+// one cache line per thread, so the threads' sums do not share lines
+struct psum {
+	uint64_t	count;
+	uint64_t	sum;
+	char		pad[48];
+};
+
+static bool psum_iter(const void *item, void *udata)
+{
+	struct psum *p = udata;
+	p->count++;
+	p->sum += ((const struct kv *)item)->val;
+	return true;
+}
+
+static void psum_reduce(void *into, void *from)
+{
+	struct psum *a = into, *b = from;
+	a->count += b->count;
+	a->sum += b->sum;
+}
+
+// bench_pscan sums the values of all items with ttlmap_scan_parallel on 1,
+// 2, 4 ... THREADS threads. Each scan is one sample.
+static void bench_pscan()
+{
+	struct samples lat = {0};
+	struct psum *sums = aligned_alloc(64, nthreads * sizeof(struct psum));
+	void **udata = calloc(nthreads, sizeof(void *));
+	char extra[64];
+	uint64_t start, begin;
+	int n, i, rounds;
+	ttlmap *map = newmap(N);
+	fill(map, N, 0);
+	for (i = 0; i < nthreads; i++)
+		udata[i] = &sums[i];
+	for (n = 1; n <= nthreads; n *= 2) {
+		begin = now_ns();
+		for (rounds = 0; rounds == 0 || now_ns() - begin < duration * 1e9; rounds++) {
+			memset(sums, 0, nthreads * sizeof(struct psum));
+			start = now_ns();
+			ttlmap_scan_parallel(map, n, psum_iter, udata, psum_reduce);
+			sample_add(&lat, now_ns() - start);
+		}
+		snprintf(extra, sizeof(extra), "\"workers\":%d,\"items\":%llu", n,
+			 (unsigned long long)sums[0].count);
+		report("pscan", rounds, (now_ns() - begin) / 1e9, &lat, extra);
+	}
+	free(udata);
+	free(sums);
+	freemap(map);
+}
+
+// Every worker reads one of HERD_KEYS hot keys that expire after TTL ms. A
+// miss is loaded from a simulated backend that takes HERD_LOAD_US. With
+// getset every thread that misses loads the key and sets it, with load
+// ttlmap_get_or_load loads each key once per expiry.
+#define HERD_KEYS	16
+#define HERD_LOAD_US	1000
+static uint64_t herdloads;
+
+static bool herd_loader(const void *key, void *item, void *udata)
+{
+	struct kv *kv = item;
+	(void)key;
+	(void)udata;
+	__atomic_fetch_add(&herdloads, 1, __ATOMIC_RELAXED);
+	usleep(HERD_LOAD_US);
+	kv->val = kv->key;
+	return true;
+}
+
+static void op_herd_getset(struct worker *w)
+{
+	struct kv kv = {.key = xorshift(&w->rnd) % HERD_KEYS};
+	ttlmap_enter(w->map);
+	if (ttlmap_get(w->map, &kv) == NULL) {
+		herd_loader(&kv, &kv, NULL);
+		ttlmap_set(w->map, &kv, ttl);
+	}
+	ttlmap_leave(w->map);
+}
+
+static void op_herd_load(struct worker *w)
+{
+	struct kv kv = {.key = xorshift(&w->rnd) % HERD_KEYS};
+	ttlmap_enter(w->map);
+	ttlmap_get_or_load(w->map, &kv, herd_loader, NULL, ttl);
+	ttlmap_leave(w->map);
+}
+
+static void bench_herd()
+{
+	struct samples lat = {0};
+	char extra[96];
+	double secs;
+	uint64_t ops;
+	int single;
+	ttlmap *map;
+	for (single = 0; single < 2; single++) {
+		map = newmap(0);
+		herdloads = 0;
+		ops = run_workers(map, NULL, single ? op_herd_load : op_herd_getset, &lat, &secs);
+		snprintf(extra, sizeof(extra), "\"mode\":\"%s\",\"loads\":%llu",
+			 single ? "load" : "getset", (unsigned long long)herdloads);
+		report("herd", ops, secs, &lat, extra);
+		freemap(map);
+	}
+}
+
+static void nop(void *arg)
+{
+	(void)arg;
+}
+
+static void op_timer(struct worker *w)
+{
+	twtask_t *task = tw_addtask(w->tw, 1 + xorshift(&w->rnd) % (ttl * 4), nop, NULL);
+	(void)task;
+}
+
+static void bench_timer()
+{
+	struct samples lat = {0};
+	double secs;
+	timewheel_t *tw = tw_new();
+	tw_runthread(tw);
+	uint64_t ops = run_workers(NULL, tw, op_timer, &lat, &secs);
+	report("timer", ops, secs, &lat, "");
+	tw_free(tw);
+}
+
+// Every worker keeps pushing out its own share of an hour long timers, as a
+// connection keepalive would.
+#define RESET_TIMEOUT	3600000
+static twtask_t **resettasks;
+static size_t resetper;
+
+static void op_reset(struct worker *w)
+{
+	size_t i = w->id * resetper + xorshift(&w->rnd) % resetper;
+	tw_resettask(w->tw, resettasks[i], RESET_TIMEOUT);
+}
+
+static void bench_reset()
+{
+	struct samples lat = {0};
+	double secs;
+	size_t i;
+	timewheel_t *tw = tw_new();
+	tw_runthread(tw);
+	resetper = N / nthreads ? N / nthreads : 1;
+	resettasks = malloc(sizeof(twtask_t*) * resetper * nthreads);
+	for (i = 0; i < resetper * nthreads; i++)
+		resettasks[i] = tw_addtask(tw, RESET_TIMEOUT, nop, NULL);
+	uint64_t ops = run_workers(NULL, tw, op_reset, &lat, &secs);
+	report("reset", ops, secs, &lat, "");
+	tw_free(tw);
+	free(resettasks);
+}
+
+struct lateness {
+	uint64_t	due;
+	uint64_t	fired;
+};
+
+static void on_fire(void *arg)
+{
+	struct lateness *l = arg;
+	l->fired = now_ns();
+}
+
+// bench_lateness schedules timers on a 1ms wheel and compares the time they
+// fire with their deadline.
+static void bench_lateness()
+{
+	struct samples lat = {0};
+	char extra[64];
+	size_t i, n = N < 100000 ? N : 100000, missed = 0;
+	struct lateness *ls = calloc(n, sizeof(struct lateness));
+	uint64_t rnd = seed + 1, start, maxto = 0;
+	timewheel_t *tw = malloc(sizeof(timewheel_t));
+	tw_init(tw, TW_TICKSIZE_1MS);
+	tw_runthread(tw);
+	start = now_ns();
+	for (i = 0; i < n; i++) {
+		unsigned int to = 1 + xorshift(&rnd) % ttl;
+		ls[i].due = now_ns() + (uint64_t)to * 1000000;
+		if (to > maxto)
+			maxto = to;
+		tw_addtask(tw, to, on_fire, &ls[i]);
+	}
+	while (now_ns() - start < (maxto + 100) * 1000000)
+		usleep(10000);
+	for (i = 0; i < n; i++) {
+		if (ls[i].fired == 0)
+			missed++;
+		else
+			sample_add(&lat, ls[i].fired > ls[i].due ? ls[i].fired - ls[i].due : 0);
+	}
+	snprintf(extra, sizeof(extra), "\"missed\":%zu", missed);
+	report("lateness", n, (now_ns() - start) / 1e9, &lat, extra);
+	tw_free(tw);
+	free(ls);
+}
+
+struct workload {
+	const char	*name;
+	void		(*run)();
+};
+
+static struct workload workloads[] = {
+	{"mixed", bench_mixed},
+	{"scale", bench_scale},
+	{"churn", bench_churn},
+	{"expiry", bench_expiry},
+	{"resize", bench_resize},
+	{"pscan", bench_pscan},
+	{"herd", bench_herd},
+	{"timer", bench_timer},
+	{"reset", bench_reset},
+	{"lateness", bench_lateness},
+};
+
+#define NWORKLOADS	(sizeof(workloads) / sizeof(workloads[0]))
+
+int main(int argc, char *argv[])
+{
+	size_t i;
+	int j;
+
+	N = envint("N", 1000000);
+	nthreads = envint("THREADS", 4);
+	duration = envdouble("DURATION", 2);
+	reads = envint("READS", 90);
+	zipf = getenv("DIST") && strcmp(getenv("DIST"), "zipf") == 0;
+	theta = envdouble("THETA", 0.99);
+	ttl = envint("TTL", 1000);
+	seed = envint("SEED", time(NULL));
+	json = getenv("FORMAT") && strcmp(getenv("FORMAT"), "json") == 0;
+	nwheels = envint("WHEELS", 0);
+	slack = envint("SLACK", 0);
+	resizers = envint("RESIZERS", 0);
+	concurrent = getenv("ENGINE") && strcmp(getenv("ENGINE"), "concurrent") == 0;
+	segmented = getenv("ENGINE") && strcmp(getenv("ENGINE"), "segmented") == 0;
+	if (N == 0 || nthreads <= 0 || ttl <= 0) {
+		fprintf(stderr, "N, THREADS and TTL must be positive\n");
+		return 1;
+	}
+	if (nwheels < 0 || nwheels > 256) {
+		fprintf(stderr, "WHEELS must be between 0 and 256\n");
+		return 1;
+	}
+	if (zipf)
+		zipf_init(N, theta);
+	if (!json)
+		printf("seed=%u, keys=%zu, threads=%d, dist=%s\n", seed, N, nthreads,
+		       zipf ? "zipf" : "uniform");
+
+	for (i = 0; i < NWORKLOADS; i++) {
+		if (argc > 1) {
+			for (j = 1; j < argc; j++)
+				if (strcmp(argv[j], workloads[i].name) == 0)
+					break;
+			if (j == argc)
+				continue;
+		}
+		workloads[i].run();
+	}
+	return 0;
+}
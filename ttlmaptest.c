@@ -1,5 +1,9 @@
+#include <assert.h>
+#include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include "ttlmap.h"
 
 struct user
@@ -28,13 +32,17 @@ uint64_t user_hash(const void *item, uint64_t seed0, uint64_t seed1)
 	return ttlmap_sip(user->name, strlen(user->name), seed0, seed1);
 }
 
-int main()
+void example()
 {
+	// a manual wheel only moves when tw_advance is called, so the example
+	// runs at full speed. Pass NULL to expire items in real time.
+	timewheel_t *tw = tw_new_manual(TW_TICKSIZE_1MS);
+
 	// create a new hash map where each item is a `struct user`. The second
 	// argument is the initial capacity. The third and fourth arguments are
 	// optional seeds that are passed to the following hash function.
 	ttlmap *map = ttlmap_new(sizeof(struct user), 0, 0, 0,
-				 user_hash, user_compare, NULL, NULL, NULL);
+				 user_hash, user_compare, NULL, NULL, tw);
 
 	// Here we'll load some users into the hash map. Each set operation
 	// performs a copy of the data that is pointed to in the second argument.
@@ -69,18 +77,438 @@ int main()
 		printf("%s (age=%d)\n", user->name, user->age);
 	}
 
-	sleep(4);
+	tw_advance(tw, 4000);
 	printf("\n-- iterate over all users (after 4s) --\n");
 	ttlmap_scan(map, user_iter, NULL);
 	
-	sleep(3);
+	tw_advance(tw, 3000);
 	printf("\n-- iterate over all users (after 7s) --\n");
 	ttlmap_scan(map, user_iter, NULL);
 	
-	sleep(3);
+	tw_advance(tw, 3000);
 	printf("\n-- iterate over all users (after 10s) --\n");
 	ttlmap_scan(map, user_iter, NULL);
 
 	ttlmap_free(map);
+	tw_free(tw);
+}
+
+// The tests below drive the expiry timers with a manual wheel, so every
+// check happens at an exact time.
+
+struct kv {
+	uint64_t key;
+	uint64_t val;
+};
+
+int kv_compare(const void *a, const void *b, void *udata)
+{
+	const struct kv *ka = a;
+	const struct kv *kb = b;
+	return ka->key < kb->key ? -1 : ka->key > kb->key;
+}
+
+uint64_t kv_hash(const void *item, uint64_t seed0, uint64_t seed1)
+{
+	return ttlmap_murmur(item, sizeof(uint64_t), seed0, seed1);
+}
+
+// kv_map creates a map of struct kv on the engine picked by kind: hashmap
+// (0), concurrent (1) or segmented (2).
+ttlmap *kv_map(int kind, timewheel_t *tw)
+{
+	ttlmap *map;
+	switch (kind) {
+	case 0:
+		map = ttlmap_new(sizeof(struct kv), 0, 1, 2, kv_hash, kv_compare,
+				 NULL, NULL, tw);
+		break;
+	case 1:
+		map = ttlmap_new_concurrent(sizeof(struct kv), 0, 1, 2, kv_hash,
+					    kv_compare, NULL, NULL, tw);
+		break;
+	default:
+		map = ttlmap_new_segmented(sizeof(struct kv), 0, 1, 2, kv_hash,
+					   kv_compare, NULL, NULL, tw);
+		break;
+	}
+	assert(map != NULL);
+	assert(ttlmap_setkeysize(map, sizeof(uint64_t)) == 0);
+	return map;
+}
+
+// kv_val returns the value stored for key, or -1 when there is none.
+int64_t kv_val(ttlmap *map, uint64_t key)
+{
+	int64_t val;
+	ttlmap_enter(map);
+	struct kv *kv = ttlmap_get(map, &key);
+	val = kv != NULL ? (int64_t)kv->val : -1;
+	ttlmap_leave(map);
+	return val;
+}
+
+void test_expiry()
+{
+	for (int kind = 0; kind < 3; kind++) {
+		timewheel_t *tw = tw_new_manual(TW_TICKSIZE_1MS);
+		ttlmap *map = kv_map(kind, tw);
+		ttlmap_set(map, &(struct kv){1, 10}, 100);
+		ttlmap_set(map, &(struct kv){2, 20}, 0);
+		tw_advance(tw, 99);
+		assert(kv_val(map, 1) == 10);
+		assert(ttlmap_count(map) == 2);
+		tw_advance(tw, 1);
+		assert(kv_val(map, 1) == -1);
+		assert(ttlmap_count(map) == 1);
+		// an item without a ttl stays
+		tw_advance(tw, 10000);
+		assert(kv_val(map, 2) == 20);
+
+		// a timer never reaps before the deadline, even when the item
+		// was set in the middle of a coarse tick
+		timewheel_t *tw8 = tw_new_manual(TW_TICKSIZE_8MS);
+		ttlmap *map8 = kv_map(kind, tw8);
+		tw_advance(tw8, 5);
+		ttlmap_set(map8, &(struct kv){1, 10}, 12);
+		tw_advance(tw8, 11);
+		assert(ttlmap_count(map8) == 1);
+		tw_advance(tw8, 8);
+		assert(ttlmap_count(map8) == 0);
+		ttlmap_free(map8);
+		tw_free(tw8);
+		ttlmap_free(map);
+		tw_free(tw);
+	}
+}
+
+void test_rearm()
+{
+	for (int kind = 0; kind < 3; kind++) {
+		timewheel_t *tw = tw_new_manual(TW_TICKSIZE_1MS);
+		ttlmap *map = kv_map(kind, tw);
+		// a new ttl replaces the old one: the first timer leaves the item
+		ttlmap_set(map, &(struct kv){1, 10}, 100);
+		tw_advance(tw, 50);
+		ttlmap_set(map, &(struct kv){1, 11}, 100);
+		tw_advance(tw, 50);
+		assert(kv_val(map, 1) == 11);
+		tw_advance(tw, 50);
+		assert(kv_val(map, 1) == -1);
+		assert(ttlmap_count(map) == 0);
+
+		// and so does a shorter one
+		ttlmap_set(map, &(struct kv){2, 20}, 100);
+		ttlmap_set(map, &(struct kv){2, 21}, 10);
+		tw_advance(tw, 10);
+		assert(ttlmap_count(map) == 0);
+
+		// a set without a ttl keeps the item for good
+		ttlmap_set(map, &(struct kv){3, 30}, 10);
+		ttlmap_set(map, &(struct kv){3, 31}, 0);
+		tw_advance(tw, 100);
+		assert(kv_val(map, 3) == 31);
+		ttlmap_free(map);
+		tw_free(tw);
+	}
+}
+
+void test_cancel()
+{
+	for (int kind = 0; kind < 3; kind++) {
+		timewheel_t *tw = tw_new_manual(TW_TICKSIZE_1MS);
+		ttlmap *map = kv_map(kind, tw);
+		// the timer of a deleted item must not remove the key set again
+		ttlmap_set(map, &(struct kv){1, 10}, 100);
+		ttlmap_enter(map);
+		assert(ttlmap_delete(map, &(uint64_t){1}) != NULL);
+		ttlmap_leave(map);
+		assert(ttlmap_count(map) == 0);
+		ttlmap_set(map, &(struct kv){1, 11}, 0);
+		tw_advance(tw, 200);
+		assert(kv_val(map, 1) == 11);
+
+		// clearing the map disarms its timers as well
+		ttlmap_set(map, &(struct kv){2, 20}, 100);
+		ttlmap_clear(map, false);
+		ttlmap_set(map, &(struct kv){2, 21}, 0);
+		tw_advance(tw, 200);
+		assert(kv_val(map, 2) == 21);
+
+		// pending timers go with a freed map
+		ttlmap_set(map, &(struct kv){3, 30}, 100);
+		ttlmap_free(map);
+		tw_advance(tw, 200);
+		tw_free(tw);
+	}
+}
+
+// kv_load loads the snapshot at path and checks its count.
+ttlmap *kv_load(const char *path, timewheel_t *tw, size_t count)
+{
+	ttlmap *map = ttlmap_load(path, kv_hash, kv_compare, NULL, NULL, tw);
+	assert(map != NULL);
+	assert(ttlmap_count(map) == count);
+	return map;
+}
+
+void test_persist()
+{
+	char path[] = "/tmp/ttlmaptest.XXXXXX";
+	char logpath[] = "/tmp/ttlmaptest.log.XXXXXX";
+	char logpath2[] = "/tmp/ttlmaptest.log.XXXXXX";
+	int fd = mkstemp(path);
+	int logfd = mkstemp(logpath);
+	int logfd2 = mkstemp(logpath2);
+	assert(fd >= 0 && logfd >= 0 && logfd2 >= 0);
+	close(fd);
+
+	timewheel_t *tw = tw_new_manual(TW_TICKSIZE_1MS);
+	ttlmap *map = kv_map(0, tw);
+	// with slack the timer of item 2 fires well after its deadline, so it
+	// is saved expired but not reaped
+	ttlmap_setslack(map, 100);
+	ttlmap_set(map, &(struct kv){1, 10}, 0);
+	ttlmap_set(map, &(struct kv){2, 20}, 1000);
+	ttlmap_set(map, &(struct kv){3, 30}, 60000);
+	tw_advance(tw, 1001);
+	assert(ttlmap_count(map) == 3 && kv_val(map, 2) == -1);
+	assert(ttlmap_save(map, path) == 0);
+
+	// expired items are dropped on load, the others keep their ttl
+	ttlmap *loaded = kv_load(path, tw, 2);
+	assert(kv_val(loaded, 1) == 10);
+	assert(kv_val(loaded, 3) == 30);
+	tw_advance(tw, 58000);
+	assert(kv_val(loaded, 3) == 30);
+	tw_advance(tw, 2000);
+	assert(ttlmap_count(loaded) == 1);
+	ttlmap_free(loaded);
+	ttlmap_free(map);
+	tw_free(tw);
+
+	// a log written after the snapshot brings a loaded map up to date
+	tw = tw_new_manual(TW_TICKSIZE_1MS);
+	map = kv_map(0, tw);
+	ttlmap_set(map, &(struct kv){1, 10}, 0);
+	ttlmap_set(map, &(struct kv){2, 20}, 0);
+	ttlmap_set(map, &(struct kv){3, 30}, 0);
+	assert(ttlmap_save(map, path) == 0);
+	assert(ttlmap_log_open(map, logfd, 0, 0) == 0);
+	ttlmap_set(map, &(struct kv){2, 21}, 0);
+	ttlmap_set(map, &(struct kv){4, 40}, 60000);
+	ttlmap_set(map, &(struct kv){5, 50}, 100);
+	ttlmap_delete(map, &(uint64_t){1});
+	tw_advance(tw, 100);
+	assert(kv_val(map, 5) == -1);
+	assert(ttlmap_log_close(map) == 0);
+	assert(lseek(logfd, 0, SEEK_SET) == 0);
+	loaded = kv_load(path, tw, 3);
+	// set 2, set 4, set 5, delete 1 and expire 5
+	assert(ttlmap_replay(loaded, logfd) == 5);
+	assert(ttlmap_count(loaded) == 3);
+	assert(kv_val(loaded, 1) == -1);
+	assert(kv_val(loaded, 2) == 21);
+	assert(kv_val(loaded, 3) == 30);
+	assert(kv_val(loaded, 4) == 40);
+	assert(kv_val(loaded, 5) == -1);
+	// the replayed ttl is armed on the loaded map
+	tw_advance(tw, 60000);
+	assert(kv_val(loaded, 4) == -1);
+	// records the map has already seen are skipped
+	assert(lseek(logfd, 0, SEEK_SET) == 0);
+	assert(ttlmap_replay(loaded, logfd) == 0);
+	ttlmap_free(loaded);
+
+	// a clear record drops what came before it
+	assert(ttlmap_log_open(map, logfd2, 0, 0) == 0);
+	ttlmap_set(map, &(struct kv){6, 60}, 0);
+	ttlmap_clear(map, false);
+	ttlmap_set(map, &(struct kv){7, 70}, 0);
+	assert(ttlmap_log_close(map) == 0);
+	assert(lseek(logfd2, 0, SEEK_SET) == 0);
+	loaded = kv_load(path, tw, 3);
+	assert(ttlmap_replay(loaded, logfd2) == 3);
+	assert(ttlmap_count(loaded) == 1);
+	assert(kv_val(loaded, 7) == 70);
+	ttlmap_free(loaded);
+	ttlmap_free(map);
+	tw_free(tw);
+
+	close(logfd);
+	close(logfd2);
+	unlink(logpath);
+	unlink(logpath2);
+	unlink(path);
+}
+
+// corrupt_at saves a small map to path and overwrites len bytes of it at
+// off, or cuts the file to off bytes when data is NULL.
+void corrupt_at(const char *path, off_t off, const void *data, size_t len)
+{
+	timewheel_t *tw = tw_new_manual(TW_TICKSIZE_1MS);
+	ttlmap *map = kv_map(0, tw);
+	for (uint64_t i = 0; i < 100; i++)
+		ttlmap_set(map, &(struct kv){i, i}, 0);
+	assert(ttlmap_save(map, path) == 0);
+	ttlmap_free(map);
+	tw_free(tw);
+	if (data == NULL) {
+		assert(truncate(path, off) == 0);
+		return;
+	}
+	FILE *f = fopen(path, "r+b");
+	assert(f != NULL);
+	assert(fseek(f, off, SEEK_SET) == 0);
+	assert(fwrite(data, 1, len, f) == len);
+	fclose(f);
+}
+
+void test_badfile()
+{
+	char path[] = "/tmp/ttlmaptest.XXXXXX";
+	int fd = mkstemp(path);
+	assert(fd >= 0);
+	close(fd);
+	timewheel_t *tw = tw_new_manual(TW_TICKSIZE_1MS);
+	uint64_t huge = UINT64_MAX / 2, zero = 0;
+	// offsets into the header ttlmap_save writes: the magic, the bucket
+	// count and the key size
+	struct {
+		off_t off;
+		const void *data;
+		size_t len;
+	} cases[] = {
+		{ 0, NULL, 0 },			// empty file
+		{ 64, NULL, 0 },		// cut inside the header
+		{ 4096 + 8, NULL, 0 },		// cut inside the buckets
+		{ 0, "TTLMAQ", 6 },		// bad magic
+		{ 40, &huge, sizeof(huge) },	// bucket array out of bounds
+		{ 40, &zero, sizeof(zero) },	// no buckets
+		{ 96, &zero, sizeof(zero) },	// no key
+	};
+	// rewriting the magic as it is leaves a file that loads
+	corrupt_at(path, 0, "TTLMAP", 6);
+	ttlmap_free(kv_load(path, tw, 100));
+	for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+		corrupt_at(path, cases[i].off, cases[i].data, cases[i].len);
+		errno = 0;
+		assert(ttlmap_load(path, kv_hash, kv_compare, NULL, NULL, tw) == NULL);
+		assert(errno == EINVAL);
+	}
+	tw_free(tw);
+	unlink(path);
+}
+
+// get_or_load test: GL_THREADS threads ask for the same GL_KEYS keys at once.
+#define GL_THREADS	8
+#define GL_KEYS		4
+
+struct gl {
+	ttlmap	*map;
+	int	fail;
+	int	arrived;
+	int	loads[GL_KEYS];
+	int64_t	got[GL_THREADS][GL_KEYS];
+};
+
+struct gl_thread {
+	struct gl	*gl;
+	int		id;
+};
+
+bool gl_loader(const void *key, void *item, void *udata)
+{
+	struct gl *gl = udata;
+	uint64_t k = *(const uint64_t*)key;
+	__atomic_fetch_add(&gl->loads[k], 1, __ATOMIC_RELAXED);
+	// hold the load until every thread is in, so that the others wait
+	while (__atomic_load_n(&gl->arrived, __ATOMIC_ACQUIRE) < GL_THREADS)
+		usleep(1000);
+	usleep(10000);
+	((struct kv*)item)->val = k * 10;
+	return !gl->fail;
+}
+
+void *gl_run(void *arg)
+{
+	struct gl_thread *t = arg;
+	struct gl *gl = t->gl;
+	__atomic_fetch_add(&gl->arrived, 1, __ATOMIC_RELEASE);
+	for (int j = 0; j < GL_KEYS; j++) {
+		uint64_t k = (t->id + j) % GL_KEYS;
+		ttlmap_enter(gl->map);
+		struct kv *kv = ttlmap_get_or_load(gl->map, &k, gl_loader, gl, 0);
+		gl->got[t->id][k] = kv != NULL ? (int64_t)kv->val : -1;
+		ttlmap_leave(gl->map);
+	}
+	return NULL;
+}
+
+void gl_herd(struct gl *gl)
+{
+	pthread_t threads[GL_THREADS];
+	struct gl_thread args[GL_THREADS];
+	gl->arrived = 0;
+	memset(gl->loads, 0, sizeof(gl->loads));
+	for (int i = 0; i < GL_THREADS; i++) {
+		args[i].gl = gl;
+		args[i].id = i;
+		assert(pthread_create(&threads[i], NULL, gl_run, &args[i]) == 0);
+	}
+	for (int i = 0; i < GL_THREADS; i++)
+		pthread_join(threads[i], NULL);
+}
+
+void test_get_or_load()
+{
+	for (int kind = 0; kind < 3; kind++) {
+		timewheel_t *tw = tw_new_manual(TW_TICKSIZE_1MS);
+		struct gl gl = { .map = kv_map(kind, tw) };
+
+		// the loader runs once per key and every caller gets its item
+		gl_herd(&gl);
+		for (int k = 0; k < GL_KEYS; k++) {
+			assert(gl.loads[k] == 1);
+			for (int i = 0; i < GL_THREADS; i++)
+				assert(gl.got[i][k] == k * 10);
+		}
+		assert(ttlmap_count(gl.map) == GL_KEYS);
+		ttlmap_clear(gl.map, false);
+
+		// a failed load wakes its waiters with NULL and takes the
+		// placeholder out again
+		gl.fail = 1;
+		gl_herd(&gl);
+		for (int k = 0; k < GL_KEYS; k++) {
+			assert(gl.loads[k] >= 1);
+			for (int i = 0; i < GL_THREADS; i++)
+				assert(gl.got[i][k] == -1);
+		}
+		assert(ttlmap_count(gl.map) == 0);
+
+		// so the next caller loads the key again
+		gl.fail = 0;
+		gl_herd(&gl);
+		for (int k = 0; k < GL_KEYS; k++) {
+			assert(gl.loads[k] == 1);
+			for (int i = 0; i < GL_THREADS; i++)
+				assert(gl.got[i][k] == k * 10);
+		}
+		ttlmap_free(gl.map);
+		tw_free(tw);
+	}
+}
+
+int main()
+{
+	example();
+	test_expiry();
+	test_rearm();
+	test_cancel();
+	test_persist();
+	test_badfile();
+	test_get_or_load();
+	printf("\nPASSED\n");
 	return 0;
 }
\ No newline at end of file
@@ -1,3 +1,4 @@
+#include <assert.h>
 #include <unistd.h>
 #include <sys/time.h>
 #include "timewheel.h"
@@ -33,7 +34,127 @@ void counttask(void *arg)
 	return;
 }
 
-int main()
+// The tests below run on a manual wheel, so they take no wall-clock time and
+// every tick fires exactly when tw_advance passes it.
+
+void firetask(void *arg)
+{
+	(*(int*)arg)++;
+}
+
+struct selfcancel {
+	timewheel_t	*tw;
+	twhandle_t	handle;
+	int		ret;
+};
+
+void selfcanceltask(void *arg)
+{
+	struct selfcancel *sc = arg;
+	sc->ret = tw_cancel(sc->tw, sc->handle);
+}
+
+void test_expiry()
+{
+	timewheel_t *w = tw_new_manual(TW_TICKSIZE_1MS);
+	int fired = 0;
+	assert(tw_addtask(w, 50, firetask, &fired) != NULL);
+	tw_advance(w, 49);
+	assert(fired == 0);
+	tw_advance(w, 1);
+	assert(fired == 1);
+	tw_advance(w, 100);
+	assert(fired == 1);
+
+	// a periodic task fires once per period until it is cancelled
+	fired = 0;
+	twtask_t *task = tw_addtask(w, 10, firetask, &fired);
+	tw_settaskperiod(w, task, 10);
+	tw_advance(w, 30);
+	assert(fired == 3);
+	tw_canceltask(task);
+	tw_advance(w, 30);
+	assert(fired == 3);
+
+	// coarser ticks round a timeout up, never down
+	timewheel_t *w8 = tw_new_manual(TW_TICKSIZE_8MS);
+	fired = 0;
+	tw_add(w8, 12, firetask, &fired);
+	tw_advance(w8, 8);
+	assert(fired == 0);
+	tw_advance(w8, 8);
+	assert(fired == 1);
+	tw_free(w8);
+	tw_free(w);
+}
+
+void test_rearm()
+{
+	timewheel_t *w = tw_new_manual(TW_TICKSIZE_1MS);
+	int fired = 0;
+	twhandle_t handle = tw_add(w, 50, firetask, &fired);
+	assert(handle != TW_HANDLE_INVALID);
+	tw_advance(w, 30);
+	assert(tw_reschedule(w, handle, 50) == 0);
+	tw_advance(w, 49);
+	assert(fired == 0);
+	tw_advance(w, 1);
+	assert(fired == 1);
+	assert(tw_reschedule(w, handle, 50) == -1);
+
+	// pulling a deadline in moves the task as well
+	fired = 0;
+	handle = tw_add(w, 100, firetask, &fired);
+	assert(tw_reschedule(w, handle, 10) == 0);
+	tw_advance(w, 10);
+	assert(fired == 1);
+
+	fired = 0;
+	twtask_t *task = tw_addtask(w, 20, firetask, &fired);
+	tw_advance(w, 10);
+	assert(tw_resettask(w, task, 20) == 0);
+	tw_advance(w, 19);
+	assert(fired == 0);
+	tw_advance(w, 1);
+	assert(fired == 1);
+	tw_free(w);
+}
+
+void test_cancel()
+{
+	timewheel_t *w = tw_new_manual(TW_TICKSIZE_1MS);
+	int fired = 0;
+	twhandle_t handle = tw_add(w, 50, firetask, &fired);
+	tw_advance(w, 20);
+	assert(tw_cancel(w, handle) == 0);
+	tw_advance(w, 100);
+	assert(fired == 0);
+	assert(tw_cancel(w, handle) == -1);
+
+	// a handle goes stale once its task fired
+	handle = tw_add(w, 10, firetask, &fired);
+	tw_advance(w, 10);
+	assert(fired == 1);
+	assert(tw_cancel(w, handle) == -1);
+
+	// cancelling from the task's own callback is too late
+	struct selfcancel sc = { w, TW_HANDLE_INVALID, -2 };
+	sc.handle = tw_add(w, 10, selfcanceltask, &sc);
+	tw_advance(w, 10);
+	assert(sc.ret == 1);
+	assert(tw_cancel(w, sc.handle) == -1);
+
+	fired = 0;
+	twtask_t *task = tw_addtask(w, 10, firetask, &fired);
+	tw_canceltask(task);
+	tw_advance(w, 20);
+	assert(fired == 0);
+	tw_free(w);
+}
+
+// demo runs tasks on a real-time wheel and prints them as they fire. It
+// does not return.
+int demo()
 {
 	tw_init(&tw, TW_TICKSIZE_1MS);
 	pthread_t twpid = tw_runthread(&tw);
@@ -60,4 +181,15 @@ int main()
 		}
 	}
 	return 0;
-}
\ No newline at end of file
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc > 1 && strcmp(argv[1], "demo") == 0)
+		return demo();
+	test_expiry();
+	test_rearm();
+	test_cancel();
+	printf("PASSED\n");
+	return 0;
+}